@@ -5,64 +5,76 @@
 #include "rtweekend.h"
 #include "hittable.h"
 
-class xy_rect : public hittable {
+class xy_rect final : public hittable {
 public:
-	double x0, y0, x1, y1, k;
+	real x0, y0, x1, y1, k;
 	shared_ptr<material> mp;
 public:
-	xy_rect() {}
-	xy_rect(double _x0, double _x1, double _y0, double _y1, double _k,
+	xy_rect() : hittable(hittable_kind::xy_rect) {}
+	xy_rect(real _x0, real _x1, real _y0, real _y1, real _k,
 		shared_ptr<material> mat) 
-	: x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat)
+	: hittable(hittable_kind::xy_rect), x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat)
 	{}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
 		output_box = aabb(point3(x0, y0, k - 0.0001), point3(x1, y1, k + 0.0001));
 		return true;
 	}
+
+	virtual const material* surface_material() const override { return mp.get(); }
+	virtual real pdf_value(const point3& o, const vec3& v) const override;
+	virtual vec3 random(const point3& o) const override;
 };
 
-class xz_rect : public hittable {
+class xz_rect final : public hittable {
 public:
-	double x0, z0, x1, z1, k;
+	real x0, z0, x1, z1, k;
 	shared_ptr<material> mp;
 public:
-	xz_rect() {}
-	xz_rect(double _x0, double _x1, double _z0, double _z1, double _k,
+	xz_rect() : hittable(hittable_kind::xz_rect) {}
+	xz_rect(real _x0, real _x1, real _z0, real _z1, real _k,
 		shared_ptr<material> mat)
-		: x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat)
+		: hittable(hittable_kind::xz_rect), x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat)
 	{}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
 		output_box = aabb(point3(x0, k - 0.0001, z0), point3(x1, k + 0.0001, z1));
 		return true;
 	}
+
+	virtual const material* surface_material() const override { return mp.get(); }
+	virtual real pdf_value(const point3& o, const vec3& v) const override;
+	virtual vec3 random(const point3& o) const override;
 };
 
-class yz_rect : public hittable {
+class yz_rect final : public hittable {
 public:
-	double y0, z0, y1, z1, k;
+	real y0, z0, y1, z1, k;
 	shared_ptr<material> mp;
 public:
-	yz_rect() {}
-	yz_rect(double _y0, double _y1, double _z0, double _z1, double _k,
+	yz_rect() : hittable(hittable_kind::yz_rect) {}
+	yz_rect(real _y0, real _y1, real _z0, real _z1, real _k,
 		shared_ptr<material> mat)
-		: y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat)
+		: hittable(hittable_kind::yz_rect), y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat)
 	{}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
 		output_box = aabb(point3(k - 0.0001,y0, z0), point3(k + 0.0001, y1, z1));
 		return true;
 	}
+
+	virtual const material* surface_material() const override { return mp.get(); }
+	virtual real pdf_value(const point3& o, const vec3& v) const override;
+	virtual vec3 random(const point3& o) const override;
 };
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xy_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	auto t = (k - r.origin().z()) / r.direction().z();
 
 	if (t < t_min || t > t_max)
@@ -80,13 +92,14 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 	
 	auto outward_normal = vec3(0, 0, 1);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
+	rec.obj = this;
 	rec.p = r.at(t);
 
 	return true;
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	auto t = (k - r.origin().y()) / r.direction().y();
 
 	if (t < t_min || t > t_max)
@@ -104,13 +117,14 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
 	auto outward_normal = vec3(0, 1, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
+	rec.obj = this;
 	rec.p = r.at(t);
 
 	return true;
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool yz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	auto t = (k - r.origin().x()) / r.direction().x();
 
 	if (t < t_min || t > t_max)
@@ -128,10 +142,52 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
 	auto outward_normal = vec3(1, 0, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
+	rec.obj = this;
 	rec.p = r.at(t);
 
 	return true;
 }
 
+// Area lights: convert the uniform area density to solid angle at o.
+inline real rect_pdf_value(const hittable& rect, real area, const point3& o, const vec3& v) {
+	hit_record rec;
+	if (!rect.hit(ray(o, v), 0.001, infinity, rec))
+		return 0;
+
+	auto distance_squared = rec.t * rec.t * v.length_squared();
+	auto cosine = fabs(dot(v, rec.normal) / v.length());
+	if (cosine <= 0)
+		return 0;
+
+	return distance_squared / (cosine * area);
+}
+
+real xy_rect::pdf_value(const point3& o, const vec3& v) const {
+	return rect_pdf_value(*this, (x1 - x0) * (y1 - y0), o, v);
+}
+
+vec3 xy_rect::random(const point3& o) const {
+	auto random_point = point3(random_double(x0, x1), random_double(y0, y1), k);
+	return random_point - o;
+}
+
+real xz_rect::pdf_value(const point3& o, const vec3& v) const {
+	return rect_pdf_value(*this, (x1 - x0) * (z1 - z0), o, v);
+}
+
+vec3 xz_rect::random(const point3& o) const {
+	auto random_point = point3(random_double(x0, x1), k, random_double(z0, z1));
+	return random_point - o;
+}
+
+real yz_rect::pdf_value(const point3& o, const vec3& v) const {
+	return rect_pdf_value(*this, (y1 - y0) * (z1 - z0), o, v);
+}
+
+vec3 yz_rect::random(const point3& o) const {
+	auto random_point = point3(k, random_double(y0, y1), random_double(z0, z1));
+	return random_point - o;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,296 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <typeindex>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOGDI
+#define NOGDI
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "util.h"
+
+using std::shared_ptr;
+
+class hittable;
+class material;
+class texture;
+
+enum class arena_category {
+	primitive,
+	material,
+	texture,
+	acceleration,
+	volume,
+	other,
+	count
+};
+
+// Which bucket an object type is reported under. Specialize for types that
+// derive from one of the base classes but belong elsewhere (e.g. bvh_node).
+template <typename T>
+struct arena_category_of {
+	static constexpr arena_category value =
+		std::is_base_of<hittable, T>::value ? arena_category::primitive
+		: std::is_base_of<material, T>::value ? arena_category::material
+		: std::is_base_of<texture, T>::value ? arena_category::texture
+		: arena_category::other;
+};
+
+// Owns every object of a scene. Objects of the same type are bump allocated
+// next to each other in large blocks (optionally backed by huge pages), and the
+// whole scene is torn down at once when the arena is destroyed.
+//
+// make<T>() returns a non-owning shared_ptr (no control block, no refcount
+// traffic), so the arena must outlive everything built from it.
+class scene_arena {
+public:
+	explicit scene_arena(bool use_huge_pages = false);
+	~scene_arena();
+
+	scene_arena(const scene_arena&) = delete;
+	scene_arena& operator=(const scene_arena&) = delete;
+
+	template <typename T, typename... Args>
+	shared_ptr<T> make(Args&&... args);
+
+	// n value-initialized Ts for the bulk data of a scene object, e.g. a
+	// voxel grid, reported under c. They are never destroyed, so T must be
+	// trivially destructible.
+	template <typename T>
+	T* make_array(size_t n, arena_category c);
+
+	size_t bytes_used(arena_category c) const { return used[static_cast<int>(c)]; }
+	size_t bytes_reserved() const { return reserved; }
+	bool huge_pages() const { return huge_pages_backed; }
+
+	void report() const;
+
+private:
+	struct block {
+		unsigned char* data;
+		size_t size;
+		bool mapped;
+	};
+
+	struct pool {
+		std::vector<block> blocks;
+		size_t offset = 0;
+		size_t objects = 0;
+		arena_category category = arena_category::other;
+	};
+
+	struct destructor_entry {
+		void* object;
+		void (*destroy)(void*);
+	};
+
+	void* allocate(pool& p, size_t size, size_t alignment);
+	block allocate_block(size_t size);
+	void free_block(const block& b);
+
+	std::unordered_map<std::type_index, pool> pools;
+	std::vector<destructor_entry> destructors;
+
+	bool use_huge;
+	bool huge_pages_backed = false;
+	size_t block_size;
+	size_t reserved = 0;
+	size_t used[static_cast<int>(arena_category::count)] = {};
+};
+
+// Allocate from the arena when there is one, fall back to the heap otherwise.
+template <typename T, typename... Args>
+shared_ptr<T> arena_make(scene_arena* arena, Args&&... args) {
+	if (arena) return arena->make<T>(std::forward<Args>(args)...);
+	return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+const size_t arena_small_block = 64 * 1024;
+const size_t arena_huge_block = 2 * 1024 * 1024;
+
+scene_arena::scene_arena(bool use_huge_pages)
+	: use_huge(use_huge_pages),
+	block_size(use_huge_pages ? arena_huge_block : arena_small_block) {}
+
+scene_arena::~scene_arena() {
+	// Objects reference each other freely, so run every destructor before any
+	// memory is returned.
+	for (auto it = destructors.rbegin(); it != destructors.rend(); ++it) {
+		it->destroy(it->object);
+	}
+
+	for (auto& [type, p] : pools) {
+		for (const auto& b : p.blocks) {
+			free_block(b);
+		}
+	}
+}
+
+template <typename T, typename... Args>
+shared_ptr<T> scene_arena::make(Args&&... args) {
+	auto& p = pools[std::type_index(typeid(T))];
+	p.category = arena_category_of<T>::value;
+
+	void* mem = allocate(p, sizeof(T), alignof(T));
+	T* obj = new (mem) T(std::forward<Args>(args)...);
+
+	p.objects++;
+	used[static_cast<int>(p.category)] += sizeof(T);
+
+	if constexpr (!std::is_trivially_destructible<T>::value) {
+		destructors.push_back({ obj, [](void* o) { static_cast<T*>(o)->~T(); } });
+	}
+
+	// Aliasing an empty shared_ptr gives a plain pointer in shared_ptr clothing.
+	return shared_ptr<T>(shared_ptr<void>(), obj);
+}
+
+template <typename T>
+T* scene_arena::make_array(size_t n, arena_category c) {
+	static_assert(std::is_trivially_destructible<T>::value, "arena arrays are never destroyed");
+
+	// Arrays get their own pool, apart from single Ts.
+	auto& p = pools[std::type_index(typeid(T*))];
+	p.category = c;
+
+	auto data = static_cast<T*>(allocate(p, sizeof(T) * n, alignof(T)));
+	std::uninitialized_value_construct_n(data, n);
+
+	p.objects++;
+	used[static_cast<int>(c)] += sizeof(T) * n;
+	return data;
+}
+
+void* scene_arena::allocate(pool& p, size_t size, size_t alignment) {
+	if (!p.blocks.empty()) {
+		auto& b = p.blocks.back();
+		size_t start = (p.offset + alignment - 1) & ~(alignment - 1);
+		if (start + size <= b.size) {
+			p.offset = start + size;
+			return b.data + start;
+		}
+	}
+
+	size_t size_needed = size + alignment;
+	size_t bsize = size_needed > block_size ? size_needed : block_size;
+	p.blocks.push_back(allocate_block(bsize));
+
+	auto& b = p.blocks.back();
+	size_t start = (reinterpret_cast<uintptr_t>(b.data) % alignment) == 0 ? 0
+		: alignment - reinterpret_cast<uintptr_t>(b.data) % alignment;
+	p.offset = start + size;
+	return b.data + start;
+}
+
+scene_arena::block scene_arena::allocate_block(size_t size) {
+	block b{ nullptr, size, false };
+
+	if (use_huge) {
+		size = (size + arena_huge_block - 1) & ~(arena_huge_block - 1);
+		b.size = size;
+#if defined(_WIN32)
+		size_t large_page = GetLargePageMinimum();
+		if (large_page != 0 && size % large_page == 0) {
+			b.data = static_cast<unsigned char*>(VirtualAlloc(
+				nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE));
+			if (b.data) {
+				huge_pages_backed = true;
+			}
+		}
+		if (!b.data) {
+			b.data = static_cast<unsigned char*>(VirtualAlloc(
+				nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+		}
+		b.mapped = b.data != nullptr;
+#elif defined(__linux__)
+		void* m = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (m != MAP_FAILED) {
+			huge_pages_backed = true;
+		}
+		else {
+			// No reserved huge pages, ask for transparent ones instead.
+			m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (m != MAP_FAILED && madvise(m, size, MADV_HUGEPAGE) == 0) {
+				huge_pages_backed = true;
+			}
+		}
+		if (m != MAP_FAILED) {
+			b.data = static_cast<unsigned char*>(m);
+			b.mapped = true;
+		}
+#endif
+	}
+
+	if (!b.data) {
+		b.data = static_cast<unsigned char*>(::operator new(size, std::align_val_t(64)));
+		b.mapped = false;
+	}
+
+	reserved += b.size;
+	return b;
+}
+
+void scene_arena::free_block(const block& b) {
+	if (b.mapped) {
+#if defined(_WIN32)
+		VirtualFree(b.data, 0, MEM_RELEASE);
+#elif defined(__linux__)
+		munmap(b.data, b.size);
+#endif
+	}
+	else {
+		::operator delete(b.data, std::align_val_t(64));
+	}
+}
+
+void scene_arena::report() const {
+	static const char* names[] = { "primitives", "materials", "textures", "acceleration", "volumes", "other" };
+
+	size_t objects[static_cast<int>(arena_category::count)] = {};
+	size_t types[static_cast<int>(arena_category::count)] = {};
+	for (const auto& [type, p] : pools) {
+		objects[static_cast<int>(p.category)] += p.objects;
+		types[static_cast<int>(p.category)]++;
+	}
+
+	size_t total = 0;
+	for (int c = 0; c < static_cast<int>(arena_category::count); c++) {
+		if (objects[c] == 0) continue;
+
+		std::stringstream ss;
+		ss << "Scene memory " << names[c] << ": " << used[c] / 1024.0 << " KB in "
+			<< objects[c] << " objects (" << types[c] << " types)";
+		LOG(LOG_TYPE::INFO, ss.str());
+		total += used[c];
+	}
+
+	std::stringstream ss;
+	ss << "Scene memory total: " << total / 1024.0 << " KB used, "
+		<< reserved / 1024.0 << " KB reserved"
+		<< (huge_pages_backed ? " (huge pages)" : "");
+	LOG(LOG_TYPE::INFO, ss.str());
+}
+
+#endif
@@ -0,0 +1,619 @@
+#ifndef BDPT_H
+#define BDPT_H
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "dispatch.h"
+#include "lights.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "onb.h"
+#include "denoiser.h"
+
+// Light that reaches pixels through light tracing. Paths started at any
+// pixel can land anywhere on the film, so all threads add into one buffer.
+class splat_buffer {
+public:
+	splat_buffer(int width, int height) : width(width), height(height), values(size_t(3) * width * height, 0) {}
+
+	void add(int x, int y, const color& c) {
+		auto v = &values[3 * (size_t(y) * width + x)];
+		for (int a = 0; a < 3; a++) {
+			std::atomic_ref<real>(v[a]).fetch_add(c[a], std::memory_order_relaxed);
+		}
+	}
+
+	color at(int x, int y) const {
+		auto v = &values[3 * (size_t(y) * width + x)];
+		return color(v[0], v[1], v[2]);
+	}
+
+private:
+	int width, height;
+	std::vector<real> values;
+};
+
+// One vertex of a camera or light subpath. Densities are per unit area at
+// the vertex: pdf_fwd for being sampled by the subpath that reached it,
+// pdf_rev for being sampled from the other end.
+struct bdpt_vertex {
+	enum class type : unsigned char { camera, light, surface, medium };
+
+	type kind = type::surface;
+	point3 p;
+	vec3 n;                           // outward geometric normal, zero in media and at the camera
+	hit_record rec;                   // surfaces and media
+	ray in;                           // ray that arrived here
+	const hittable* light = nullptr;  // light vertices
+	color beta;
+	real pdf_fwd = 0;
+	real pdf_rev = 0;
+	bool delta = false;               // specular scattering, can't be connected to
+
+	bool on_surface() const { return kind == type::surface; }
+};
+
+// Bidirectional path tracing (Veach, pbrt's BDPT): every pixel sample
+// traces a camera subpath and a light subpath and connects each prefix of
+// one to each prefix of the other, weighting all ways a path could have been
+// built with the power heuristic. Connections to the camera (light tracing)
+// are splatted into a shared buffer. This finds caustics through glass onto
+// diffuse surfaces that a path tracer only gets by chance.
+//
+// Lights are the spheres and rects of the scene's light list. Background and
+// environment light and emitters BDPT can't sample are only found by the
+// camera subpath, light tracing needs a pinhole camera, and the global
+// medium is not supported.
+class bdpt_integrator {
+public:
+	bdpt_integrator(const hittable& world, const scene_lights& lights, const camera& cam,
+		const color& background, int image_width, int image_height, int max_depth);
+
+	// Radiance along the camera ray r; light tracing contributions go to splats.
+	color li(const ray& r, splat_buffer& splats, pixel_features* features) const;
+
+	int sampled_light_count() const { return emitters.count(); }
+
+private:
+	using vertex = bdpt_vertex;
+
+	int camera_subpath(const ray& r, vertex* path, color& escaped) const;
+	int light_subpath(real time, vertex* path) const;
+	int walk(ray r, color beta, real pdf_dir, int max_vertices, vertex* path, color* escaped) const;
+
+	color connect(vertex* light_path, vertex* camera_path, int s, int t,
+		splat_buffer& splats, real time) const;
+	real mis_weight(vertex* light_path, vertex* camera_path, const vertex& sampled, int s, int t) const;
+
+	// Light vertices.
+	bool sample_light(const hittable& light, vertex& v) const;
+	bool sample_light(const hittable& light, const point3& ref, vertex& v, real& pdf_area) const;
+	color emitted(const vertex& v, const vec3& w) const;
+	bool is_emitter(const vertex& v) const;
+
+	// Densities, see bdpt_vertex.
+	real convert_density(real pdf_dir, const vertex& from, const vertex& to) const;
+	real pdf(const vertex& v, const vertex* prev, const vertex& next) const;
+	real pdf_light(const vertex& v, const vertex& next) const;
+	real pdf_light_origin(const vertex& v) const;
+	real camera_pdf(const vec3& w) const;
+
+	color f(const vertex& v, const vec3& to_prev, const vec3& to_next) const;
+	real cosine(const vertex& v, const vec3& w) const;
+	bool visible(const vertex& a, const vertex& b, real time) const;
+	bool film_pixel(const point3& p, int& x, int& y) const;
+
+	const hittable& world;
+	const scene_lights& lights;
+	camera cam;
+	color background;
+	int width, height;
+	int max_depth;
+	// Film area at unit distance from the pinhole, as covered by get_ray.
+	real film_area;
+	bool light_tracing;
+
+	emitter_distribution emitters;
+};
+
+bdpt_integrator::bdpt_integrator(const hittable& world, const scene_lights& lights, const camera& cam,
+	const color& background, int image_width, int image_height, int max_depth)
+	: world(world), lights(lights), cam(cam), background(background),
+	width(image_width), height(image_height), max_depth(max_depth), emitters(lights.bvh.lights) {
+	// thread_trace maps pixel i to film u in [i, i + 1) / (width - 1).
+	auto focus = -dot(cam.lower_left_corner - cam.origin, cam.forward);
+	film_area = (cam.horizontal.length() / focus) * (real(width) / (width - 1))
+		* (cam.vertical.length() / focus) * (real(height) / (height - 1));
+	light_tracing = cam.lens_radius == 0;
+
+}
+
+bool bdpt_integrator::sample_light(const hittable& light, vertex& v) const {
+	v.kind = vertex::type::light;
+	v.light = &light;
+	v.delta = false;
+	if (!emitters.sample_point(light, v.rec))
+		return false;
+
+	v.p = v.rec.p;
+	v.n = v.rec.normal;
+	return true;
+}
+
+// Point on the light for next-event estimation from ref, with its density
+// per unit area. Spheres sample the cone they subtend, as the path tracer
+// does; MIS weights still use the uniform density light subpaths start with.
+bool bdpt_integrator::sample_light(const hittable& light, const point3& ref, vertex& v, real& pdf_area) const {
+	if (light.kind == hittable_kind::sphere) {
+		const auto& s = static_cast<const sphere&>(light);
+		if ((ref - s.center).length_squared() > s.radius * s.radius) {
+			auto direction = s.random(ref);
+			auto pdf_dir = s.pdf_value(ref, direction);
+			auto& rec = v.rec;
+			if (pdf_dir <= 0 || !s.hit(ray(ref, direction), 0.001, infinity, rec))
+				return false;
+
+			v.kind = vertex::type::light;
+			v.light = &light;
+			v.delta = false;
+			v.p = rec.p;
+			v.n = (rec.p - s.center) / s.radius;
+			rec.obj = &light;
+			rec.normal = v.n;
+			rec.front_face = true;
+
+			auto d = v.p - ref;
+			pdf_area = pdf_dir * fabs(dot(v.n, unit_vector(d))) / d.length_squared();
+			return rec.mat_ptr != nullptr && pdf_area > 0;
+		}
+	}
+
+	auto area = emitters.area(light);
+	pdf_area = area > 0 ? 1 / area : 0;
+	return area > 0 && sample_light(light, v);
+}
+
+// Rects emit on both sides, spheres only outwards.
+color bdpt_integrator::emitted(const vertex& v, const vec3& w) const {
+	const auto* mat = v.rec.mat_ptr;
+	const auto* obj = v.kind == vertex::type::light ? v.light : v.rec.obj;
+	if (!mat || !obj)
+		return color(0, 0, 0);
+	if (!emitter_distribution::emits_towards(*obj, v.n, w))
+		return color(0, 0, 0);
+
+	return emitted_dispatch(*mat, v.rec.u, v.rec.v, v.p);
+}
+
+bool bdpt_integrator::is_emitter(const vertex& v) const {
+	return v.kind == vertex::type::surface && v.rec.mat_ptr && v.rec.mat_ptr->is_emissive();
+}
+
+real bdpt_integrator::cosine(const vertex& v, const vec3& w) const {
+	switch (v.kind) {
+	case vertex::type::medium:
+		return 1;
+	case vertex::type::camera:
+		return -dot(w, cam.forward);
+	default:
+		return fabs(dot(v.n, w));
+	}
+}
+
+real bdpt_integrator::convert_density(real pdf_dir, const vertex& from, const vertex& to) const {
+	auto d = to.p - from.p;
+	auto distance_squared = d.length_squared();
+	if (distance_squared == 0)
+		return 0;
+
+	if (to.kind == vertex::type::surface || to.kind == vertex::type::light)
+		pdf_dir *= fabs(dot(to.n, d)) / sqrt(distance_squared);
+	return pdf_dir / distance_squared;
+}
+
+real bdpt_integrator::camera_pdf(const vec3& w) const {
+	auto cos_theta = -dot(w, cam.forward);
+	if (cos_theta <= 0)
+		return 0;
+
+	int x, y;
+	if (!film_pixel(cam.origin + w, x, y))
+		return 0;
+	return 1 / (film_area * cos_theta * cos_theta * cos_theta);
+}
+
+// Pixel the pinhole camera sees p in, the inverse of get_ray.
+bool bdpt_integrator::film_pixel(const point3& p, int& x, int& y) const {
+	auto d = p - cam.origin;
+	auto depth = -dot(d, cam.forward);
+	if (depth <= 0)
+		return false;
+
+	auto focus = -dot(cam.lower_left_corner - cam.origin, cam.forward);
+	auto q = cam.origin + d * (focus / depth) - cam.lower_left_corner;
+	auto u = dot(q, cam.horizontal) / cam.horizontal.length_squared();
+	auto v = dot(q, cam.vertical) / cam.vertical.length_squared();
+	if (u < 0 || v < 0)
+		return false;
+
+	x = static_cast<int>(u * (width - 1));
+	y = static_cast<int>(v * (height - 1));
+	return x < width && y < height;
+}
+
+// BSDF at v without the cosine term, for light going between the two unit
+// directions. The normal is turned towards to_prev the way a ray from there
+// would have left it.
+color bdpt_integrator::f(const vertex& v, const vec3& to_prev, const vec3& to_next) const {
+	if (!v.rec.mat_ptr || v.delta)
+		return color(0, 0, 0);
+
+	ray r_in(v.p + to_prev, -to_prev, v.in.time());
+	if (v.kind == vertex::type::medium)
+		return eval_dispatch(*v.rec.mat_ptr, r_in, v.rec, to_next);
+
+	auto local = v.rec;
+	local.set_face_normal(r_in, v.n);
+	auto cos_next = fabs(dot(local.normal, to_next));
+	if (cos_next == 0)
+		return color(0, 0, 0);
+	return eval_dispatch(*v.rec.mat_ptr, r_in, local, to_next) / cos_next;
+}
+
+real bdpt_integrator::pdf(const vertex& v, const vertex* prev, const vertex& next) const {
+	if (v.kind == vertex::type::light)
+		return pdf_light(v, next);
+
+	auto to_next = unit_vector(next.p - v.p);
+	real pdf_dir = 0;
+	if (v.kind == vertex::type::camera) {
+		pdf_dir = camera_pdf(to_next);
+	}
+	else {
+		if (!prev || !v.rec.mat_ptr || v.delta)
+			return 0;
+
+		auto to_prev = unit_vector(prev->p - v.p);
+		ray r_in(prev->p, -to_prev, v.in.time());
+		auto local = v.rec;
+		if (v.kind == vertex::type::surface)
+			local.set_face_normal(r_in, v.n);
+		pdf_dir = pdf_dispatch(*v.rec.mat_ptr, r_in, local, to_next);
+	}
+
+	return convert_density(pdf_dir, v, next);
+}
+
+// Density of a light subpath leaving v towards next: cosine weighted on
+// the sampled side.
+real bdpt_integrator::pdf_light(const vertex& v, const vertex& next) const {
+	const auto* obj = v.kind == vertex::type::light ? v.light : v.rec.obj;
+	if (!obj)
+		return 0;
+
+	auto pdf_dir = emitters.direction_pdf(*obj, v.n, unit_vector(next.p - v.p));
+	return convert_density(pdf_dir, v, next);
+}
+
+real bdpt_integrator::pdf_light_origin(const vertex& v) const {
+	const auto* obj = v.kind == vertex::type::light ? v.light : v.rec.obj;
+	return obj ? emitters.origin_pdf(*obj) : 0;
+}
+
+bool bdpt_integrator::visible(const vertex& a, const vertex& b, real time) const {
+	auto d = b.p - a.p;
+	auto distance = d.length();
+	auto direction = d / distance;
+	auto origin = a.on_surface() || a.kind == vertex::type::light
+		? offset_ray_origin(a.p, a.n, direction) : a.p;
+
+	ray shadow(origin, direction, time, shadow_ray);
+	return !occluded_dispatch(world, shadow, 0.001, distance * (1 - 1e-4));
+}
+
+// Extends path[0] by scattering until the path is max_vertices long, it
+// escapes or it is absorbed. Camera subpaths collect what they escape to.
+int bdpt_integrator::walk(ray r, color beta, real pdf_dir, int max_vertices, vertex* path, color* escaped) const {
+	int count = 1;
+	while (count < max_vertices) {
+		hit_record rec;
+		if (!hit_dispatch(world, r, 0.001, infinity, rec)) {
+			if (escaped) {
+				auto sky = lights.environment ? lights.environment->radiance(r.direction()) : background;
+				*escaped = beta * sky;
+			}
+			break;
+		}
+
+		auto& prev = path[count - 1];
+		auto& v = path[count];
+		v = vertex();
+		v.kind = rec.mat_ptr && rec.mat_ptr->kind == material_kind::isotropic
+			? vertex::type::medium : vertex::type::surface;
+		v.p = rec.p;
+		v.n = v.kind == vertex::type::medium ? vec3(0, 0, 0) : (rec.front_face ? rec.normal : -rec.normal);
+		v.rec = rec;
+		v.in = r;
+		v.beta = beta;
+		v.pdf_fwd = convert_density(pdf_dir, prev, v);
+		count++;
+
+		bsdf_sample s;
+		if (count >= max_vertices || !sample_dispatch(*rec.mat_ptr, r, rec, s))
+			break;
+
+		auto wo = -unit_vector(r.direction());
+		auto wi = unit_vector(s.scattered.direction());
+		real pdf_rev_dir = 0;
+		if (s.is_specular) {
+			v.delta = true;
+			pdf_dir = 0;
+		}
+		else {
+			pdf_dir = s.pdf;
+			ray reverse(rec.p + wi, -wi, r.time());
+			auto local = rec;
+			if (v.kind == vertex::type::surface)
+				local.set_face_normal(reverse, v.n);
+			pdf_rev_dir = pdf_dispatch(*rec.mat_ptr, reverse, local, wo);
+		}
+
+		beta = beta * s.weight;
+		if (beta.near_zero())
+			break;
+
+		prev.pdf_rev = convert_density(pdf_rev_dir, v, prev);
+		r = s.scattered;
+		r.type = s.is_specular ? specular_ray : diffuse_ray;
+	}
+	return count;
+}
+
+int bdpt_integrator::camera_subpath(const ray& r, vertex* path, color& escaped) const {
+	auto& c = path[0];
+	c = vertex();
+	c.kind = vertex::type::camera;
+	c.p = r.origin();
+	c.in = r;
+	c.beta = color(1, 1, 1);
+
+	return walk(r, c.beta, camera_pdf(unit_vector(r.direction())), max_depth + 2, path, &escaped);
+}
+
+int bdpt_integrator::light_subpath(real time, vertex* path) const {
+	real pmf;
+	auto light = emitters.pick(random_double(), pmf);
+	if (!light)
+		return 0;
+
+	auto& l = path[0];
+	l = vertex();
+	if (!sample_light(*light, l))
+		return 0;
+
+	real pdf_dir;
+	auto direction = emitters.sample_direction(*light, l.n, pdf_dir);
+	auto cos_theta = fabs(dot(l.n, direction));
+
+	auto area_pdf = pdf_light_origin(l);
+	auto le = emitted(l, direction);
+	if (area_pdf <= 0 || pdf_dir <= 0 || le.near_zero())
+		return 0;
+
+	l.in = ray(l.p, direction, time);
+	l.beta = le / area_pdf;
+	l.pdf_fwd = area_pdf;
+
+	ray r(offset_ray_origin(l.p, l.n, direction), direction, time, diffuse_ray);
+	auto beta = le * cos_theta / (area_pdf * pdf_dir);
+	return walk(r, beta, pdf_dir, max_depth + 1, path, nullptr);
+}
+
+color bdpt_integrator::connect(vertex* light_path, vertex* camera_path, int s, int t,
+	splat_buffer& splats, real time) const {
+	auto& pt = camera_path[t - 1];
+	vertex sampled;
+	color L(0, 0, 0);
+
+	if (s == 0) {
+		// The camera subpath ran into a light.
+		if (!is_emitter(pt))
+			return color(0, 0, 0);
+		L = pt.beta * emitted(pt, unit_vector(camera_path[t - 2].p - pt.p));
+	}
+	else if (t == 1) {
+		// Light tracing: connect the light subpath to the pinhole.
+		auto& qs = light_path[s - 1];
+		if (!light_tracing || qs.delta || qs.kind == vertex::type::light)
+			return color(0, 0, 0);
+
+		int x, y;
+		if (!film_pixel(qs.p, x, y))
+			return color(0, 0, 0);
+
+		auto d = cam.origin - qs.p;
+		auto distance_squared = d.length_squared();
+		auto w = d / sqrt(distance_squared);
+		auto cos_camera = dot(w, cam.forward);
+		if (cos_camera <= 0)
+			return color(0, 0, 0);
+
+		sampled = vertex();
+		sampled.kind = vertex::type::camera;
+		sampled.p = cam.origin;
+		auto importance = 1 / (film_area * cos_camera * cos_camera * cos_camera * cos_camera);
+		sampled.beta = color(1, 1, 1) * (importance * cos_camera / distance_squared);
+
+		auto to_prev = unit_vector(light_path[s - 2].p - qs.p);
+		L = qs.beta * f(qs, to_prev, w) * sampled.beta;
+		if (qs.on_surface()) L *= fabs(dot(w, qs.n));
+		if (L.near_zero() || !visible(qs, sampled, time))
+			return color(0, 0, 0);
+
+		L *= mis_weight(light_path, camera_path, sampled, s, t);
+		if (std::isfinite(L.x()) && std::isfinite(L.y()) && std::isfinite(L.z()))
+			splats.add(x, y, L);
+		return color(0, 0, 0);
+	}
+	else if (s == 1) {
+		// Next-event estimation: a fresh point on a light.
+		if (pt.delta)
+			return color(0, 0, 0);
+
+		real pmf, pdf_area;
+		auto light = emitters.pick(random_double(), pmf);
+		if (!light || !sample_light(*light, pt.p, sampled, pdf_area))
+			return color(0, 0, 0);
+
+		auto d = sampled.p - pt.p;
+		auto distance_squared = d.length_squared();
+		auto w = d / sqrt(distance_squared);
+		auto le = emitted(sampled, -w);
+		if (le.near_zero())
+			return color(0, 0, 0);
+
+		sampled.beta = le / (pmf * pdf_area);
+		sampled.pdf_fwd = pdf_light_origin(sampled);
+		auto to_prev = unit_vector(camera_path[t - 2].p - pt.p);
+		auto g = fabs(dot(sampled.n, w)) / distance_squared;
+		L = pt.beta * f(pt, to_prev, w) * sampled.beta * g;
+		if (pt.on_surface()) L *= fabs(dot(w, pt.n));
+		if (L.near_zero() || !visible(pt, sampled, time))
+			return color(0, 0, 0);
+	}
+	else {
+		auto& qs = light_path[s - 1];
+		if (qs.delta || pt.delta)
+			return color(0, 0, 0);
+
+		auto d = pt.p - qs.p;
+		auto distance_squared = d.length_squared();
+		auto w = d / sqrt(distance_squared);
+		auto to_prev_q = unit_vector(light_path[s - 2].p - qs.p);
+		auto to_prev_t = unit_vector(camera_path[t - 2].p - pt.p);
+		auto g = cosine(qs, w) * cosine(pt, -w) / distance_squared;
+		L = qs.beta * f(qs, to_prev_q, w) * f(pt, to_prev_t, -w) * pt.beta * g;
+		if (L.near_zero() || !visible(qs, pt, time))
+			return color(0, 0, 0);
+	}
+
+	if (L.near_zero())
+		return color(0, 0, 0);
+	return L * mis_weight(light_path, camera_path, sampled, s, t);
+}
+
+// Power heuristic over every (s, t) split of the same path, from the ratios
+// of reverse to forward densities along it (pbrt's MISWeight). The vertices
+// at the connection get the densities this strategy implies and are put
+// back afterwards.
+real bdpt_integrator::mis_weight(vertex* light_path, vertex* camera_path, const vertex& sampled, int s, int t) const {
+	if (s + t == 2)
+		return 1;
+
+	vertex* qs = s > 0 ? &light_path[s - 1] : nullptr;
+	vertex* pt = &camera_path[t - 1];
+	vertex* qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+	vertex* pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+
+	// Emitters the light subpath can't start on only come from s = 0.
+	if (s == 0 && pdf_light_origin(*pt) <= 0)
+		return 1;
+
+	vertex saved_sampled;
+	if (s == 1) {
+		saved_sampled = light_path[0];
+		light_path[0] = sampled;
+	}
+	else if (t == 1) {
+		saved_sampled = camera_path[0];
+		camera_path[0] = sampled;
+	}
+
+	auto saved_pt = *pt;
+	vertex saved_qs, saved_pt_minus, saved_qs_minus;
+	if (qs) saved_qs = *qs;
+	if (pt_minus) saved_pt_minus = *pt_minus;
+	if (qs_minus) saved_qs_minus = *qs_minus;
+
+	pt->delta = false;
+	if (qs) qs->delta = false;
+
+	pt->pdf_rev = s > 0 ? pdf(*qs, qs_minus, *pt) : pdf_light_origin(*pt);
+	if (pt_minus)
+		pt_minus->pdf_rev = s > 0 ? pdf(*pt, qs, *pt_minus) : pdf_light(*pt, *pt_minus);
+	if (qs)
+		qs->pdf_rev = pdf(*pt, pt_minus, *qs);
+	if (qs_minus)
+		qs_minus->pdf_rev = pdf(*qs, pt, *qs_minus);
+
+	auto remap = [](real v) { return v != 0 ? v : real(1); };
+	real sum = 0;
+
+	real ratio = 1;
+	for (int i = t - 1; i > 0; i--) {
+		ratio *= remap(camera_path[i].pdf_rev) / remap(camera_path[i].pdf_fwd);
+		bool connectable = !camera_path[i].delta && !camera_path[i - 1].delta;
+		if (connectable && (i > 1 || light_tracing))
+			sum += ratio * ratio;
+	}
+
+	ratio = 1;
+	for (int i = s - 1; i >= 0; i--) {
+		ratio *= remap(light_path[i].pdf_rev) / remap(light_path[i].pdf_fwd);
+		bool previous_delta = i > 0 && light_path[i - 1].delta;
+		if (!light_path[i].delta && !previous_delta)
+			sum += ratio * ratio;
+	}
+
+	*pt = saved_pt;
+	if (qs) *qs = saved_qs;
+	if (pt_minus) *pt_minus = saved_pt_minus;
+	if (qs_minus) *qs_minus = saved_qs_minus;
+	if (s == 1)
+		light_path[0] = saved_sampled;
+	else if (t == 1)
+		camera_path[0] = saved_sampled;
+
+	return 1 / (1 + sum);
+}
+
+color bdpt_integrator::li(const ray& r, splat_buffer& splats, pixel_features* features) const {
+	thread_local std::vector<vertex> camera_path, light_path;
+	camera_path.resize(max_depth + 2);
+	light_path.resize(max_depth + 1);
+
+	color escaped(0, 0, 0);
+	int n_camera = camera_subpath(r, camera_path.data(), escaped);
+	int n_light = light_subpath(r.time(), light_path.data());
+
+	if (features) {
+		if (n_camera > 1) {
+			features->albedo = albedo_dispatch(*camera_path[1].rec.mat_ptr, camera_path[1].rec);
+			features->normal = camera_path[1].rec.normal;
+		}
+		else {
+			features->albedo = color(fmin(escaped.x(), 1.0), fmin(escaped.y(), 1.0), fmin(escaped.z(), 1.0));
+			features->normal = vec3(0, 0, 0);
+		}
+	}
+
+	// Light sampling doesn't need the light subpath to have got anywhere.
+	int max_s = std::max(n_light, emitters.empty() ? 0 : 1);
+	color L = escaped;
+	for (int t = 1; t <= n_camera; t++) {
+		for (int s = 0; s <= max_s; s++) {
+			int depth = s + t - 2;
+			if ((s == 1 && t == 1) || depth < 0 || depth > max_depth)
+				continue;
+			L += connect(light_path.data(), camera_path.data(), s, t, splats, r.time());
+		}
+	}
+	return L;
+}
+
+#endif
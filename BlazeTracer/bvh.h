@@ -4,6 +4,7 @@
 #include <algorithm>
 
 #include "rtweekend.h"
+#include "arena.h"
 
 #include "hittable.h"
 #include "hittable_list.h"
@@ -33,7 +34,7 @@ bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
 
 
 
-class bvh_node : public hittable {
+class bvh_node final : public hittable {
 public:
 	shared_ptr<hittable> left;
 	shared_ptr<hittable> right;
@@ -41,42 +42,57 @@ public:
 	aabb box;
 public:
 
-	bvh_node() {
+	bvh_node() : hittable(hittable_kind::bvh_node) {
 	}
 	bvh_node(
-		hittable_list src_objects, double time0, double time1) 
-	: bvh_node(src_objects.objects, 0, src_objects.objects.size(), time0, time1) {
+		hittable_list src_objects, real time0, real time1, scene_arena* arena = nullptr) 
+	: bvh_node(src_objects.objects, 0, src_objects.objects.size(), time0, time1, arena) {
 	}
 
 	bvh_node(
 		const std::vector<shared_ptr<hittable>>& src_objects,
-		size_t start, size_t end, double time0, double time1);
+		size_t start, size_t end, real time0, real time1, scene_arena* arena = nullptr);
 
 	virtual bool hit(
-		const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
 
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 };
 
-bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
+template <>
+struct arena_category_of<bvh_node> {
+	static constexpr arena_category value = arena_category::acceleration;
+};
+
+bool bvh_node::bounding_box(real time0, real time1, aabb& output_box) const {
 	output_box = box;
 	return true;
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool bvh_node::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	if (!box.hit(r, t_min, t_max))
 		return false;
 
-	bool hit_left = left->hit(r, t_min, t_max, rec);
-	bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+	bool hit_left = hit_dispatch(*left, r, t_min, t_max, rec);
+	bool hit_right = hit_dispatch(*right, r, t_min, hit_left ? rec.t : t_max, rec);
 
 	return hit_left || hit_right;
 }
 
+bool bvh_node::occluded(const ray& r, real t_min, real t_max) const {
+	if (!box.hit(r, t_min, t_max))
+		return false;
+
+	return occluded_dispatch(*left, r, t_min, t_max)
+		|| occluded_dispatch(*right, r, t_min, t_max);
+}
+
 bvh_node::bvh_node(
 	const std::vector<shared_ptr<hittable>>& src_objects,
-	size_t start, size_t end, double time0, double time1) {
+	size_t start, size_t end, real time0, real time1, scene_arena* arena)
+	: hittable(hittable_kind::bvh_node) {
 
 	auto objects = src_objects;
 
@@ -105,8 +121,8 @@ bvh_node::bvh_node(
 
 		auto mid = start + object_span / 2;
 
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+		left = arena_make<bvh_node>(arena, objects, start, mid, time0, time1, arena);
+		right = arena_make<bvh_node>(arena, objects, mid, end, time0, time1, arena);
 	}
 
 	aabb box_left, box_right;
@@ -117,7 +133,7 @@ bvh_node::bvh_node(
 	}
 
 	box = surrounding_box(box_left, box_right);
+	visibility = left->visibility | right->visibility;
 }
 
-
 #endif
\ No newline at end of file
@@ -3,6 +3,16 @@
 
 #include "rtweekend.h"
 
+// Ray cone (Akenine-Moller et al.): a ray stands for a cone of the given
+// width at its origin that widens by spread per unit distance. Its width at
+// a hit is the pixel footprint that picks the texture mip level.
+struct ray_cone {
+	real width = 0;
+	real spread = 0;
+
+	real width_at(real t) const { return width + spread * t; }
+};
+
 class camera {
 public:
 	point3 origin;
@@ -11,16 +21,16 @@ public:
 	vec3 vertical;
 	
 	vec3 forward, right, up;
-	double lens_radius;
-	double time0, time1; //shutter open and close time
+	real lens_radius;
+	real time0, time1; //shutter open and close time
 public:
 
 	camera(point3 lookfrom, point3 lookat, vec3 vup,
-		double vfov, double aspect_ratio,
-		double aperture,
-		double focus_dist,
-		double _time0 = 0,
-		double _time1 = 0) {
+		real vfov, real aspect_ratio,
+		real aperture,
+		real focus_dist,
+		real _time0 = 0,
+		real _time1 = 0) {
 		auto theta = degrees_to_radians(vfov);
 		auto h = tan(theta / 2);
 		
@@ -44,14 +54,55 @@ public:
 		time1 = _time1;
 	}
 
-	ray get_ray(double u, double v) const {
+	ray get_ray(real u, real v) const {
+		return get_ray(u, v, random_double(), random_double(), random_double());
+	}
+
+	// Ray through film position (u, v) from the lens position picked by
+	// (lens_u, lens_v) at shutter fraction time_u, all in [0, 1).
+	ray get_ray(real u, real v, real lens_u, real lens_v, real time_u) const {
+		return get_ray<true, true>(u, v, lens_u, lens_v, time_u);
+	}
 
-		vec3 rd = lens_radius * random_in_unit_disk();
+	// The same, for render kernels that know whether the lens has an aperture
+	// and the shutter stays open. With either off its numbers go unused.
+	template <bool depth_of_field, bool motion_blur>
+	ray get_ray(real u, real v, real lens_u, real lens_v, real time_u) const {
+		auto direction = lower_left_corner + u * horizontal + v * vertical - origin;
+		auto time = motion_blur ? time0 + (time1 - time0) * time_u : time0;
+		if constexpr (!depth_of_field) {
+			return ray(origin, direction, time, camera_ray);
+		}
+
+		vec3 rd = lens_radius * concentric_disk(lens_u, lens_v);
 		vec3 offset = right * rd.x() + up * rd.y();
+		return ray(origin + offset, direction - offset, time, camera_ray);
+	}
+
+	// Cone of a primary ray for an image height pixels tall.
+	ray_cone pixel_cone(int image_height) const {
+		auto focus_dist = (origin - (lower_left_corner + horizontal / 2 + vertical / 2)).length();
+		return { 0, vertical.length() / (focus_dist * image_height) };
+	}
+
+private:
+	// Shirley-Chiu concentric map of the unit square onto the unit disk.
+	static vec3 concentric_disk(real a, real b) {
+		auto x = 2 * a - 1;
+		auto y = 2 * b - 1;
+		if (x == 0 && y == 0)
+			return vec3(0, 0, 0);
 
-		return ray(origin + offset,
-			lower_left_corner + u * horizontal + v * vertical - origin - offset,
-			random_double(time0, time1));
+		real r, theta;
+		if (fabs(x) > fabs(y)) {
+			r = x;
+			theta = pi / 4 * (y / x);
+		}
+		else {
+			r = y;
+			theta = pi / 2 - pi / 4 * (x / y);
+		}
+		return vec3(r * cos(theta), r * sin(theta), 0);
 	}
 };
 
@@ -5,6 +5,11 @@
 
 #include "vec3.h"
 
+// Rec. 709 luminance of a linear color.
+inline real luminance(const color& c) {
+    return real(0.2126) * c.x() + real(0.7152) * c.y() + real(0.0722) * c.z();
+}
+
 void write_color(std::ostream& out, color pixel_color, int samples_per_pixel) {
 
     auto r = pixel_color.x();
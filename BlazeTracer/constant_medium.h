@@ -7,44 +7,56 @@
 #include "material.h"
 #include "texture.h"
 
-class constant_medium : public hittable {
+class constant_medium final : public hittable {
 public:
 	shared_ptr<hittable> boundary;
 	shared_ptr<material> phase_function;
-	double neg_inv_density;
+	real neg_inv_density;
 public:
 
-	constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
-		: boundary(b),
-		neg_inv_density(-1 / d),
-		phase_function(make_shared<isotropic>(a))
+	// The phase function (and its color) come from arena when there is one.
+	constant_medium(shared_ptr<hittable> b, real d, shared_ptr<texture> a, scene_arena* arena = nullptr)
+		: hittable(hittable_kind::constant_medium),
+		boundary(b),
+		phase_function(arena_make<isotropic>(arena, a)),
+		neg_inv_density(-1 / d)
 	{
 
 	}
 
-	constant_medium(shared_ptr<hittable> b, double d, color c)
-		: boundary(b),
-		neg_inv_density(-1 / d),
-		phase_function(make_shared<isotropic>(c)) {}
+	constant_medium(shared_ptr<hittable> b, real d, color c, scene_arena* arena = nullptr)
+		: hittable(hittable_kind::constant_medium),
+		boundary(b),
+		phase_function(arena_make<isotropic>(arena, c, arena)),
+		neg_inv_density(-1 / d) {}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	// Share one phase function between media instead of allocating one each.
+	constant_medium(shared_ptr<hittable> b, real d, shared_ptr<material> phase)
+		: hittable(hittable_kind::constant_medium),
+		boundary(b),
+		phase_function(phase),
+		neg_inv_density(-1 / d) {}
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
 		return boundary->bounding_box(time0, time1, output_box);
 	}
 };
 
-bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool constant_medium::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	const bool enableDebug = false;
 	const bool debugging = enableDebug && random_double() < 0.0001;
 
 	hit_record rec1, rec2;
 
-	if (!boundary->hit(r, -infinity, infinity, rec1)) {
+	// The boundary only shapes the medium, hiding it must not hide the medium.
+	ray probe(r.origin(), r.direction(), r.time());
+	if (!hit_dispatch(*boundary, probe, -infinity, infinity, rec1)) {
 		return false;
 	}
 
-	if (!boundary->hit(r, rec1.t + 0.0001, infinity, rec2)) {
+	if (!hit_dispatch(*boundary, probe, rec1.t + 0.0001, infinity, rec2)) {
 		return false;
 	}
 
@@ -77,7 +89,8 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
 	rec.normal = vec3(1, 0, 0);
 	rec.front_face = true;
-	rec.mat_ptr = phase_function;
+	rec.mat_ptr = phase_function.get();
+	rec.obj = this;
 
 	return true;
 }
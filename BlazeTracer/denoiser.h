@@ -0,0 +1,244 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "rtweekend.h"
+#include "color.h"
+#include "util.h"
+
+// What a camera ray saw first, gathered next to its color for the denoiser.
+struct pixel_features {
+	color albedo;
+	vec3 normal;
+};
+
+// Per-pixel sums over all samples, laid out like the color buffer.
+class feature_buffers {
+public:
+	std::vector<std::vector<color>> albedo;
+	std::vector<std::vector<vec3>> normal;
+	std::vector<std::vector<real>> luminance_squared;
+public:
+	feature_buffers(int width, int height)
+		: albedo(height, std::vector<color>(width)),
+		normal(height, std::vector<vec3>(width)),
+		luminance_squared(height, std::vector<real>(width, 0)) {}
+
+	void write(const char* albedo_file, const char* normal_file, int samples_per_pixel) const;
+};
+
+void feature_buffers::write(const char* albedo_file, const char* normal_file, int samples_per_pixel) const {
+	std::ofstream albedo_out(albedo_file);
+	std::ofstream normal_out(normal_file);
+	if (!albedo_out.is_open() || !normal_out.is_open()) {
+		LOG(LOG_TYPE::ERROR, "Error writing feature images!");
+		return;
+	}
+
+	int height = static_cast<int>(albedo.size());
+	int width = height ? static_cast<int>(albedo[0].size()) : 0;
+	albedo_out << "P3\n" << width << ' ' << height << "\n255\n";
+	normal_out << "P3\n" << width << ' ' << height << "\n255\n";
+
+	for (int j = height - 1; j >= 0; --j) {
+		for (int i = 0; i < width; ++i) {
+			write_color(albedo_out, albedo[j][i], samples_per_pixel);
+
+			// Normals map [-1, 1] to [0, 255] without gamma.
+			auto n = normal[j][i] / samples_per_pixel;
+			for (int c = 0; c < 3; c++) {
+				normal_out << static_cast<int>(255.999 * clamp(0.5 * n[c] + 0.5, 0.0, 1.0)) << (c < 2 ? ' ' : '\n');
+			}
+		}
+	}
+}
+
+struct denoise_settings {
+	int iterations = 4;
+	// Edge stopping: luminance differences in standard deviations, exponent
+	// on the normal cosine, albedo differences.
+	real sigma_luminance = 4;
+	real sigma_normal = 128;
+	real sigma_albedo = real(0.1);
+	int threads = 0;
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., with the variance
+// guided luminance weight of SVGF). Texture detail is kept by filtering the
+// color divided by the first-hit albedo and multiplying it back afterwards;
+// normals and albedo stop the filter at geometry and material edges. Returns
+// mean colors, i.e. the result is written with one sample per pixel.
+class denoiser {
+public:
+	denoiser(const std::vector<std::vector<color>>& colors, const feature_buffers& features,
+		int samples_per_pixel, const denoise_settings& settings = denoise_settings());
+
+	std::vector<std::vector<color>> run();
+
+private:
+	void filter_rows(int step, int row_begin, int row_end);
+	real blurred_variance(int i, int j) const;
+
+	int width, height;
+	denoise_settings settings;
+
+	std::vector<color> albedo;
+	std::vector<vec3> normal;
+
+	// Ping-pong buffers of demodulated color and its variance.
+	std::vector<color> irradiance, irradiance_next;
+	std::vector<real> variance, variance_next;
+};
+
+denoiser::denoiser(const std::vector<std::vector<color>>& colors, const feature_buffers& features,
+	int samples_per_pixel, const denoise_settings& settings)
+	: width(colors.empty() ? 0 : static_cast<int>(colors[0].size())),
+	height(static_cast<int>(colors.size())),
+	settings(settings) {
+	size_t count = size_t(width) * height;
+	albedo.resize(count);
+	normal.resize(count);
+	irradiance.resize(count);
+	variance.resize(count);
+	irradiance_next.resize(count);
+	variance_next.resize(count);
+
+	const real epsilon = real(1e-3);
+	real inv_spp = real(1) / samples_per_pixel;
+
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			size_t k = size_t(j) * width + i;
+
+			auto c = colors[j][i] * inv_spp;
+			auto a = features.albedo[j][i] * inv_spp;
+			auto n = features.normal[j][i] * inv_spp;
+
+			// Where there is nothing to divide by keep the color as is.
+			for (int ch = 0; ch < 3; ch++) {
+				if (a[ch] < epsilon) a[ch] = 1;
+			}
+
+			auto l = luminance(c);
+			auto var = fmax(features.luminance_squared[j][i] * inv_spp - l * l, real(0)) * inv_spp;
+			auto la = fmax(luminance(a), epsilon);
+
+			albedo[k] = a;
+			normal[k] = n.near_zero() ? vec3(0, 0, 0) : unit_vector(n);
+			irradiance[k] = color(c.x() / a.x(), c.y() / a.y(), c.z() / a.z());
+			variance[k] = var / (la * la);
+		}
+	}
+}
+
+// 3x3 Gaussian of the variance; a single pixel's estimate is too noisy to
+// scale the luminance weight with.
+real denoiser::blurred_variance(int i, int j) const {
+	static const real kernel[2] = { real(1.0 / 4), real(1.0 / 8) };
+
+	real sum = 0;
+	real weight_sum = 0;
+	for (int dy = -1; dy <= 1; dy++) {
+		int y = j + dy;
+		if (y < 0 || y >= height) continue;
+
+		for (int dx = -1; dx <= 1; dx++) {
+			int x = i + dx;
+			if (x < 0 || x >= width) continue;
+
+			auto w = kernel[dx != 0] * kernel[dy != 0] * 4;
+			sum += w * variance[size_t(y) * width + x];
+			weight_sum += w;
+		}
+	}
+
+	return sum / weight_sum;
+}
+
+void denoiser::filter_rows(int step, int row_begin, int row_end) {
+	static const real kernel[5] = { real(1.0 / 16), real(1.0 / 4), real(3.0 / 8), real(1.0 / 4), real(1.0 / 16) };
+
+	for (int j = row_begin; j < row_end; j++) {
+		for (int i = 0; i < width; i++) {
+			size_t p = size_t(j) * width + i;
+
+			auto lp = luminance(irradiance[p]);
+			auto luminance_scale = settings.sigma_luminance * sqrt(blurred_variance(i, j)) + real(1e-4);
+			const auto& np = normal[p];
+			const auto& ap = albedo[p];
+
+			color sum(0, 0, 0);
+			real var_sum = 0;
+			real weight_sum = 0;
+
+			for (int dy = -2; dy <= 2; dy++) {
+				int y = j + dy * step;
+				if (y < 0 || y >= height) continue;
+
+				for (int dx = -2; dx <= 2; dx++) {
+					int x = i + dx * step;
+					if (x < 0 || x >= width) continue;
+
+					size_t q = size_t(y) * width + x;
+
+					real w_n;
+					if (np.near_zero() || normal[q].near_zero())
+						w_n = np.near_zero() == normal[q].near_zero() ? 1 : 0;
+					else
+						w_n = pow(fmax(dot(np, normal[q]), real(0)), settings.sigma_normal);
+
+					auto w_l = exp(-fabs(lp - luminance(irradiance[q])) / luminance_scale);
+					auto w_a = exp(-(ap - albedo[q]).length_squared() / (settings.sigma_albedo * settings.sigma_albedo));
+
+					auto w = kernel[dx + 2] * kernel[dy + 2] * w_n * w_l * w_a;
+					sum += w * irradiance[q];
+					var_sum += w * w * variance[q];
+					weight_sum += w;
+				}
+			}
+
+			// The center tap always has weight > 0.
+			irradiance_next[p] = sum / weight_sum;
+			variance_next[p] = var_sum / (weight_sum * weight_sum);
+		}
+	}
+}
+
+std::vector<std::vector<color>> denoiser::run() {
+	int thread_count = settings.threads > 0 ? settings.threads
+		: std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	thread_count = std::min(thread_count, std::max(height, 1));
+
+	for (int iteration = 0; iteration < settings.iterations; iteration++) {
+		int step = 1 << iteration;
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < thread_count; t++) {
+			int begin = height * t / thread_count;
+			int end = height * (t + 1) / thread_count;
+			threads.emplace_back(&denoiser::filter_rows, this, step, begin, end);
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+
+		std::swap(irradiance, irradiance_next);
+		std::swap(variance, variance_next);
+	}
+
+	std::vector<std::vector<color>> result(height, std::vector<color>(width));
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			size_t k = size_t(j) * width + i;
+			result[j][i] = irradiance[k] * albedo[k];
+		}
+	}
+
+	return result;
+}
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "aarect.h"
+#include "box.h"
+#include "bvh.h"
+#include "constant_medium.h"
+#include "grid_medium.h"
+
+// Closed-world dispatch for the built-in hittables. The type tag selects the
+// concrete class and its hit() is called non-virtually, which lets the
+// compiler inline sphere::hit and friends straight into BVH traversal.
+// Custom hittables keep using the virtual interface. Objects, or whole BVH
+// subtrees, hidden from the ray's type are skipped before anything else.
+inline bool hit_dispatch(const hittable& h, const ray& r, real t_min, real t_max, hit_record& rec) {
+	if (!(h.visibility & r.type))
+		return false;
+
+	switch (h.kind) {
+	case hittable_kind::sphere:
+		return static_cast<const sphere&>(h).sphere::hit(r, t_min, t_max, rec);
+	case hittable_kind::moving_sphere:
+		return static_cast<const moving_sphere&>(h).moving_sphere::hit(r, t_min, t_max, rec);
+	case hittable_kind::xy_rect:
+		return static_cast<const xy_rect&>(h).xy_rect::hit(r, t_min, t_max, rec);
+	case hittable_kind::xz_rect:
+		return static_cast<const xz_rect&>(h).xz_rect::hit(r, t_min, t_max, rec);
+	case hittable_kind::yz_rect:
+		return static_cast<const yz_rect&>(h).yz_rect::hit(r, t_min, t_max, rec);
+	case hittable_kind::box:
+		return static_cast<const box&>(h).box::hit(r, t_min, t_max, rec);
+	case hittable_kind::hittable_list:
+		return static_cast<const hittable_list&>(h).hittable_list::hit(r, t_min, t_max, rec);
+	case hittable_kind::bvh_node:
+		return static_cast<const bvh_node&>(h).bvh_node::hit(r, t_min, t_max, rec);
+	case hittable_kind::translate:
+		return static_cast<const translate&>(h).translate::hit(r, t_min, t_max, rec);
+	case hittable_kind::rotate_y:
+		return static_cast<const rotate_y&>(h).rotate_y::hit(r, t_min, t_max, rec);
+	case hittable_kind::constant_medium:
+		return static_cast<const constant_medium&>(h).constant_medium::hit(r, t_min, t_max, rec);
+	case hittable_kind::grid_medium:
+		return static_cast<const grid_medium&>(h).grid_medium::hit(r, t_min, t_max, rec);
+	default:
+		return h.hit(r, t_min, t_max, rec);
+	}
+}
+
+inline bool occluded_dispatch(const hittable& h, const ray& r, real t_min, real t_max) {
+	if (!(h.visibility & r.type))
+		return false;
+
+	switch (h.kind) {
+	case hittable_kind::bvh_node:
+		return static_cast<const bvh_node&>(h).bvh_node::occluded(r, t_min, t_max);
+	case hittable_kind::hittable_list:
+		return static_cast<const hittable_list&>(h).hittable_list::occluded(r, t_min, t_max);
+	case hittable_kind::custom:
+		return h.occluded(r, t_min, t_max);
+	default: {
+		hit_record rec;
+		return hit_dispatch(h, r, t_min, t_max, rec);
+	}
+	}
+}
+
+// Every material below h, e.g. to rewrite their textures at scene build.
+inline void collect_materials(const hittable& h, std::vector<material*>& materials) {
+	switch (h.kind) {
+	case hittable_kind::hittable_list:
+		for (const auto& object : static_cast<const hittable_list&>(h).objects) {
+			collect_materials(*object, materials);
+		}
+		break;
+	case hittable_kind::bvh_node: {
+		const auto& node = static_cast<const bvh_node&>(h);
+		collect_materials(*node.left, materials);
+		if (node.right != node.left)
+			collect_materials(*node.right, materials);
+		break;
+	}
+	case hittable_kind::box:
+		collect_materials(static_cast<const box&>(h).sides, materials);
+		break;
+	case hittable_kind::translate:
+		collect_materials(*static_cast<const translate&>(h).ptr, materials);
+		break;
+	case hittable_kind::rotate_y:
+		collect_materials(*static_cast<const rotate_y&>(h).ptr, materials);
+		break;
+	case hittable_kind::constant_medium:
+		materials.push_back(static_cast<const constant_medium&>(h).phase_function.get());
+		break;
+	case hittable_kind::grid_medium:
+		materials.push_back(static_cast<const grid_medium&>(h).phase_function.get());
+		break;
+	default:
+		if (auto mat = h.surface_material())
+			materials.push_back(const_cast<material*>(mat));
+		break;
+	}
+}
+
+// World-space length of the primitive's (u, v) parameter range around the
+// hit, used to turn a footprint width into texture coordinates. Zero for
+// anything without a known parametrization.
+inline void surface_uv_lengths(const hit_record& rec, real& length_u, real& length_v) {
+	length_u = length_v = 0;
+	if (!rec.obj)
+		return;
+
+	switch (rec.obj->kind) {
+	case hittable_kind::sphere:
+	case hittable_kind::moving_sphere: {
+		auto radius = rec.obj->kind == hittable_kind::sphere
+			? static_cast<const sphere*>(rec.obj)->radius
+			: static_cast<const moving_sphere*>(rec.obj)->radius;
+		length_u = 2 * pi * radius * fmax(sin(pi * rec.v), real(1e-3));
+		length_v = pi * radius;
+		break;
+	}
+	case hittable_kind::xy_rect: {
+		auto rect = static_cast<const xy_rect*>(rec.obj);
+		length_u = rect->x1 - rect->x0;
+		length_v = rect->y1 - rect->y0;
+		break;
+	}
+	case hittable_kind::xz_rect: {
+		auto rect = static_cast<const xz_rect*>(rec.obj);
+		length_u = rect->x1 - rect->x0;
+		length_v = rect->z1 - rect->z0;
+		break;
+	}
+	case hittable_kind::yz_rect: {
+		auto rect = static_cast<const yz_rect*>(rec.obj);
+		length_u = rect->y1 - rect->y0;
+		length_v = rect->z1 - rect->z0;
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+#endif
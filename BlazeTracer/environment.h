@@ -0,0 +1,192 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <vector>
+
+#include "rtweekend.h"
+#include "color.h"
+#include "rtw_stb_image.h"
+
+// Walker/Vose alias table: draws index i with probability weights[i] / sum
+// in constant time. u picks the column and v decides between it and its
+// alias; taking both from one number would tie the decision to u's low bits
+// and break the stratification of low-discrepancy samplers.
+class alias_table {
+public:
+	alias_table() {}
+	explicit alias_table(const std::vector<real>& weights);
+
+	int sample(real u, real v) const;
+	real pmf(int i) const { return probabilities[i]; }
+	int size() const { return static_cast<int>(probabilities.size()); }
+
+private:
+	std::vector<real> probabilities;
+	std::vector<real> threshold;
+	std::vector<int> alias;
+};
+
+alias_table::alias_table(const std::vector<real>& weights)
+	: probabilities(weights.size()), threshold(weights.size()), alias(weights.size()) {
+	auto n = weights.size();
+	double sum = 0;
+	for (auto w : weights) sum += w;
+
+	std::vector<double> scaled(n);
+	std::vector<int> small, large;
+	for (size_t i = 0; i < n; i++) {
+		probabilities[i] = sum > 0 ? static_cast<real>(weights[i] / sum) : real(1) / n;
+		scaled[i] = sum > 0 ? weights[i] / sum * n : 1;
+		(scaled[i] < 1 ? small : large).push_back(static_cast<int>(i));
+	}
+
+	while (!small.empty() && !large.empty()) {
+		int s = small.back(); small.pop_back();
+		int l = large.back(); large.pop_back();
+
+		threshold[s] = static_cast<real>(scaled[s]);
+		alias[s] = l;
+
+		scaled[l] = scaled[l] + scaled[s] - 1;
+		(scaled[l] < 1 ? small : large).push_back(l);
+	}
+
+	// Whatever is left is 1 up to rounding.
+	for (int i : large) { threshold[i] = 1; alias[i] = i; }
+	for (int i : small) { threshold[i] = 1; alias[i] = i; }
+}
+
+int alias_table::sample(real u, real v) const {
+	auto n = static_cast<int>(threshold.size());
+	int i = std::min(static_cast<int>(u * n), n - 1);
+	return v < threshold[i] ? i : alias[i];
+}
+
+// Equirectangular environment map lighting every ray that leaves the scene.
+// Directions are importance sampled in proportion to luminance * sin(theta)
+// through a marginal alias table over rows and one conditional table per row.
+class environment_light {
+public:
+	environment_light(const char* filename, real intensity = 1);
+
+	bool valid() const { return width > 0; }
+
+	color radiance(const vec3& direction) const;
+
+	// Direction towards the environment and its solid angle density.
+	vec3 sample(real& pdf) const;
+	real pdf(const vec3& direction) const;
+
+private:
+	void direction_to_pixel(const vec3& direction, int& i, int& j, real& sin_theta) const;
+
+	std::vector<color> pixels;
+	int width = 0;
+	int height = 0;
+	real intensity;
+
+	alias_table rows;
+	std::vector<alias_table> columns;
+};
+
+environment_light::environment_light(const char* filename, real intensity) : intensity(intensity) {
+	// Row 0 is the top of the sky.
+	stbi_set_flip_vertically_on_load_thread(0);
+	int components = 3;
+	float* data = stbi_loadf(filename, &width, &height, &components, 3);
+
+	if (!data) {
+		std::cerr << "ERROR: Could not load environment map '" << filename << "'.\n";
+		width = height = 0;
+		return;
+	}
+
+	pixels.resize(size_t(width) * height);
+	for (size_t k = 0; k < pixels.size(); k++) {
+		pixels[k] = color(data[3 * k], data[3 * k + 1], data[3 * k + 2]);
+	}
+	stbi_image_free(data);
+
+	std::vector<real> row_weights(height);
+	std::vector<real> weights(width);
+	columns.reserve(height);
+	for (int j = 0; j < height; j++) {
+		auto sin_theta = sin(pi * (j + real(0.5)) / height);
+
+		double row_sum = 0;
+		for (int i = 0; i < width; i++) {
+			weights[i] = fmax(luminance(pixels[size_t(j) * width + i]), real(0)) * sin_theta;
+			row_sum += weights[i];
+		}
+
+		columns.emplace_back(weights);
+		row_weights[j] = static_cast<real>(row_sum);
+	}
+
+	// A black map still has to be sampleable.
+	double total = 0;
+	for (auto w : row_weights) total += w;
+	if (total <= 0) {
+		for (int j = 0; j < height; j++) {
+			row_weights[j] = sin(pi * (j + real(0.5)) / height);
+		}
+	}
+
+	rows = alias_table(row_weights);
+}
+
+void environment_light::direction_to_pixel(const vec3& direction, int& i, int& j, real& sin_theta) const {
+	auto d = unit_vector(direction);
+	auto theta = acos(clamp(d.y(), -1.0, 1.0));
+	auto phi = atan2(-d.z(), d.x()) + pi;
+
+	i = std::min(static_cast<int>(phi / (2 * pi) * width), width - 1);
+	j = std::min(static_cast<int>(theta / pi * height), height - 1);
+	sin_theta = sin(theta);
+}
+
+color environment_light::radiance(const vec3& direction) const {
+	if (!valid())
+		return color(0, 0, 0);
+
+	int i, j;
+	real sin_theta;
+	direction_to_pixel(direction, i, j, sin_theta);
+
+	return intensity * pixels[size_t(j) * width + i];
+}
+
+vec3 environment_light::sample(real& pdf) const {
+	pdf = 0;
+	if (!valid())
+		return vec3(0, 1, 0);
+
+	int j = rows.sample(random_double(), random_double());
+	int i = columns[j].sample(random_double(), random_double());
+
+	auto theta = pi * (j + random_double()) / height;
+	auto phi = 2 * pi * (i + random_double()) / width;
+	auto sin_theta = sin(theta);
+	if (sin_theta <= 0)
+		return vec3(0, 1, 0);
+
+	// Uniform over the pixel's (u, v) rectangle, mapped to the sphere.
+	pdf = rows.pmf(j) * columns[j].pmf(i) * width * height / (2 * pi * pi * sin_theta);
+
+	return vec3(-sin_theta * cos(phi), cos(theta), sin_theta * sin(phi));
+}
+
+real environment_light::pdf(const vec3& direction) const {
+	if (!valid())
+		return 0;
+
+	int i, j;
+	real sin_theta;
+	direction_to_pixel(direction, i, j, sin_theta);
+	if (sin_theta <= 0)
+		return 0;
+
+	return rows.pmf(j) * columns[j].pmf(i) * width * height / (2 * pi * pi * sin_theta);
+}
+
+#endif
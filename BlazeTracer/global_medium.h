@@ -0,0 +1,132 @@
+#ifndef GLOBAL_MEDIUM_H
+#define GLOBAL_MEDIUM_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+
+// Scene-wide fog handled by the integrator instead of a primitive: between
+// two surface hits a ray may scatter in it, and shadow rays are attenuated
+// by it. The extinction is density * exp(-falloff * (y - base_height)),
+// constant for falloff 0, limited to a ball of the given radius around
+// center. Optical depth and free-flight distances are computed in closed
+// form, so it costs a few exp/log per ray.
+class global_medium {
+public:
+	real density = 0;
+	real falloff = 0;
+	real base_height = 0;
+	point3 center = point3(0, 0, 0);
+	real radius = infinity;
+	shared_ptr<material> phase_function;
+public:
+	global_medium() {}
+
+	static global_medium homogeneous(real density, shared_ptr<material> phase,
+		const point3& center = point3(0, 0, 0), real radius = infinity) {
+		global_medium m;
+		m.density = density;
+		m.phase_function = phase;
+		m.center = center;
+		m.radius = radius;
+		return m;
+	}
+
+	static global_medium height_fog(real density, real falloff, real base_height, shared_ptr<material> phase) {
+		global_medium m;
+		m.density = density;
+		m.falloff = falloff;
+		m.base_height = base_height;
+		m.phase_function = phase;
+		return m;
+	}
+
+	bool active() const { return density > 0 && phase_function; }
+
+	real transmittance(const ray& r, real t0, real t1) const {
+		if (!active() || !clip(r, t0, t1))
+			return 1;
+		return exp(-optical_depth(r, t0, t1));
+	}
+
+	// Samples where a ray travelling from t0 to t1 first scatters. On
+	// success rec describes the scattering point; otherwise the ray gets
+	// through, which happens with probability transmittance(r, t0, t1).
+	bool sample(const ray& r, real t0, real t1, hit_record& rec) const;
+
+private:
+	bool clip(const ray& r, real& t0, real& t1) const;
+	real optical_depth(const ray& r, real t0, real t1) const;
+};
+
+// Restricts [t0, t1] to the medium's ball.
+bool global_medium::clip(const ray& r, real& t0, real& t1) const {
+	if (radius == infinity)
+		return t0 < t1;
+
+	vec3 oc = r.origin() - center;
+	auto a = r.direction().length_squared();
+	auto half_b = dot(oc, r.direction());
+	auto c = oc.length_squared() - radius * radius;
+	auto discriminant = half_b * half_b - a * c;
+	if (discriminant <= 0)
+		return false;
+
+	auto root = sqrt(discriminant);
+	t0 = fmax(t0, (-half_b - root) / a);
+	t1 = fmin(t1, (-half_b + root) / a);
+	return t0 < t1;
+}
+
+// Integral of the extinction over the clipped segment. With height falloff
+// the exponent is linear in t, so it integrates in closed form.
+real global_medium::optical_depth(const ray& r, real t0, real t1) const {
+	auto length = r.direction().length();
+	auto b = falloff * r.direction().y();
+	if (fabs(b) < 1e-9) {
+		auto sigma = density * exp(-falloff * (r.origin().y() + r.direction().y() * t0 - base_height));
+		return sigma * length * (t1 - t0);
+	}
+
+	auto a = density * length * exp(-falloff * (r.origin().y() - base_height));
+	auto tail = t1 == infinity ? (b > 0 ? 0 : infinity) : exp(-b * t1);
+	return a * (exp(-b * t0) - tail) / b;
+}
+
+bool global_medium::sample(const ray& r, real t0, real t1, hit_record& rec) const {
+	if (!active() || !clip(r, t0, t1))
+		return false;
+
+	auto target = -log(1 - random_double());
+	auto length = r.direction().length();
+	real t;
+
+	auto b = falloff * r.direction().y();
+	if (fabs(b) < 1e-9) {
+		auto sigma = density * exp(-falloff * (r.origin().y() + r.direction().y() * t0 - base_height));
+		t = t0 + target / (sigma * length);
+	}
+	else {
+		// Solve optical_depth(t0, t) = target for t.
+		auto a = density * length * exp(-falloff * (r.origin().y() - base_height));
+		auto e = exp(-b * t0) - target * b / a;
+		if (e <= 0)
+			return false;
+		t = -log(e) / b;
+	}
+
+	if (!(t < t1))
+		return false;
+
+	rec.t = t;
+	rec.p = r.at(t);
+	rec.normal = vec3(1, 0, 0);
+	rec.front_face = true;
+	rec.mat_ptr = phase_function.get();
+	rec.obj = nullptr;
+	rec.u = rec.v = 0;
+	return true;
+}
+
+#endif
@@ -0,0 +1,320 @@
+#ifndef GRID_MEDIUM_H
+#define GRID_MEDIUM_H
+
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "arena.h"
+#include "material.h"
+#include "util.h"
+
+// Densities on a voxel grid spanning bounds, looked up trilinearly. Zero
+// outside the grid.
+class density_grid {
+public:
+	int nx = 0, ny = 0, nz = 0;
+	aabb bounds;
+	float* values = nullptr;  // nx * ny * nz, x fastest
+public:
+	density_grid() {}
+	// The voxels come from arena when there is one, from the heap otherwise.
+	density_grid(int nx, int ny, int nz, const aabb& bounds, scene_arena* arena = nullptr)
+		: nx(nx), ny(ny), nz(nz), bounds(bounds) {
+		if (arena) {
+			values = arena->make_array<float>(size(), arena_category::volume);
+		}
+		else {
+			heap_values.assign(size(), 0.0f);
+			values = heap_values.data();
+		}
+	}
+
+	density_grid(const density_grid&) = delete;
+	density_grid& operator=(const density_grid&) = delete;
+
+	size_t size() const { return size_t(nx) * ny * nz; }
+
+	float& at(int x, int y, int z) { return values[(size_t(z) * ny + y) * nx + x]; }
+	float at(int x, int y, int z) const { return values[(size_t(z) * ny + y) * nx + x]; }
+
+	// Continuous grid coordinates of p, voxel centers at half-integers.
+	vec3 grid_position(const point3& p) const {
+		auto extent = bounds.max() - bounds.min();
+		return vec3((p.x() - bounds.min().x()) / extent.x() * nx,
+			(p.y() - bounds.min().y()) / extent.y() * ny,
+			(p.z() - bounds.min().z()) / extent.z() * nz);
+	}
+
+	real density(const point3& p) const;
+
+private:
+	std::vector<float> heap_values;
+};
+
+template <>
+struct arena_category_of<density_grid> {
+	static constexpr arena_category value = arena_category::volume;
+};
+
+real density_grid::density(const point3& p) const {
+	auto g = grid_position(p);
+	int n[3] = { nx, ny, nz };
+	int i0[3], i1[3];
+	real f[3];
+	for (int a = 0; a < 3; a++) {
+		if (g[a] < 0 || g[a] > n[a])
+			return 0;
+
+		auto c = clamp(g[a] - 0.5, 0.0, n[a] - 1.0);
+		i0[a] = static_cast<int>(c);
+		i1[a] = std::min(i0[a] + 1, n[a] - 1);
+		f[a] = c - i0[a];
+	}
+
+	auto lerp_x = [&](int y, int z) {
+		return (1 - f[0]) * at(i0[0], y, z) + f[0] * at(i1[0], y, z);
+	};
+	auto lerp_y = [&](int z) {
+		return (1 - f[1]) * lerp_x(i0[1], z) + f[1] * lerp_x(i1[1], z);
+	};
+	return (1 - f[2]) * lerp_y(i0[2]) + f[2] * lerp_y(i1[2]);
+}
+
+// Reads a text voxel file:
+//
+//   dense nx ny nz                 or   sparse nx ny nz
+//   bounds x0 y0 z0 x1 y1 z1            bounds x0 y0 z0 x1 y1 z1
+//   nx*ny*nz densities, x fastest       count, then count lines "i j k density"
+//
+// Lines starting with '#' are skipped. Returns nullptr on errors. The grid
+// comes from arena when there is one.
+shared_ptr<density_grid> load_density_grid(const char* filename, scene_arena* arena = nullptr) {
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		std::cerr << "ERROR: Could not load volume file '" << filename << "'.\n";
+		return nullptr;
+	}
+
+	std::stringstream body;
+	std::string line;
+	while (std::getline(file, line)) {
+		if (!line.empty() && line[0] != '#') body << line << '\n';
+	}
+
+	std::string layout, keyword;
+	int nx = 0, ny = 0, nz = 0;
+	real x0, y0, z0, x1, y1, z1;
+	body >> layout >> nx >> ny >> nz >> keyword >> x0 >> y0 >> z0 >> x1 >> y1 >> z1;
+	if (!body || (layout != "dense" && layout != "sparse") || keyword != "bounds" || nx <= 0 || ny <= 0 || nz <= 0) {
+		std::cerr << "ERROR: Malformed volume file '" << filename << "'.\n";
+		return nullptr;
+	}
+
+	auto grid = arena_make<density_grid>(arena, nx, ny, nz, aabb(point3(x0, y0, z0), point3(x1, y1, z1)), arena);
+	if (layout == "dense") {
+		for (size_t n = 0; n < grid->size(); n++) body >> grid->values[n];
+	}
+	else {
+		size_t count = 0;
+		body >> count;
+		for (size_t n = 0; n < count && body; n++) {
+			int i, j, k;
+			float v;
+			body >> i >> j >> k >> v;
+			if (i >= 0 && i < nx && j >= 0 && j < ny && k >= 0 && k < nz)
+				grid->at(i, j, k) = v;
+		}
+	}
+
+	if (!body) {
+		std::cerr << "ERROR: Truncated volume file '" << filename << "'.\n";
+		return nullptr;
+	}
+
+	return grid;
+}
+
+// Heterogeneous medium with density scale * grid density. Free flights are
+// sampled by delta tracking against a coarse grid of per-cell maximum
+// densities, walked with a 3D DDA: empty cells are stepped over at once and
+// dense ones use their own tight bound. An optional boundary clips the
+// medium the way constant_medium's does, e.g. to the dielectric it sits in.
+class grid_medium final : public hittable {
+public:
+	shared_ptr<density_grid> grid;
+	shared_ptr<hittable> boundary;
+	shared_ptr<material> phase_function;
+	real scale;
+
+	// Majorant cells of cell_voxels^3 voxels, their count along each axis
+	// and their maximum densities.
+	int cell_voxels;
+	int mx, my, mz;
+	std::vector<float> majorants;
+public:
+	grid_medium(shared_ptr<density_grid> g, real density_scale, shared_ptr<material> phase,
+		shared_ptr<hittable> b = nullptr, int majorant_cell = 8);
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
+		if (boundary) return boundary->bounding_box(time0, time1, output_box);
+		output_box = grid->bounds;
+		return true;
+	}
+
+private:
+	bool clip(const ray& r, real& t0, real& t1) const;
+};
+
+grid_medium::grid_medium(shared_ptr<density_grid> g, real density_scale, shared_ptr<material> phase,
+	shared_ptr<hittable> b, int majorant_cell)
+	: hittable(hittable_kind::grid_medium), grid(g), boundary(b), phase_function(phase), scale(density_scale),
+	cell_voxels(majorant_cell) {
+	mx = (grid->nx + majorant_cell - 1) / majorant_cell;
+	my = (grid->ny + majorant_cell - 1) / majorant_cell;
+	mz = (grid->nz + majorant_cell - 1) / majorant_cell;
+	majorants.assign(size_t(mx) * my * mz, 0.0f);
+
+	// Interpolation reaches one voxel into the neighbouring cells, so every
+	// voxel counts for the cells within a voxel of it.
+	for (int z = 0; z < grid->nz; z++) {
+		for (int y = 0; y < grid->ny; y++) {
+			for (int x = 0; x < grid->nx; x++) {
+				auto v = grid->at(x, y, z);
+				if (v <= 0) continue;
+
+				for (int cz = std::max(z - 1, 0) / majorant_cell; cz <= std::min(z + 1, grid->nz - 1) / majorant_cell; cz++)
+					for (int cy = std::max(y - 1, 0) / majorant_cell; cy <= std::min(y + 1, grid->ny - 1) / majorant_cell; cy++)
+						for (int cx = std::max(x - 1, 0) / majorant_cell; cx <= std::min(x + 1, grid->nx - 1) / majorant_cell; cx++) {
+							auto& m = majorants[(size_t(cz) * my + cy) * mx + cx];
+							m = std::max(m, v);
+						}
+			}
+		}
+	}
+}
+
+// Parametric range of r inside the grid and the boundary, if any.
+bool grid_medium::clip(const ray& r, real& t0, real& t1) const {
+	for (int a = 0; a < 3; a++) {
+		auto inv_d = 1 / r.direction()[a];
+		auto t_near = (grid->bounds.min()[a] - r.origin()[a]) * inv_d;
+		auto t_far = (grid->bounds.max()[a] - r.origin()[a]) * inv_d;
+		if (inv_d < 0) std::swap(t_near, t_far);
+		t0 = t_near > t0 ? t_near : t0;
+		t1 = t_far < t1 ? t_far : t1;
+		if (t1 <= t0) return false;
+	}
+
+	if (boundary) {
+		hit_record rec1, rec2;
+		ray probe(r.origin(), r.direction(), r.time());
+		if (!hit_dispatch(*boundary, probe, -infinity, infinity, rec1)) return false;
+		if (!hit_dispatch(*boundary, probe, rec1.t + 0.0001, infinity, rec2)) return false;
+		t0 = fmax(t0, rec1.t);
+		t1 = fmin(t1, rec2.t);
+	}
+
+	return t0 < t1;
+}
+
+bool grid_medium::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+	auto t0 = t_min, t1 = t_max;
+	if (!clip(r, t0, t1))
+		return false;
+
+	// DDA over the majorant cells. The last cell along an axis may stick out
+	// of the grid, which is fine since t1 ends the walk at its bounds.
+	int m[3] = { mx, my, mz };
+	int n[3] = { grid->nx, grid->ny, grid->nz };
+	auto extent = grid->bounds.max() - grid->bounds.min();
+	auto start = r.at(t0);
+	int cell[3], step[3];
+	real t_next[3], t_delta[3];
+	for (int a = 0; a < 3; a++) {
+		auto cell_size = extent[a] / n[a] * cell_voxels;
+		auto pos = (start[a] - grid->bounds.min()[a]) / cell_size;
+		cell[a] = std::min(std::max(static_cast<int>(pos), 0), m[a] - 1);
+
+		auto d = r.direction()[a];
+		if (d > 0) {
+			step[a] = 1;
+			t_next[a] = t0 + ((cell[a] + 1) * cell_size + grid->bounds.min()[a] - start[a]) / d;
+			t_delta[a] = cell_size / d;
+		}
+		else if (d < 0) {
+			step[a] = -1;
+			t_next[a] = t0 + (cell[a] * cell_size + grid->bounds.min()[a] - start[a]) / d;
+			t_delta[a] = -cell_size / d;
+		}
+		else {
+			step[a] = 0;
+			t_next[a] = infinity;
+			t_delta[a] = infinity;
+		}
+	}
+
+	const auto ray_length = r.direction().length();
+	auto t = t0;
+	while (true) {
+		int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+		auto t_exit = fmin(t_next[axis], t1);
+
+		auto majorant = scale * majorants[(size_t(cell[2]) * my + cell[1]) * mx + cell[0]];
+		if (majorant > 0) {
+			// Delta tracking: tentative collisions at the majorant's rate,
+			// real ones with probability density / majorant.
+			while (true) {
+				t -= log(1 - random_double()) / (majorant * ray_length);
+				if (t >= t_exit) break;
+
+				auto p = r.at(t);
+				if (random_double() * majorant < scale * grid->density(p)) {
+					rec.t = t;
+					rec.p = p;
+					rec.normal = vec3(1, 0, 0);
+					rec.front_face = true;
+					rec.mat_ptr = phase_function.get();
+					rec.obj = this;
+					return true;
+				}
+			}
+		}
+
+		if (t_exit >= t1)
+			return false;
+
+		t = t_exit;
+		cell[axis] += step[axis];
+		if (cell[axis] < 0 || cell[axis] >= m[axis])
+			return false;
+		t_next[axis] += t_delta[axis];
+	}
+}
+
+// Grid of size n^3 over bounds filled by density(p) at the voxel centers,
+// for procedural volumes.
+shared_ptr<density_grid> make_density_grid(int n, const aabb& bounds, const std::function<real(const point3&)>& density,
+	scene_arena* arena = nullptr) {
+	auto grid = arena_make<density_grid>(arena, n, n, n, bounds, arena);
+	auto extent = bounds.max() - bounds.min();
+	for (int z = 0; z < n; z++) {
+		for (int y = 0; y < n; y++) {
+			for (int x = 0; x < n; x++) {
+				auto p = bounds.min() + vec3(extent.x() * (x + real(0.5)) / n,
+					extent.y() * (y + real(0.5)) / n, extent.z() * (z + real(0.5)) / n);
+				grid->at(x, y, z) = static_cast<float>(density(p));
+			}
+		}
+	}
+	return grid;
+}
+
+#endif
@@ -5,15 +5,20 @@
 #include "aabb.h"
 
 class material;
+class hittable;
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
-    double t;
-
-    double u;
-    double v;
+    const material* mat_ptr;
+    const hittable* obj = nullptr;  // primitive that was hit
+    real t;
+
+    real u;
+    real v;
+    // Texture filter width in (u, v), 0 for a point lookup.
+    real footprint_u = 0;
+    real footprint_v = 0;
     
     bool front_face;
 
@@ -23,30 +28,84 @@ struct hit_record {
     }
 };
 
+// Type tag for the built-in hittables. Hot loops switch on it and call the
+// concrete hit() directly so it can be inlined; anything tagged custom (user
+// extensions) goes through the virtual interface as before. The tagged
+// classes are final, so a user class can't inherit a tag and have its
+// overrides skipped; extensions derive from hittable itself.
+enum class hittable_kind : unsigned char {
+    custom,
+    sphere,
+    moving_sphere,
+    xy_rect,
+    xz_rect,
+    yz_rect,
+    box,
+    hittable_list,
+    bvh_node,
+    translate,
+    rotate_y,
+    constant_medium,
+    grid_medium
+};
+
 class hittable {
 public:
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+    hittable_kind kind;
+    // Ray types this object is hit by, e.g. clear shadow_ray so it casts no
+    // shadows. BVH nodes and instances take theirs from what they hold, so
+    // whole subtrees are skipped; set it before building the BVH. A list's
+    // own mask is applied on top of its children's.
+    unsigned char visibility = all_rays;
+    int light_index = -1;   // position in the scene's light list, -1 if not sampled
+public:
+    hittable(hittable_kind k = hittable_kind::custom) : kind(k) {}
+
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const = 0;
+
+    // Is anything hit in (t_min, t_max)? Aggregates override this to stop at
+    // the first hit instead of searching for the closest one.
+    virtual bool occluded(const ray& r, real t_min, real t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    // Material of a single-surface primitive, nullptr for aggregates. Used to
+    // find the emitters when a scene is built.
+    virtual const material* surface_material() const { return nullptr; }
+
+    // Light sampling: solid angle pdf of direction v seen from o, and a random
+    // direction from o towards this object. Only primitives that can be used
+    // as sampled lights implement them.
+    virtual real pdf_value(const point3& o, const vec3& v) const { return 0; }
+    virtual vec3 random(const point3& o) const { return vec3(1, 0, 0); }
 };
 
+// Defined in dispatch.h once every built-in hittable is known.
+inline bool hit_dispatch(const hittable& h, const ray& r, real t_min, real t_max, hit_record& rec);
+inline bool occluded_dispatch(const hittable& h, const ray& r, real t_min, real t_max);
 
-class translate : public hittable {
+
+class translate final : public hittable {
 public:
     shared_ptr<hittable> ptr;
     vec3 offset;
 public:
     translate(shared_ptr<hittable> p, const vec3& displacement)
-        : ptr(p), offset(displacement) {}
+        : hittable(hittable_kind::translate), ptr(p), offset(displacement) {
+        visibility = p->visibility;
+    }
     
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
 };
 
-bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    ray moved_r(r.origin() - offset, r.direction(), r.time());
+bool translate::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    ray moved_r(r.origin() - offset, r.direction(), r.time(), r.type);
 
-    if (!ptr->hit(moved_r, t_min, t_max, rec)) {
+    if (!hit_dispatch(*ptr, moved_r, t_min, t_max, rec)) {
         return false;
     }
 
@@ -55,7 +114,7 @@ bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
 
     return true;
 }
-bool translate::bounding_box(double time0, double time1, aabb& output_box) const {
+bool translate::bounding_box(real time0, real time1, aabb& output_box) const {
 
     if (!ptr->bounding_box(time0, time1, output_box)) return false;
 
@@ -64,28 +123,29 @@ bool translate::bounding_box(double time0, double time1, aabb& output_box) const
     return true;
 }
 
-class rotate_y : public hittable {
+class rotate_y final : public hittable {
 public:
-    rotate_y(shared_ptr<hittable> p, double angle);
+    rotate_y(shared_ptr<hittable> p, real angle);
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+    virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
         output_box = bbox;
         return hasbox;
     }
 
 public:
     shared_ptr<hittable> ptr;
-    double sin_theta;
-    double cos_theta;
+    real sin_theta;
+    real cos_theta;
     bool hasbox;
     aabb bbox;
 };
 
 
-rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
+rotate_y::rotate_y(shared_ptr<hittable> p, real angle) : hittable(hittable_kind::rotate_y), ptr(p) {
+    visibility = p->visibility;
     auto radians = degrees_to_radians(angle);
     sin_theta = sin(radians);
     cos_theta = cos(radians);
@@ -118,7 +178,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 }
 
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool rotate_y::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto origin = r.origin();
     auto direction = r.direction();
 
@@ -128,9 +188,9 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
     direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
+    ray rotated_r(origin, direction, r.time(), r.type);
 
-    if (!ptr->hit(rotated_r, t_min, t_max, rec))
+    if (!hit_dispatch(*ptr, rotated_r, t_min, t_max, rec))
         return false;
 
     auto p = rec.p;
@@ -9,29 +9,35 @@
 using std::shared_ptr;
 using std::make_shared;
 
-class hittable_list : public hittable {
+class hittable_list final : public hittable {
 public:
 	std::vector<shared_ptr<hittable>> objects;
 public:
-	hittable_list() {}
-	hittable_list(shared_ptr<hittable> object) { add(object); }
+	hittable_list() : hittable(hittable_kind::hittable_list) {}
+	hittable_list(shared_ptr<hittable> object) : hittable(hittable_kind::hittable_list) { add(object); }
 
 	void clear() { objects.clear(); }
 	void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
+
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+	// Uniform mixture of the members, for using the list as a set of lights.
+	virtual real pdf_value(const point3& o, const vec3& v) const override;
+	virtual vec3 random(const point3& o) const override;
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	hit_record temp_rec;
 	bool hit_anything = false;
 
 	auto closest_so_far = t_max;
 
 	for (const auto& object : objects) {
-		if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+		if (hit_dispatch(*object, r, t_min, closest_so_far, temp_rec)) {
 			hit_anything = true;
 			closest_so_far = temp_rec.t;
 			rec = temp_rec;
@@ -41,7 +47,33 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 	return hit_anything;
 }
 
-bool hittable_list ::bounding_box(double time0, double time1, aabb& output_box) const {
+bool hittable_list::occluded(const ray& r, real t_min, real t_max) const {
+	for (const auto& object : objects) {
+		if (occluded_dispatch(*object, r, t_min, t_max)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+real hittable_list::pdf_value(const point3& o, const vec3& v) const {
+	auto weight = real(1) / objects.size();
+	real sum = 0;
+
+	for (const auto& object : objects) {
+		sum += weight * object->pdf_value(o, v);
+	}
+
+	return sum;
+}
+
+vec3 hittable_list::random(const point3& o) const {
+	auto int_size = static_cast<int>(objects.size());
+	return objects[random_int(0, int_size - 1)]->random(o);
+}
+
+bool hittable_list ::bounding_box(real time0, real time1, aabb& output_box) const {
 	if (objects.empty()) return false;
 
 	aabb temp_box;
@@ -0,0 +1,410 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include <algorithm>
+#include <vector>
+
+#include "rtweekend.h"
+#include "color.h"
+
+#include "aarect.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+// Where light can come from and where it can go: the emitters' bounds, a cone
+// (axis, cos_theta_o) holding all their surface normals, and how far around
+// a normal each one emits (cos_theta_e). two_sided emitters light both sides
+// of the cone.
+struct light_bounds {
+	aabb bounds;
+	vec3 axis;
+	real cos_theta_o;
+	real cos_theta_e;
+	real power;
+	bool two_sided;
+
+	// Conservative estimate of the light arriving at p from these emitters,
+	// for a surface with normal n (zero for points inside a medium).
+	real importance(const point3& p, const vec3& n) const;
+};
+
+light_bounds make_light_bounds(const hittable& light);
+light_bounds union_bounds(const light_bounds& a, const light_bounds& b);
+
+// Binary tree over all emitters for picking one in proportion to its
+// estimated contribution at a shading point. Sampling walks down from the
+// root choosing a child by importance, so it costs O(log n) however many
+// lights there are; pmf() walks the same path back up from the leaf.
+class light_bvh {
+public:
+	hittable_list lights;
+public:
+	light_bvh() {}
+	explicit light_bvh(const hittable_list& light_list);
+
+	bool empty() const { return lights.objects.empty(); }
+	size_t size() const { return lights.objects.size(); }
+	size_t node_count() const { return nodes.size(); }
+
+	// Pick a light for p using the uniform number u, nullptr if no light can
+	// reach p.
+	const hittable* sample(const point3& p, const vec3& n, real u, real& pmf) const;
+	real pmf(const point3& p, const vec3& n, const hittable& light) const;
+
+private:
+	struct node {
+		light_bounds lb;
+		// Interior nodes: index of the second child, the first one follows
+		// the node. Leaves: index into lights.
+		int index;
+		bool leaf;
+	};
+
+	struct build_item {
+		light_bounds lb;
+		point3 centroid;
+		int light;
+	};
+
+	int build(std::vector<build_item>& items, size_t start, size_t end);
+
+	std::vector<node> nodes;
+	std::vector<int> parent;
+	std::vector<int> leaf_of_light;
+};
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of
+// the angles a and b, both in [0, pi].
+inline real cos_sub_clamped(real sin_a, real cos_a, real sin_b, real cos_b) {
+	if (cos_a > cos_b) return 1;
+	return cos_a * cos_b + sin_a * sin_b;
+}
+
+inline real sin_sub_clamped(real sin_a, real cos_a, real sin_b, real cos_b) {
+	if (cos_a > cos_b) return 0;
+	return sin_a * cos_b - cos_a * sin_b;
+}
+
+inline real safe_sqrt(real x) {
+	return sqrt(fmax(x, real(0)));
+}
+
+real light_bounds::importance(const point3& p, const vec3& n) const {
+	auto center = (bounds.min() + bounds.max()) / 2;
+	auto radius_squared = (bounds.max() - center).length_squared();
+	auto distance_squared = (p - center).length_squared();
+
+	// Points inside the bounding sphere can be lit from any direction.
+	if (distance_squared <= radius_squared)
+		return power / fmax(distance_squared, (bounds.max() - bounds.min()).length() / 2);
+
+	auto wi = (p - center) / sqrt(distance_squared);
+
+	auto cos_w = dot(axis, wi);
+	if (two_sided) cos_w = fabs(cos_w);
+	auto sin_w = safe_sqrt(1 - cos_w * cos_w);
+
+	// Half angle of the cone the bounding sphere subtends at p.
+	auto sin_b_squared = radius_squared / distance_squared;
+	auto sin_b = sqrt(sin_b_squared);
+	auto cos_b = safe_sqrt(1 - sin_b_squared);
+
+	// Smallest angle between the direction to p and any emitter normal.
+	auto sin_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+	auto cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o);
+	auto sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o);
+	auto cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+	if (cos_p <= cos_theta_e)
+		return 0;
+
+	auto d2 = fmax(distance_squared, (bounds.max() - bounds.min()).length() / 2);
+	auto result = power * cos_p / d2;
+
+	if (n.near_zero())
+		return result;
+
+	auto cos_i = fabs(dot(wi, n));
+	auto sin_i = safe_sqrt(1 - cos_i * cos_i);
+	return fmax(result * cos_sub_clamped(sin_i, cos_i, sin_b, cos_b), real(0));
+}
+
+light_bounds make_light_bounds(const hittable& light) {
+	light_bounds lb;
+	light.bounding_box(0, 1, lb.bounds);
+
+	auto center = (lb.bounds.min() + lb.bounds.max()) / 2;
+	auto mat = light.surface_material();
+	auto radiance = mat ? luminance(emitted_dispatch(*mat, 0.5, 0.5, center)) : real(0);
+
+	// Diffuse emitters: cos_theta_e = cos(pi / 2), power = pi * area * L.
+	lb.cos_theta_e = 0;
+
+	switch (light.kind) {
+	case hittable_kind::sphere: {
+		auto r = static_cast<const sphere&>(light).radius;
+		lb.axis = vec3(0, 0, 1);
+		lb.cos_theta_o = -1;
+		lb.two_sided = false;
+		lb.power = pi * 4 * pi * r * r * radiance;
+		break;
+	}
+	case hittable_kind::xy_rect: {
+		const auto& rect = static_cast<const xy_rect&>(light);
+		lb.axis = vec3(0, 0, 1);
+		lb.cos_theta_o = 1;
+		lb.two_sided = true;
+		lb.power = 2 * pi * (rect.x1 - rect.x0) * (rect.y1 - rect.y0) * radiance;
+		break;
+	}
+	case hittable_kind::xz_rect: {
+		const auto& rect = static_cast<const xz_rect&>(light);
+		lb.axis = vec3(0, 1, 0);
+		lb.cos_theta_o = 1;
+		lb.two_sided = true;
+		lb.power = 2 * pi * (rect.x1 - rect.x0) * (rect.z1 - rect.z0) * radiance;
+		break;
+	}
+	case hittable_kind::yz_rect: {
+		const auto& rect = static_cast<const yz_rect&>(light);
+		lb.axis = vec3(1, 0, 0);
+		lb.cos_theta_o = 1;
+		lb.two_sided = true;
+		lb.power = 2 * pi * (rect.y1 - rect.y0) * (rect.z1 - rect.z0) * radiance;
+		break;
+	}
+	default: {
+		// Unknown shape: emits in every direction from half its box surface.
+		auto d = lb.bounds.max() - lb.bounds.min();
+		lb.axis = vec3(0, 0, 1);
+		lb.cos_theta_o = -1;
+		lb.two_sided = false;
+		lb.power = pi * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x()) * radiance;
+		break;
+	}
+	}
+
+	return lb;
+}
+
+// Rotate v around the unit axis k by the given angle (Rodrigues).
+inline vec3 rotate_around(const vec3& v, const vec3& k, real angle) {
+	auto c = cos(angle);
+	auto s = sin(angle);
+	return c * v + s * cross(k, v) + (1 - c) * dot(k, v) * k;
+}
+
+light_bounds union_bounds(const light_bounds& a, const light_bounds& b) {
+	light_bounds lb;
+	lb.bounds = surrounding_box(a.bounds, b.bounds);
+	lb.cos_theta_e = fmin(a.cos_theta_e, b.cos_theta_e);
+	lb.power = a.power + b.power;
+	lb.two_sided = a.two_sided || b.two_sided;
+
+	// Smallest cone holding both normal cones.
+	auto theta_a = acos(clamp(a.cos_theta_o, -1.0, 1.0));
+	auto theta_b = acos(clamp(b.cos_theta_o, -1.0, 1.0));
+	auto theta_d = acos(clamp(dot(a.axis, b.axis), -1.0, 1.0));
+
+	if (fmin(theta_d + theta_b, pi) <= theta_a) {
+		lb.axis = a.axis;
+		lb.cos_theta_o = a.cos_theta_o;
+		return lb;
+	}
+	if (fmin(theta_d + theta_a, pi) <= theta_b) {
+		lb.axis = b.axis;
+		lb.cos_theta_o = b.cos_theta_o;
+		return lb;
+	}
+
+	auto theta_o = (theta_a + theta_d + theta_b) / 2;
+	auto k = cross(a.axis, b.axis);
+	if (theta_o >= pi || k.near_zero()) {
+		lb.axis = a.axis;
+		lb.cos_theta_o = -1;
+		return lb;
+	}
+
+	lb.axis = unit_vector(rotate_around(a.axis, unit_vector(k), theta_o - theta_a));
+	lb.cos_theta_o = cos(theta_o);
+	return lb;
+}
+
+// Surface area orientation heuristic: like SAH, weighted by power and by the
+// solid angle the emission of the bounds covers.
+inline real light_split_cost(const light_bounds& lb, const aabb& node_bounds, int axis) {
+	auto theta_o = acos(clamp(lb.cos_theta_o, -1.0, 1.0));
+	auto theta_e = acos(clamp(lb.cos_theta_e, -1.0, 1.0));
+	auto theta_w = fmin(theta_o + theta_e, pi);
+	auto sin_o = sin(theta_o);
+	auto m_omega = 2 * pi * (1 - lb.cos_theta_o)
+		+ pi / 2 * (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_o + lb.cos_theta_o);
+
+	auto nd = node_bounds.max() - node_bounds.min();
+	auto kr = fmax(nd.x(), fmax(nd.y(), nd.z())) / fmax(nd[axis], real(1e-6));
+
+	auto d = lb.bounds.max() - lb.bounds.min();
+	auto area = 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+
+	return lb.power * m_omega * kr * area;
+}
+
+light_bvh::light_bvh(const hittable_list& light_list) : lights(light_list) {
+	if (lights.objects.empty())
+		return;
+
+	std::vector<build_item> items;
+	items.reserve(lights.objects.size());
+	for (size_t i = 0; i < lights.objects.size(); i++) {
+		auto lb = make_light_bounds(*lights.objects[i]);
+		items.push_back({ lb, (lb.bounds.min() + lb.bounds.max()) / 2, static_cast<int>(i) });
+	}
+
+	leaf_of_light.assign(items.size(), -1);
+	nodes.reserve(2 * items.size() - 1);
+	parent.reserve(2 * items.size() - 1);
+	build(items, 0, items.size());
+}
+
+int light_bvh::build(std::vector<build_item>& items, size_t start, size_t end) {
+	int index = static_cast<int>(nodes.size());
+	nodes.push_back({});
+	parent.push_back(-1);
+
+	if (end - start == 1) {
+		nodes[index] = { items[start].lb, items[start].light, true };
+		leaf_of_light[items[start].light] = index;
+		return index;
+	}
+
+	light_bounds all = items[start].lb;
+	aabb centroids(items[start].centroid, items[start].centroid);
+	for (size_t i = start + 1; i < end; i++) {
+		all = union_bounds(all, items[i].lb);
+		centroids = surrounding_box(centroids, aabb(items[i].centroid, items[i].centroid));
+	}
+
+	const int bucket_count = 12;
+	real best_cost = infinity;
+	int best_axis = -1;
+	int best_bucket = -1;
+
+	auto extent = centroids.max() - centroids.min();
+	auto bucket_of = [&](const build_item& item, int axis) {
+		int b = static_cast<int>(bucket_count * (item.centroid[axis] - centroids.min()[axis]) / extent[axis]);
+		return std::clamp(b, 0, bucket_count - 1);
+	};
+
+	for (int axis = 0; axis < 3; axis++) {
+		if (extent[axis] <= 0) continue;
+
+		light_bounds buckets[bucket_count];
+		int counts[bucket_count] = {};
+		for (size_t i = start; i < end; i++) {
+			int b = bucket_of(items[i], axis);
+			buckets[b] = counts[b]++ ? union_bounds(buckets[b], items[i].lb) : items[i].lb;
+		}
+
+		// Cost of splitting after each bucket, from both sides.
+		for (int split = 0; split < bucket_count - 1; split++) {
+			light_bounds below, above;
+			int n_below = 0, n_above = 0;
+			for (int b = 0; b <= split; b++) {
+				if (!counts[b]) continue;
+				below = n_below ? union_bounds(below, buckets[b]) : buckets[b];
+				n_below += counts[b];
+			}
+			for (int b = split + 1; b < bucket_count; b++) {
+				if (!counts[b]) continue;
+				above = n_above ? union_bounds(above, buckets[b]) : buckets[b];
+				n_above += counts[b];
+			}
+			if (!n_below || !n_above) continue;
+
+			auto cost = light_split_cost(below, all.bounds, axis) + light_split_cost(above, all.bounds, axis);
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bucket = split;
+			}
+		}
+	}
+
+	size_t mid;
+	if (best_axis >= 0) {
+		auto it = std::partition(items.begin() + start, items.begin() + end,
+			[&](const build_item& item) { return bucket_of(item, best_axis) <= best_bucket; });
+		mid = it - items.begin();
+	}
+	else {
+		// All centroids coincide (or every split costs nothing), halve by count.
+		mid = (start + end) / 2;
+	}
+
+	int first = build(items, start, mid);
+	int second = build(items, mid, end);
+	parent[first] = index;
+	parent[second] = index;
+
+	nodes[index] = { all, second, false };
+	return index;
+}
+
+const hittable* light_bvh::sample(const point3& p, const vec3& n, real u, real& pmf) const {
+	pmf = 0;
+	if (nodes.empty() || nodes[0].lb.importance(p, n) <= 0)
+		return nullptr;
+
+	const real one_minus_epsilon = std::nextafter(real(1), real(0));
+
+	int i = 0;
+	real path_pmf = 1;
+	while (!nodes[i].leaf) {
+		int first = i + 1;
+		int second = nodes[i].index;
+		auto ci0 = nodes[first].lb.importance(p, n);
+		auto ci1 = nodes[second].lb.importance(p, n);
+		if (ci0 <= 0 && ci1 <= 0)
+			return nullptr;
+
+		// Reuse u for the next level after picking a child.
+		auto p0 = ci0 / (ci0 + ci1);
+		if (u < p0) {
+			i = first;
+			u = fmin(u / p0, one_minus_epsilon);
+			path_pmf *= p0;
+		}
+		else {
+			i = second;
+			u = fmin((u - p0) / (1 - p0), one_minus_epsilon);
+			path_pmf *= 1 - p0;
+		}
+	}
+
+	pmf = path_pmf;
+	return lights.objects[nodes[i].index].get();
+}
+
+real light_bvh::pmf(const point3& p, const vec3& n, const hittable& light) const {
+	if (light.light_index < 0 || light.light_index >= static_cast<int>(leaf_of_light.size()))
+		return 0;
+	if (nodes[0].lb.importance(p, n) <= 0)
+		return 0;
+
+	real result = 1;
+	for (int i = leaf_of_light[light.light_index]; parent[i] >= 0; i = parent[i]) {
+		int first = parent[i] + 1;
+		int second = nodes[parent[i]].index;
+		auto ci0 = nodes[first].lb.importance(p, n);
+		auto ci1 = nodes[second].lb.importance(p, n);
+		auto ci = i == first ? ci0 : ci1;
+		if (ci <= 0)
+			return 0;
+
+		result *= ci / (ci0 + ci1);
+	}
+
+	return result;
+}
+
+#endif
@@ -0,0 +1,374 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <algorithm>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "hittable_list.h"
+#include "material.h"
+#include "dispatch.h"
+#include "light_bvh.h"
+#include "onb.h"
+#include "environment.h"
+#include "global_medium.h"
+#include "path_guiding.h"
+
+// Gather every emissive primitive that can be sampled (it implements
+// pdf_value/random) into a light list and tag it with its index, so the
+// integrator can tell a sampled light apart from any other emitter.
+//
+// Next-event estimation stands in for diffuse bounces, so a light hidden
+// from diffuse rays, by its own mask or a list's around it, is left out: it
+// lights nothing, just as the bounces it replaces could never reach it.
+void collect_lights(const hittable_list& world, hittable_list& lights, unsigned char visibility = all_rays) {
+	visibility &= world.visibility;
+	for (const auto& object : world.objects) {
+		if (object->kind == hittable_kind::hittable_list) {
+			collect_lights(static_cast<const hittable_list&>(*object), lights, visibility);
+			continue;
+		}
+		if (!(object->visibility & visibility & diffuse_ray))
+			continue;
+
+		// Moving spheres have no light sampling; they are hit like any
+		// other emitter.
+		auto mat = object->surface_material();
+		if (!mat || !mat->is_emissive() || object->kind == hittable_kind::moving_sphere) continue;
+
+		object->light_index = static_cast<int>(lights.objects.size());
+		lights.add(object);
+	}
+}
+
+hittable_list collect_lights(const hittable_list& world) {
+	hittable_list lights;
+	collect_lights(world, lights);
+	return lights;
+}
+
+// Power heuristic (beta = 2) weight for a sample drawn from the strategy with
+// density pdf_a, when pdf_b could have produced it too.
+inline real power_heuristic(real pdf_a, real pdf_b) {
+	auto a = pdf_a * pdf_a;
+	auto b = pdf_b * pdf_b;
+	return a + b > 0 ? a / (a + b) : 0;
+}
+
+// Everything next-event estimation can sample: the emitters in the light BVH
+// and an optional environment map.
+class scene_lights {
+public:
+	light_bvh bvh;
+	shared_ptr<environment_light> environment;
+public:
+	scene_lights() {}
+	scene_lights(const hittable_list& emitters, shared_ptr<environment_light> env = nullptr)
+		: bvh(emitters), environment(env && env->valid() ? env : nullptr) {}
+
+	bool empty() const { return bvh.empty() && !environment; }
+
+	// Chance of sampling the environment rather than an emitter.
+	real environment_probability() const {
+		if (!environment) return 0;
+		return bvh.empty() ? 1 : real(0.5);
+	}
+};
+
+// Normal the light BVH weighs lights with at rec. Phase functions have no
+// cosine term, so points in a medium get none.
+inline vec3 light_sampling_normal(const hit_record& rec) {
+	if (rec.mat_ptr && rec.mat_ptr->kind == material_kind::isotropic)
+		return vec3(0, 0, 0);
+
+	return rec.normal;
+}
+
+// Density with which sample_direct_light at rec picks direction v towards
+// the light that was hit, or towards the environment.
+inline real light_pdf(const scene_lights& lights, const hittable& light, const hit_record& rec, const vec3& v) {
+	return (1 - lights.environment_probability())
+		* lights.bvh.pmf(rec.p, light_sampling_normal(rec), light) * light.pdf_value(rec.p, v);
+}
+
+inline real environment_pdf(const scene_lights& lights, const vec3& v) {
+	if (!lights.environment) return 0;
+	return lights.environment_probability() * lights.environment->pdf(v);
+}
+
+// A next-event estimate short of its shadow ray: weight * f * radiance / pdf
+// arrives unless something blocks shadow before distance, attenuated by the
+// global medium along it.
+struct light_connection {
+	ray shadow;
+	real distance;
+	real weight;
+	color f;
+	color radiance;
+	real pdf;
+};
+
+bool connect_environment_light(const scene_lights& lights, const ray& r_in, const hit_record& rec,
+	const guided_vertex* guide, light_connection& c) {
+	real pdf;
+	auto direction = lights.environment->sample(pdf);
+	pdf *= lights.environment_probability();
+	if (pdf <= 0)
+		return false;
+
+	auto f = eval_dispatch(*rec.mat_ptr, r_in, rec, direction);
+	if (f.near_zero())
+		return false;
+
+	auto bsdf_pdf = pdf_dispatch(*rec.mat_ptr, r_in, rec, direction);
+	c.shadow = ray(offset_ray_origin(rec.p, rec.normal, direction), direction, r_in.time(), shadow_ray);
+	c.distance = infinity;
+	c.weight = power_heuristic(pdf, guide ? guide->pdf(direction, bsdf_pdf) : bsdf_pdf);
+	c.f = f;
+	c.radiance = lights.environment->radiance(direction);
+	c.pdf = pdf;
+	return true;
+}
+
+// Next-event estimation up to the shadow ray: pick the environment or a
+// light from the light BVH and sample a direction towards it. False when
+// the sample can't contribute. The weight is MIS against the material
+// sampling the same direction, the integrator weights the other half when a
+// bounce hits a light or escapes. With path guiding the bounce density is
+// the guided mixture, so the weights use that.
+bool connect_direct_light(const scene_lights& lights, const ray& r_in, const hit_record& rec,
+	const guided_vertex* guide, light_connection& c) {
+	auto env_probability = lights.environment_probability();
+	if (env_probability > 0 && random_double() < env_probability)
+		return connect_environment_light(lights, r_in, rec, guide, c);
+
+	real pick_pmf;
+	auto light = lights.bvh.sample(rec.p, light_sampling_normal(rec), random_double(), pick_pmf);
+	if (!light)
+		return false;
+
+	auto direction = unit_vector(light->random(rec.p));
+	auto f = eval_dispatch(*rec.mat_ptr, r_in, rec, direction);
+	if (f.near_zero())
+		return false;
+
+	auto pdf = (1 - env_probability) * pick_pmf * light->pdf_value(rec.p, direction);
+	if (pdf <= 0)
+		return false;
+
+	ray shadow(offset_ray_origin(rec.p, rec.normal, direction), direction, r_in.time(), shadow_ray);
+
+	hit_record light_rec;
+	if (!light->hit(shadow, 0.001, infinity, light_rec))
+		return false;
+
+	auto bsdf_pdf = pdf_dispatch(*rec.mat_ptr, r_in, rec, direction);
+	c.shadow = shadow;
+	c.distance = light_rec.t;
+	c.weight = power_heuristic(pdf, guide ? guide->pdf(direction, bsdf_pdf) : bsdf_pdf);
+	c.f = f;
+	c.radiance = emitted_dispatch(*light_rec.mat_ptr, light_rec.u, light_rec.v, light_rec.p);
+	c.pdf = pdf;
+	return true;
+}
+
+// What c delivers once its shadow ray is traced.
+color trace_connection(const hittable& world, const light_connection& c, const global_medium* medium) {
+	if (occluded_dispatch(world, c.shadow, 0.001, c.distance * (1 - 1e-4)))
+		return color(0, 0, 0);
+
+	auto weight = c.weight;
+	if (medium)
+		weight *= medium->transmittance(c.shadow, 0.001, c.distance);
+	return weight * c.f * c.radiance / c.pdf;
+}
+
+// Next-event estimation at rec, the shadow ray traced right away. A global
+// medium attenuates it.
+color sample_direct_light(const hittable& world, const scene_lights& lights,
+	const ray& r_in, const hit_record& rec, const global_medium* medium = nullptr,
+	const guided_vertex* guide = nullptr) {
+	light_connection c;
+	if (!connect_direct_light(lights, r_in, rec, guide, c))
+		return color(0, 0, 0);
+	return trace_connection(world, c, medium);
+}
+
+// Emitters as the start of light paths, for the bidirectional and photon
+// integrators: the spheres and rects of the light list, picked in proportion
+// to their power and sampled uniformly by area. Other emitters can't start
+// a path and get probability 0.
+class emitter_distribution {
+public:
+	emitter_distribution(const hittable_list& emitters);
+
+	bool empty() const { return cdf.empty() || cdf.back() <= 0; }
+	int count() const;
+
+	const hittable* pick(real u, real& pmf) const;
+	real pmf(const hittable& light) const;
+	real area(const hittable& light) const;
+	// Density of starting on a point of light, per unit area.
+	real origin_pdf(const hittable& light) const {
+		auto a = area(light);
+		return a > 0 ? pmf(light) / a : 0;
+	}
+
+	// Uniform point on the light: position, outward normal, the texture
+	// coordinates of its emission, material and object.
+	bool sample_point(const hittable& light, hit_record& rec) const;
+
+	// Cosine weighted emission direction at a point with outward normal n.
+	// Rects emit from both faces, spheres only outwards.
+	vec3 sample_direction(const hittable& light, const vec3& n, real& pdf) const;
+	real direction_pdf(const hittable& light, const vec3& n, const vec3& w) const;
+	static bool emits_towards(const hittable& light, const vec3& n, const vec3& w) {
+		return light.kind != hittable_kind::sphere || dot(n, w) > 0;
+	}
+
+private:
+	const hittable_list& emitters;
+	std::vector<real> cdf;    // by light_index
+	std::vector<real> areas;
+};
+
+emitter_distribution::emitter_distribution(const hittable_list& emitters) : emitters(emitters) {
+	real total = 0;
+	for (const auto& light : emitters.objects) {
+		real a = 0;
+		switch (light->kind) {
+		case hittable_kind::sphere: {
+			auto radius = static_cast<const sphere&>(*light).radius;
+			a = 4 * pi * radius * radius;
+			break;
+		}
+		case hittable_kind::xy_rect: {
+			const auto& rect = static_cast<const xy_rect&>(*light);
+			a = (rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+			break;
+		}
+		case hittable_kind::xz_rect: {
+			const auto& rect = static_cast<const xz_rect&>(*light);
+			a = (rect.x1 - rect.x0) * (rect.z1 - rect.z0);
+			break;
+		}
+		case hittable_kind::yz_rect: {
+			const auto& rect = static_cast<const yz_rect&>(*light);
+			a = (rect.y1 - rect.y0) * (rect.z1 - rect.z0);
+			break;
+		}
+		default:
+			break;
+		}
+
+		areas.push_back(a);
+		if (a > 0)
+			total += fmax(make_light_bounds(*light).power, real(0));
+		cdf.push_back(total);
+	}
+
+	for (auto& c : cdf) {
+		c = total > 0 ? c / total : 0;
+	}
+}
+
+int emitter_distribution::count() const {
+	int n = 0;
+	for (const auto& light : emitters.objects) {
+		if (pmf(*light) > 0)
+			n++;
+	}
+	return n;
+}
+
+const hittable* emitter_distribution::pick(real u, real& pmf_out) const {
+	if (empty())
+		return nullptr;
+
+	auto index = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+	index = std::min<ptrdiff_t>(index, cdf.size() - 1);
+	auto light = emitters.objects[index].get();
+	pmf_out = pmf(*light);
+	return pmf_out > 0 ? light : nullptr;
+}
+
+real emitter_distribution::pmf(const hittable& light) const {
+	auto i = light.light_index;
+	if (i < 0 || i >= static_cast<int>(cdf.size()))
+		return 0;
+	return cdf[i] - (i > 0 ? cdf[i - 1] : 0);
+}
+
+real emitter_distribution::area(const hittable& light) const {
+	auto i = light.light_index;
+	if (i < 0 || i >= static_cast<int>(areas.size()))
+		return 0;
+	return areas[i];
+}
+
+bool emitter_distribution::sample_point(const hittable& light, hit_record& rec) const {
+	rec.obj = &light;
+	rec.mat_ptr = light.surface_material();
+	rec.front_face = true;
+
+	switch (light.kind) {
+	case hittable_kind::sphere: {
+		const auto& s = static_cast<const sphere&>(light);
+		auto d = random_unit_vector();
+		rec.p = s.center + s.radius * d;
+		rec.normal = d;
+		sphere::get_sphere_uv(d, rec.u, rec.v);
+		break;
+	}
+	case hittable_kind::xy_rect: {
+		const auto& rect = static_cast<const xy_rect&>(light);
+		rec.u = random_double();
+		rec.v = random_double();
+		rec.p = point3(rect.x0 + rec.u * (rect.x1 - rect.x0), rect.y0 + rec.v * (rect.y1 - rect.y0), rect.k);
+		rec.normal = vec3(0, 0, 1);
+		break;
+	}
+	case hittable_kind::xz_rect: {
+		const auto& rect = static_cast<const xz_rect&>(light);
+		rec.u = random_double();
+		rec.v = random_double();
+		rec.p = point3(rect.x0 + rec.u * (rect.x1 - rect.x0), rect.k, rect.z0 + rec.v * (rect.z1 - rect.z0));
+		rec.normal = vec3(0, 1, 0);
+		break;
+	}
+	case hittable_kind::yz_rect: {
+		const auto& rect = static_cast<const yz_rect&>(light);
+		rec.u = random_double();
+		rec.v = random_double();
+		rec.p = point3(rect.k, rect.y0 + rec.u * (rect.y1 - rect.y0), rect.z0 + rec.v * (rect.z1 - rect.z0));
+		rec.normal = vec3(1, 0, 0);
+		break;
+	}
+	default:
+		return false;
+	}
+
+	return rec.mat_ptr != nullptr;
+}
+
+vec3 emitter_distribution::sample_direction(const hittable& light, const vec3& n, real& pdf) const {
+	auto side = n;
+	if (light.kind != hittable_kind::sphere && random_double() < 0.5)
+		side = -side;
+
+	onb uvw;
+	uvw.build_from_w(side);
+	auto direction = uvw.local(random_cosine_direction());
+	pdf = direction_pdf(light, n, direction);
+	return direction;
+}
+
+real emitter_distribution::direction_pdf(const hittable& light, const vec3& n, const vec3& w) const {
+	auto cos_theta = dot(n, w);
+	if (light.kind == hittable_kind::sphere)
+		return cos_theta > 0 ? cos_theta / pi : 0;
+	return fabs(cos_theta) / (2 * pi);
+}
+
+#endif
@@ -1,12 +1,14 @@
 ﻿// BlazeTracer.cpp : Defines the entry point for the application.
 //
 
+#include <array>
 #include <iostream>
 #include <fstream>
 #include <thread>
 #include <chrono>
 #include <map>
 #include <sstream>
+#include <utility>
 
 #include "rtweekend.h"
 
@@ -22,13 +24,26 @@
 #include "box.h"
 
 #include "constant_medium.h"
-
-hittable_list random_scene() {
+#include "arena.h"
+#include "dispatch.h"
+#include "lights.h"
+#include "bdpt.h"
+#include "sppm.h"
+#include "wavefront.h"
+#include "radiance_cache.h"
+#include "ray_packet.h"
+#include "scene_features.h"
+#include "sampler.h"
+#include "denoiser.h"
+#include "texture_bake.h"
+#include "texture_program.h"
+
+hittable_list random_scene(scene_arena& arena) {
 	hittable_list world;
 
-	auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-	auto ground_material = make_shared<lambertian>(checker);
-	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+	auto checker = arena.make<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9), &arena);
+	auto ground_material = arena.make<lambertian>(checker);
+	world.add(arena.make<sphere>(point3(0, -1000, 0), 1000, ground_material));
 
 	for (int a = -11; a < 11; a++) {
 		for (int b = -11; b < 11; b++) {
@@ -41,9 +56,9 @@ hittable_list random_scene() {
 				if (choose_mat < 0.8) {
 					// diffuse
 					auto albedo = color::random() * color::random();
-					sphere_material = make_shared<lambertian>(albedo);
+					sphere_material = arena.make<lambertian>(albedo, &arena);
 					auto center2 = center + vec3(0, random_double(0, .5), 0);
-					world.add(make_shared<moving_sphere>(
+					world.add(arena.make<moving_sphere>(
 						center, center2, 0.0, 1.0, 0.2, sphere_material));
 
 				}
@@ -51,175 +66,175 @@ hittable_list random_scene() {
 					// metal
 					auto albedo = color::random(0.5, 1);
 					auto fuzz = random_double(0, 0.5);
-					sphere_material = make_shared<metal>(albedo, fuzz);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = arena.make<metal>(albedo, fuzz);
+					world.add(arena.make<sphere>(center, 0.2, sphere_material));
 				}
 				else {
 					// glass
-					sphere_material = make_shared<dielectric>(1.5);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = arena.make<dielectric>(1.5);
+					world.add(arena.make<sphere>(center, 0.2, sphere_material));
 				}
 			}
 		}
 	}
 
-	auto material1 = make_shared<dielectric>(1.5);
-	world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+	auto material1 = arena.make<dielectric>(1.5);
+	world.add(arena.make<sphere>(point3(0, 1, 0), 1.0, material1));
 
-	auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-	world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+	auto material2 = arena.make<lambertian>(color(0.4, 0.2, 0.1), &arena);
+	world.add(arena.make<sphere>(point3(-4, 1, 0), 1.0, material2));
 
-	auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-	world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+	auto material3 = arena.make<metal>(color(0.7, 0.6, 0.5), 0.0);
+	world.add(arena.make<sphere>(point3(4, 1, 0), 1.0, material3));
 
 	return world;
 }
 
-hittable_list two_spheres() {
+hittable_list two_spheres(scene_arena& arena) {
 	hittable_list objects;
 
-	auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+	auto checker = arena.make<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9), &arena);
 
-	objects.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-	objects.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+	objects.add(arena.make<sphere>(point3(0, -10, 0), 10, arena.make<lambertian>(checker)));
+	objects.add(arena.make<sphere>(point3(0, 10, 0), 10, arena.make<lambertian>(checker)));
 
 	return objects;
 }
 
-hittable_list two_perlin_spheres() {
+hittable_list two_perlin_spheres(scene_arena& arena) {
 	hittable_list objects;
 
-	auto pertext = make_shared<noise_texture>(4.0);
-	objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-	objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+	auto pertext = arena.make<noise_texture>(4.0);
+	objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, arena.make<lambertian>(pertext)));
+	objects.add(arena.make<sphere>(point3(0, 2, 0), 2, arena.make<lambertian>(pertext)));
 
 	return objects;
 }
 
-hittable_list earth() {
-	auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-	auto earth_surface = make_shared<diffuse_light>(earth_texture);
-	auto globe = make_shared<sphere>(point3(0, 0, 0), 2, earth_surface);
+hittable_list earth(scene_arena& arena) {
+	auto earth_texture = arena.make<image_texture>("earthmap.jpg");
+	auto earth_surface = arena.make<diffuse_light>(earth_texture);
+	auto globe = arena.make<sphere>(point3(0, 0, 0), 2, earth_surface);
 
 	return hittable_list(globe);
 }
 
-hittable_list simple_light() {
+hittable_list simple_light(scene_arena& arena) {
 	hittable_list objects;
 
-	auto pertext = make_shared<noise_texture>(4);
-	objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-	objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
-	objects.add(make_shared<sphere>(point3(0, 6, 0), 1, make_shared<diffuse_light>(color(4,0,0))));
+	auto pertext = arena.make<noise_texture>(4);
+	objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, arena.make<lambertian>(pertext)));
+	objects.add(arena.make<sphere>(point3(0, 2, 0), 2, arena.make<lambertian>(pertext)));
+	objects.add(arena.make<sphere>(point3(0, 6, 0), 1, arena.make<diffuse_light>(color(4,0,0), &arena)));
 
 
-	auto difflight = make_shared<diffuse_light>(color(4, 4, 4));
-	objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
+	auto difflight = arena.make<diffuse_light>(color(4, 4, 4), &arena);
+	objects.add(arena.make<xy_rect>(3, 5, 1, 3, -2, difflight));
 
 	return objects;
 }
 
-hittable_list cornell_box() {
+hittable_list cornell_box(scene_arena& arena) {
 	hittable_list objects;
 
-	auto red = make_shared<lambertian>(color(.65, .05, .05));
-	auto white = make_shared<lambertian>(color(.73, .73, .73));
-	auto green = make_shared<lambertian>(color(.12, .45, .15));
-	auto light = make_shared<diffuse_light>(color(15, 15, 15));
-
-	objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-	objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-	objects.add(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
-	objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-	objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-	objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
-
-	shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-	box1 = make_shared<rotate_y>(box1, 15);
-	box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+	auto red = arena.make<lambertian>(color(.65, .05, .05), &arena);
+	auto white = arena.make<lambertian>(color(.73, .73, .73), &arena);
+	auto green = arena.make<lambertian>(color(.12, .45, .15), &arena);
+	auto light = arena.make<diffuse_light>(color(15, 15, 15), &arena);
+
+	objects.add(arena.make<yz_rect>(0, 555, 0, 555, 555, green));
+	objects.add(arena.make<yz_rect>(0, 555, 0, 555, 0, red));
+	objects.add(arena.make<xz_rect>(213, 343, 227, 332, 554, light));
+	objects.add(arena.make<xz_rect>(0, 555, 0, 555, 0, white));
+	objects.add(arena.make<xz_rect>(0, 555, 0, 555, 555, white));
+	objects.add(arena.make<xy_rect>(0, 555, 0, 555, 555, white));
+
+	shared_ptr<hittable> box1 = arena.make<box>(point3(0, 0, 0), point3(165, 330, 165), white, &arena);
+	box1 = arena.make<rotate_y>(box1, 15);
+	box1 = arena.make<translate>(box1, vec3(265, 0, 295));
 	objects.add(box1);
 
-	shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-	box2 = make_shared<rotate_y>(box2, -18);
-	box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+	shared_ptr<hittable> box2 = arena.make<box>(point3(0, 0, 0), point3(165, 165, 165), white, &arena);
+	box2 = arena.make<rotate_y>(box2, -18);
+	box2 = arena.make<translate>(box2, vec3(130, 0, 65));
 	objects.add(box2);
 
 	return objects;
 }
 
-hittable_list cornell_smoke() {
+hittable_list cornell_smoke(scene_arena& arena) {
 	hittable_list objects;
 
-	auto red = make_shared<lambertian>(color(.65, .05, .05));
-	auto white = make_shared<lambertian>(color(.73, .73, .73));
-	auto green = make_shared<lambertian>(color(.12, .45, .15));
-	auto light = make_shared<diffuse_light>(color(7, 7, 7));
+	auto red = arena.make<lambertian>(color(.65, .05, .05), &arena);
+	auto white = arena.make<lambertian>(color(.73, .73, .73), &arena);
+	auto green = arena.make<lambertian>(color(.12, .45, .15), &arena);
+	auto light = arena.make<diffuse_light>(color(7, 7, 7), &arena);
 
-	objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-	objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-	objects.add(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-	objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-	objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-	objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+	objects.add(arena.make<yz_rect>(0, 555, 0, 555, 555, green));
+	objects.add(arena.make<yz_rect>(0, 555, 0, 555, 0, red));
+	objects.add(arena.make<xz_rect>(113, 443, 127, 432, 554, light));
+	objects.add(arena.make<xz_rect>(0, 555, 0, 555, 555, white));
+	objects.add(arena.make<xz_rect>(0, 555, 0, 555, 0, white));
+	objects.add(arena.make<xy_rect>(0, 555, 0, 555, 555, white));
 
-	shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-	box1 = make_shared<rotate_y>(box1, 15);
-	box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+	shared_ptr<hittable> box1 = arena.make<box>(point3(0, 0, 0), point3(165, 330, 165), white, &arena);
+	box1 = arena.make<rotate_y>(box1, 15);
+	box1 = arena.make<translate>(box1, vec3(265, 0, 295));
 
-	shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-	box2 = make_shared<rotate_y>(box2, -18);
-	box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+	shared_ptr<hittable> box2 = arena.make<box>(point3(0, 0, 0), point3(165, 165, 165), white, &arena);
+	box2 = arena.make<rotate_y>(box2, -18);
+	box2 = arena.make<translate>(box2, vec3(130, 0, 65));
 
-	objects.add(make_shared<constant_medium>(box1, 0.01, color(0, 0, 0)));
-	objects.add(make_shared<constant_medium>(box2, 0.01, color(1, 1, 1)));
+	objects.add(arena.make<constant_medium>(box1, 0.01, arena.make<isotropic>(color(0, 0, 0), &arena)));
+	objects.add(arena.make<constant_medium>(box2, 0.01, arena.make<isotropic>(color(1, 1, 1), &arena)));
 
 	return objects;
 }
 
-hittable_list my_scene() {
+hittable_list my_scene(scene_arena& arena) {
 	hittable_list objects;
-	auto white = make_shared<lambertian>(color(.73, .73, .73));
+	auto white = arena.make<lambertian>(color(.73, .73, .73), &arena);
 
-	//auto pertext = make_shared<noise_texture>(6);
-	objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.9, 0.9, 0.9))));
+	//auto pertext = arena.make<noise_texture>(6);
+	objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, arena.make<lambertian>(color(0.9, 0.9, 0.9), &arena)));
 	//Sun
 	
-	//objects.add(make_shared<sphere>(point3(4, 2, 4), 1, make_shared<diffuse_light>(color(1, 0.8, 0.3) * 10.0 )));
+	//objects.add(arena.make<sphere>(point3(4, 2, 4), 1, arena.make<diffuse_light>(color(1, 0.8, 0.3) * 10.0 )));
 
 	auto earthPos = point3(0, 4.2, 0);
 	auto sunPos = point3(0, 15, 0);
-	auto glass = make_shared<dielectric>(1.3);
-	auto boxmat = make_shared<lambertian>(color(0.3, 0.0, 0.0));
+	auto glass = arena.make<dielectric>(1.3);
+	auto boxmat = arena.make<lambertian>(color(0.3, 0.0, 0.0), &arena);
 	//EARTH Ball
-	objects.add(make_shared<sphere>(earthPos, 2, glass));
-	auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
-	shared_ptr<hittable> earth = make_shared<sphere>(earthPos, 1.2, emat);
+	objects.add(arena.make<sphere>(earthPos, 2, glass));
+	auto emat = arena.make<lambertian>(arena.make<image_texture>("earthmap.jpg"));
+	shared_ptr<hittable> earth = arena.make<sphere>(earthPos, 1.2, emat);
 	
 	objects.add(earth);
 
 
 	//SunBall
-	//objects.add(make_shared<sphere>(sunPos, 2, make_shared<dielectric>(1.3)));
-	auto lightMat = make_shared<diffuse_light>(color(1.0, 1.0, 1.04) * 10.0);
-	objects.add(make_shared<sphere>(sunPos, 4, lightMat));
-	auto fogSphere = make_shared<sphere>(sunPos, 1.8, white);
+	//objects.add(arena.make<sphere>(sunPos, 2, arena.make<dielectric>(1.3)));
+	auto lightMat = arena.make<diffuse_light>(color(1.0, 1.0, 1.04) * 10.0, &arena);
+	objects.add(arena.make<sphere>(sunPos, 4, lightMat));
+	auto fogSphere = arena.make<sphere>(sunPos, 1.8, white);
 	
 
-	shared_ptr<hittable> box1 = make_shared<box>(point3(-2, 0.0, -2), point3(2, 2.0, 2), boxmat);
+	shared_ptr<hittable> box1 = arena.make<box>(point3(-2, 0.0, -2), point3(2, 2.0, 2), boxmat, &arena);
 	objects.add(box1);
 
-	shared_ptr<hittable> box2 = make_shared<box>(point3(-2, 2.0, -2), point3(2, 2.5, 2), white);
-	objects.add(make_shared<constant_medium>(box2, 0.5, color(1, 1, 1)));
+	shared_ptr<hittable> box2 = arena.make<box>(point3(-2, 2.0, -2), point3(2, 2.5, 2), white, &arena);
+	objects.add(arena.make<constant_medium>(box2, 0.5, arena.make<isotropic>(color(1, 1, 1), &arena)));
 
-	auto difflight = make_shared<diffuse_light>(color(1, 1, 1) * 10.2);
-	//objects.add(make_shared<xz_rect>(-3, 3, -3, 3, 9, difflight));
+	auto difflight = arena.make<diffuse_light>(color(1, 1, 1) * 10.2, &arena);
+	//objects.add(arena.make<xz_rect>(-3, 3, -3, 3, 9, difflight));
 
 	return objects;
 }
 
-hittable_list final_scene() {
+hittable_list final_scene(scene_arena& arena) {
 	hittable_list boxes1;
-	auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+	auto ground = arena.make<lambertian>(color(0.48, 0.83, 0.53), &arena);
 
 	const int boxes_per_side = 20;
 	for (int i = 0; i < boxes_per_side; i++) {
@@ -232,48 +247,46 @@ hittable_list final_scene() {
 			auto y1 = random_double(1, 101);
 			auto z1 = z0 + w;
 
-			boxes1.add(make_shared<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
+			boxes1.add(arena.make<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground, &arena));
 		}
 	}
 
 	hittable_list objects;
 
-	objects.add(make_shared<bvh_node>(boxes1, 0, 1));
+	objects.add(arena.make<bvh_node>(boxes1, 0, 1, &arena));
 
-	auto light = make_shared<diffuse_light>(color(7, 7, 7));
-	objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
+	auto light = arena.make<diffuse_light>(color(7, 7, 7), &arena);
+	objects.add(arena.make<xz_rect>(123, 423, 147, 412, 554, light));
 
 	auto center1 = point3(400, 400, 200);
 	auto center2 = center1 + vec3(30, 0, 0);
-	auto moving_sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
-	objects.add(make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+	auto moving_sphere_material = arena.make<lambertian>(color(0.7, 0.3, 0.1), &arena);
+	objects.add(arena.make<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
 
-	objects.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-	objects.add(make_shared<sphere>(
-		point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
+	objects.add(arena.make<sphere>(point3(260, 150, 45), 50, arena.make<dielectric>(1.5)));
+	objects.add(arena.make<sphere>(
+		point3(0, 150, 145), 50, arena.make<metal>(color(0.8, 0.8, 0.9), 1.0)
 		));
 
-	auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, make_shared<dielectric>(1.5));
+	auto boundary = arena.make<sphere>(point3(360, 150, 145), 70, arena.make<dielectric>(1.5));
 	objects.add(boundary);
-	objects.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-	boundary = make_shared<sphere>(point3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
-	objects.add(make_shared<constant_medium>(boundary, .0001, color(1, 1, 1)));
+	objects.add(arena.make<constant_medium>(boundary, 0.2, arena.make<isotropic>(color(0.2, 0.4, 0.9), &arena)));
 
-	auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
-	objects.add(make_shared<sphere>(point3(400, 200, 400), 100, emat));
-	auto pertext = make_shared<noise_texture>(0.1);
-	objects.add(make_shared<sphere>(point3(220, 280, 300), 80, make_shared<lambertian>(pertext)));
+	auto emat = arena.make<lambertian>(arena.make<image_texture>("earthmap.jpg"));
+	objects.add(arena.make<sphere>(point3(400, 200, 400), 100, emat));
+	auto pertext = arena.make<noise_texture>(0.1);
+	objects.add(arena.make<sphere>(point3(220, 280, 300), 80, arena.make<lambertian>(pertext)));
 
 	hittable_list boxes2;
-	auto white = make_shared<lambertian>(color(.73, .73, .73));
+	auto white = arena.make<lambertian>(color(.73, .73, .73), &arena);
 	int ns = 1000;
 	for (int j = 0; j < ns; j++) {
-		boxes2.add(make_shared<sphere>(point3::random(0, 165), 10, white));
+		boxes2.add(arena.make<sphere>(point3::random(0, 165), 10, white));
 	}
 
-	objects.add(make_shared<translate>(
-		make_shared<rotate_y>(
-			make_shared<bvh_node>(boxes2, 0.0, 1.0), 15),
+	objects.add(arena.make<translate>(
+		arena.make<rotate_y>(
+			arena.make<bvh_node>(boxes2, 0.0, 1.0, &arena), 15),
 		vec3(-100, 270, 395)
 		)
 	);
@@ -281,29 +294,190 @@ hittable_list final_scene() {
 	return objects;
 }
 
+hittable_list environment_scene(scene_arena& arena) {
+	hittable_list objects;
+
+	auto ground = arena.make<lambertian>(color(0.5, 0.5, 0.5), &arena);
+	objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, ground));
+
+	objects.add(arena.make<sphere>(point3(-4, 1, 0), 1.0, arena.make<lambertian>(color(0.8, 0.3, 0.2), &arena)));
+	objects.add(arena.make<sphere>(point3(0, 1, 0), 1.0, arena.make<dielectric>(1.5)));
+	objects.add(arena.make<sphere>(point3(4, 1, 0), 1.0, arena.make<metal>(color(0.8, 0.8, 0.8), 0.2)));
+
+	return objects;
+}
+
+// Turbulent puff of radius r around center on a density grid.
+shared_ptr<density_grid> cloud_grid(const point3& center, real r, const perlin& noise, scene_arena& arena) {
+	auto bounds = aabb(center - vec3(r, r, r), center + vec3(r, r, r));
+	return make_density_grid(64, bounds, [&](const point3& p) {
+		auto q = (p - center) / r;
+		auto falloff = 1 - q.length();
+		if (falloff <= 0) return real(0);
+		return fmax(real(0), 2 * falloff + noise.turb(3 * q) - real(0.7));
+	}, &arena);
+}
+
+hittable_list cloud_scene(scene_arena& arena) {
+	hittable_list objects;
+	perlin noise;
+
+	auto ground = arena.make<lambertian>(color(0.5, 0.5, 0.5), &arena);
+	objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, ground));
+	objects.add(arena.make<xz_rect>(-2, 2, -2, 2, 6, arena.make<diffuse_light>(color(8, 8, 8), &arena)));
+
+	// One cloud sealed in glass, one in the open.
+	auto glass_center = point3(-2.2, 1.6, 0);
+	auto glass = arena.make<sphere>(glass_center, 1.5, arena.make<dielectric>(1.5));
+	objects.add(glass);
+	objects.add(arena.make<grid_medium>(cloud_grid(glass_center, 1.45, noise, arena), 4,
+		arena.make<isotropic>(color(0.9, 0.9, 0.9), &arena), glass));
+
+	objects.add(arena.make<grid_medium>(cloud_grid(point3(2.2, 1.6, 0), 1.5, noise, arena), 4,
+		arena.make<isotropic>(color(0.95, 0.85, 0.8), &arena)));
+
+	return objects;
+}
+
 
 
 //TRACING
-color ray_color(const ray& r, const color& background, const hittable& world, int depth) {
+// Both come in a kernel per combination of scene features; the default has
+// them all on.
+template <scene_features enabled = scene_features{}>
+color shade(const ray& r, bool hit, hit_record& rec, const color& background, const hittable& world,
+	const scene_lights& lights, const global_medium& medium, path_guide* guide, radiance_cache* cache, int depth, real bsdf_pdf = 0, const hit_record* from = nullptr,
+	pixel_features* features = nullptr, ray_cone cone = ray_cone());
+
+template <scene_features enabled = scene_features{}>
+color ray_color(const ray& r, const color& background, const hittable& world,
+	const scene_lights& lights, const global_medium& medium, path_guide* guide, radiance_cache* cache, int depth, real bsdf_pdf = 0, const hit_record* from = nullptr,
+	pixel_features* features = nullptr, ray_cone cone = ray_cone()) {
 	hit_record rec;
 	
 
 	if (depth <= 0) {
 		return color(0, 0, 0);
 	}
-	if (!world.hit(r, 0.001, infinity, rec))
-		return background;
 
-	ray scattered;
-	color attenuation;
-	color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+	bool hit = hit_dispatch(world, r, 0.001, infinity, rec);
+	return shade<enabled>(r, hit, rec, background, world, lights, medium, guide, cache, depth, bsdf_pdf, from, features, cone);
+}
+
+// Radiance along r given what it hit, e.g. by a ray packet.
+template <scene_features enabled>
+color shade(const ray& r, bool hit, hit_record& rec, const color& background, const hittable& world,
+	const scene_lights& lights, const global_medium& medium, path_guide* guide, radiance_cache* cache, int depth, real bsdf_pdf,
+	const hit_record* from, pixel_features* features, ray_cone cone) {
+	// The global medium may scatter the ray before it gets there.
+	if constexpr (enabled.media) {
+		if (medium.active() && medium.sample(r, 0.001, hit ? rec.t : infinity, rec)) {
+			hit = true;
+		}
+	}
+
+	if (!hit) {
+		auto sky = lights.environment ? lights.environment->radiance(r.direction()) : background;
+		if (features) {
+			features->albedo = color(fmin(sky.x(), 1.0), fmin(sky.y(), 1.0), fmin(sky.z(), 1.0));
+			features->normal = vec3(0, 0, 0);
+		}
+
+		if (!lights.environment)
+			return background;
 
+		if (bsdf_pdf > 0)
+			sky *= power_heuristic(bsdf_pdf, environment_pdf(lights, r.direction()));
+		return sky;
+	}
 
-	if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
+	// Texture footprint from the cone width at the hit, stretched by grazing
+	// angles the way the pixel's projection on the surface is.
+	if constexpr (enabled.filtered_textures) {
+		auto distance = rec.t * r.direction().length();
+		cone.width = cone.width_at(distance);
+		if (cone.width > 0) {
+			real length_u, length_v;
+			surface_uv_lengths(rec, length_u, length_v);
+			if (length_u > 0 && length_v > 0) {
+				auto cos_theta = fabs(dot(r.direction(), rec.normal)) / r.direction().length();
+				auto width = cone.width / fmax(cos_theta, real(0.05));
+				rec.footprint_u = width / length_u;
+				rec.footprint_v = width / length_v;
+			}
+		}
+	}
+
+	if (features) {
+		features->albedo = albedo_dispatch(*rec.mat_ptr, rec);
+		features->normal = rec.normal;
+	}
+
+	// bsdf_pdf is the density of the bounce at from that got here, 0 after a
+	// specular bounce or for camera rays. Lights that next-event estimation
+	// could have sampled are MIS weighted against it.
+	color emitted(0, 0, 0);
+	if constexpr (enabled.emitters) {
+		emitted = emitted_dispatch(*rec.mat_ptr, rec.u, rec.v, rec.p);
+		if (bsdf_pdf > 0 && rec.obj && rec.obj->light_index >= 0) {
+			emitted *= power_heuristic(bsdf_pdf, light_pdf(lights, *rec.obj, *from, r.direction()));
+		}
+	}
+
+	// Deep enough into the path, diffuse vertices take what light leaves
+	// them from the radiance cache instead of bouncing on.
+	bool cached = cache && radiance_cache::caches(*rec.mat_ptr);
+	color reflected;
+	if (cached && cache->terminates(depth) && cache->lookup(r, rec, reflected)) {
+		return emitted + reflected;
+	}
+
+	bsdf_sample s;
+	if (!sample_dispatch(*rec.mat_ptr, r, rec, s)) {
 		return emitted;
 	}
+	s.scattered.type = s.is_specular ? specular_ray : diffuse_ray;
+
+	// Path guiding: once the region around rec has learned where light comes
+	// from, the bounce is drawn from that or from the BSDF (one-sample MIS)
+	// and weighted by the density of the mixture.
+	guided_vertex guided;
+	if (guide && !s.is_specular) {
+		guided = guide->at(rec.p);
+		if (guided.guided()) {
+			if (random_double() >= guided.bsdf_fraction) {
+				auto direction = guided.sample();
+				s.scattered = ray(offset_ray_origin(rec.p, rec.normal, direction), direction, r.time(), diffuse_ray);
+			}
+			auto wi = unit_vector(s.scattered.direction());
+			s.pdf = guided.pdf(wi, pdf_dispatch(*rec.mat_ptr, r, rec, wi));
+			s.weight = s.pdf > 0 ? eval_dispatch(*rec.mat_ptr, r, rec, wi) / s.pdf : color(0, 0, 0);
+		}
+	}
+
+	color direct(0, 0, 0);
+	if (!lights.empty() && !s.is_specular) {
+		direct = sample_direct_light(world, lights, r, rec, enabled.media ? &medium : nullptr, guided.guided() ? &guided : nullptr);
+	}
+	if (guided.guided() && s.weight.near_zero()) {
+		if (cached) cache->record(r, rec, direct);
+		return emitted + direct;
+	}
 
-	return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
+	bool weighted = !lights.empty() && !s.is_specular;
+	color incoming = ray_color<enabled>(s.scattered, background, world, lights, medium, guide, cache, depth - 1,
+		weighted ? s.pdf : 0, weighted ? &rec : nullptr, nullptr, cone);
+
+	if (guided.recorder) {
+		guided.record(unit_vector(s.scattered.direction()), luminance(incoming), s.pdf);
+	}
+
+	reflected = direct + s.weight * incoming;
+	if (cached) {
+		cache->record(r, rec, reflected);
+	}
+
+	return emitted + reflected;
 
 	//vec3 unit_direction = unit_vector(r.direction());
 	//auto t = 0.5 * (unit_direction.y() + 1.0);
@@ -312,35 +486,141 @@ color ray_color(const ray& r, const color& background, const hittable& world, in
 
 
 
+enum class integrator_kind { path, bdpt, sppm, wavefront };
+
 int threadsDone = 0;
 std::map<std::thread::id, double> threadProgress;
 
-void thread_trace(std::vector<std::vector<color>>& colors, color& bg, hittable& world, camera cam,
+template <scene_features enabled>
+void thread_trace(std::vector<std::vector<color>>& colors, feature_buffers& features, color& bg, hittable& world,
+	const scene_lights& lights, const global_medium& medium, path_guide* guide, radiance_cache* cache,
+	const bdpt_integrator* bdpt, splat_buffer* splats, const packet_bvh* packets,
+	camera cam, sampler_kind sampler_type, uint32_t seed,
 	int max_depth, int start_line, int end_line, int image_height, int image_width, int samples_per_pixel, std::chrono::steady_clock::time_point start) {
+	// Everything random on this thread's paths comes from the pixel sampler.
+	auto pixel_sampler = make_sampler(sampler_type, samples_per_pixel, seed);
+	active_sample_source = pixel_sampler.get();
+	auto cone = cam.pixel_cone(image_height);
+
+	// Starts sample s of pixel (i, j) and returns its camera ray.
+	auto camera_ray = [&](int i, int j, int s) {
+		pixel_sampler->start_pixel_sample(i, j, s);
+
+		double film_u, film_v, lens_u, lens_v;
+		pixel_sampler->get_2d(film_u, film_v);
+		pixel_sampler->get_2d(lens_u, lens_v);
+		auto time_u = pixel_sampler->get_1d();
+
+		auto u = double(i + film_u) / (image_width - 1);
+		auto v = double(j + film_v) / (image_height - 1);
+
+		return cam.get_ray<enabled.depth_of_field, enabled.motion_blur>(u, v, lens_u, lens_v, time_u);
+	};
+
+	if (packets && !bdpt) {
+		// 8x8 tiles whose camera rays for one sample index are traced as a
+		// packet, then shaded one by one. Shading restarts the pixel's
+		// sample and draws the camera numbers again, so every path sees the
+		// same random numbers as without packets.
+		constexpr int tile = 8;
+		ray_packet packet;
+		packet_hits hits;
+		for (int tj = end_line; tj >= start_line; tj -= tile) {
+			auto rows = std::min(tile, tj - start_line + 1);
+			for (int ti = 0; ti < image_width; ti += tile) {
+				auto columns = std::min(tile, image_width - ti);
+				color pixel_color[tile * tile], albedo[tile * tile];
+				vec3 normal[tile * tile];
+				real luminance_squared[tile * tile] = {};
+
+				for (int s = 0; s < samples_per_pixel; ++s) {
+					packet.clear();
+					for (int y = 0; y < rows; y++) {
+						for (int x = 0; x < columns; x++) {
+							packet.add(camera_ray(ti + x, tj - y, s));
+						}
+					}
+					packet.finish();
+					packets->trace(packet, 0.001, hits);
+
+					for (int k = 0; k < packet.count; k++) {
+						ray r = camera_ray(ti + k % columns, tj - k / columns, s);
+						pixel_features first_hit;
+						color sample = hits.is_deferred(k)
+							? ray_color<enabled>(r, bg, world, lights, medium, guide, cache, max_depth, 0, nullptr, &first_hit, cone)
+							: shade<enabled>(r, hits.hit(k), hits.rec[k], bg, world, lights, medium, guide, cache, max_depth, 0, nullptr, &first_hit, cone);
+
+						pixel_color[k] += sample;
+						albedo[k] += first_hit.albedo;
+						normal[k] += first_hit.normal;
+						luminance_squared[k] += luminance(sample) * luminance(sample);
+					}
+				}
+
+				for (int k = 0; k < rows * columns; k++) {
+					auto i = ti + k % columns, j = tj - k / columns;
+					colors[j][i] = pixel_color[k];
+					features.albedo[j][i] = albedo[k];
+					features.normal[j][i] = normal[k];
+					features.luminance_squared[j][i] = luminance_squared[k];
+				}
+			}
+			threadProgress[std::this_thread::get_id()] = (double)(end_line - tj) / (end_line - start_line);
+		}
+
+		active_sample_source = nullptr;
+		threadsDone++;
+		return;
+	}
+
 	for (int j = end_line; j >= start_line; --j) {
 		//std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
 		for (int i = 0; i < image_width; ++i) {
 			color pixel_color(0, 0, 0);
+			color albedo(0, 0, 0);
+			vec3 normal(0, 0, 0);
+			real luminance_squared = 0;
 			for (int s = 0; s < samples_per_pixel; ++s) {
-				auto u = double(i + random_double()) / (image_width - 1);
-				auto v = double(j + random_double()) / (image_height - 1);
+				ray r = camera_ray(i, j, s);
 
-				ray r = cam.get_ray(u, v);
 
+				pixel_features first_hit;
+				color sample = bdpt ? bdpt->li(r, *splats, &first_hit)
+					: ray_color<enabled>(r, bg, world, lights, medium, guide, cache, max_depth, 0, nullptr, &first_hit, cone);
 
-				pixel_color += ray_color(r, bg, world, max_depth);
+				pixel_color += sample;
+				albedo += first_hit.albedo;
+				normal += first_hit.normal;
+				luminance_squared += luminance(sample) * luminance(sample);
 
 				threadProgress[std::this_thread::get_id()] = (double)(end_line - j) / (end_line - start_line);
 			}
 			colors[j][i] = pixel_color;
+			features.albedo[j][i] = albedo;
+			features.normal[j][i] = normal;
+			features.luminance_squared[j][i] = luminance_squared;
 		}
 	}
 
 	
 
+	active_sample_source = nullptr;
 	threadsDone++;
 }
 
+using trace_kernel = decltype(&thread_trace<scene_features{}>);
+
+template <size_t... bits>
+constexpr std::array<trace_kernel, sizeof...(bits)> make_trace_kernels(std::index_sequence<bits...>) {
+	return { &thread_trace<scene_features::from_bits(bits)>... };
+}
+
+// thread_trace for the features a scene uses.
+trace_kernel select_trace_kernel(const scene_features& features) {
+	static constexpr auto kernels = make_trace_kernels(std::make_index_sequence<1 << scene_features::count>());
+	return kernels[features.bits()];
+}
+
 
 int main()
 {
@@ -350,8 +630,43 @@ int main()
 	int image_width = 512;
 	int samples_per_pixel = 20;
 	int max_depth = 50;
+	bool huge_pages = false;
+	sampler_kind sampler_type = sampler_kind::sobol;
+	// Filter the image with the albedo/normal guided denoiser, and write the
+	// feature images it uses to albedo.ppm and normal.ppm. Biased, so it is
+	// off unless asked for.
+	bool denoise = false;
+	size_t texture_budget_mb = 256;
+	// Replace procedural textures with cached voxel grids of them.
+	bool bake_textures = false;
+	// Trace the camera rays of 8x8 pixel tiles together.
+	bool primary_packets = true;
+	// Render with kernels that leave out what the scene doesn't use.
+	bool specialize_kernels = true;
+	// Learn where indirect light comes from in training passes of 1, 2, 4...
+	// samples per pixel, up to this many in total, before the real render.
+	bool path_guiding = false;
+	int guiding_training_spp = 31;
+	// Bidirectional path tracing for caustics; every pair of subpath
+	// vertices is connected, so it gets a shorter depth limit.
+	integrator_kind integrator = integrator_kind::path;
+	int bdpt_max_depth = 8;
+	// Progressive photon mapping renders samples_per_pixel passes.
+	sppm_settings photon_mapping;
+	// The path tracer run a stage at a time over waves of paths; experimental
+	// and slower than the recursive one for now, see wavefront.h.
+	wavefront_settings wavefront;
+	// End paths in a cache of diffuse radiance that the render fills as it
+	// goes; biased, for quick previews of scenes with lots of bounce light.
+	bool radiance_caching = false;
+	radiance_cache_settings cache_settings;
 	//World
 	auto R = cos(pi / 4);
+
+	texture_cache::global().set_budget(texture_budget_mb * 1024 * 1024);
+
+	// Owns every scene object; declared before the world so it is torn down last
+	scene_arena arena(huge_pages);
 	hittable_list world;
 
 	point3 lookfrom;
@@ -359,10 +674,15 @@ int main()
 	auto vfov = 40.0;
 	auto aperture = 0.0;
 	color background(0, 0, 0);
+	// Lights escaped rays and is sampled like any other light; background is
+	// used when there is none.
+	shared_ptr<environment_light> environment;
+	// Fog filling the scene, off unless a scene sets it.
+	global_medium medium;
 
 	switch (7) {
 	case 1:
-		world = random_scene();
+		world = random_scene(arena);
 		background = color(0.70, 0.80, 1.00);
 		lookfrom = point3(13, 2, 3);
 		lookat = point3(0, 0, 0);
@@ -372,7 +692,7 @@ int main()
 
 	
 	case 2:
-		world = two_spheres();
+		world = two_spheres(arena);
 		background = color(0.70, 0.80, 1.00);
 		lookfrom = point3(13, 2, 3);
 		lookat = point3(0, 0, 0);
@@ -381,21 +701,21 @@ int main()
 
 	default:
 	case 3:
-		world = two_perlin_spheres();
+		world = two_perlin_spheres(arena);
 		background = color(0.70, 0.80, 1.00);
 		lookfrom = point3(13, 2, 3);
 		lookat = point3(0, 0, 0);
 		vfov = 20.0;
 		break;
 	case 4:
-		world = earth();
+		world = earth(arena);
 		background = color(0.70, 0.80, 1.00);
 		lookfrom = point3(13, 2, 3);
 		lookat = point3(0, 0, 0);
 		vfov = 20.0;
 		break;
 	case 5:
-		world = simple_light();
+		world = simple_light(arena);
 		samples_per_pixel = 200;
 		background = color(0.0, 0.0, 0.0);
 		lookfrom = point3(26, 3, 6);
@@ -404,7 +724,7 @@ int main()
 		break;
 
 	case 6:
-		world = cornell_box();
+		world = cornell_box(arena);
 		aspect_ratio = 1.0;
 		image_width = 800;
 		samples_per_pixel = 800;
@@ -416,7 +736,7 @@ int main()
 		break;
 
 	case 7:
-		world = my_scene();
+		world = my_scene(arena);
 		aspect_ratio = 1.0;
 		image_width = 512;
 		samples_per_pixel = 8000;
@@ -428,7 +748,7 @@ int main()
 		break;
 
 	case 8:
-		world = cornell_smoke();
+		world = cornell_smoke(arena);
 		aspect_ratio = 1.0;
 		image_width = 600;
 		samples_per_pixel = 600;
@@ -439,7 +759,9 @@ int main()
 		break;
 
 	case 9:
-		world = final_scene();
+		world = final_scene(arena);
+		// The thin haze around everything.
+		medium = global_medium::homogeneous(.0001, arena.make<isotropic>(color(1, 1, 1), &arena), point3(0, 0, 0), 5000);
 		aspect_ratio = 1.0;
 		image_width = 800;
 		samples_per_pixel = 8000;
@@ -449,6 +771,23 @@ int main()
 		vfov = 40.0;
 		break;
 
+	case 10:
+		world = environment_scene(arena);
+		environment = make_shared<environment_light>("environment.hdr");
+		background = color(0.70, 0.80, 1.00);
+		lookfrom = point3(13, 2, 3);
+		lookat = point3(0, 1, 0);
+		vfov = 30.0;
+		break;
+
+	case 11:
+		world = cloud_scene(arena);
+		background = color(0.05, 0.06, 0.09);
+		lookfrom = point3(0, 3, 12);
+		lookat = point3(0, 1.5, 0);
+		vfov = 35.0;
+		break;
+
 	}
 
 	// Camera
@@ -469,8 +808,9 @@ int main()
 	imageFile << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
 	std::vector<std::vector<color>> colors(image_height, std::vector<color>(image_width));
+	feature_buffers features(image_width, image_height);
 
-	auto start = std::chrono::high_resolution_clock::now();
+	auto start = std::chrono::steady_clock::now();
 	/*
 	for (int j = image_height - 1; j >= 0; --j) {
 		std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
@@ -490,51 +830,202 @@ int main()
 	}
 	*/
 
-	bvh_node scene(world.objects, 0, world.objects.size(), 0, 0);
+	if (bake_textures) {
+		// Bake what is within view distance of the camera's target.
+		bake_settings bake;
+		auto reach = (lookfrom - lookat).length();
+		bake.region = aabb(lookat - vec3(reach, reach, reach), lookat + vec3(reach, reach, reach));
+		bake_scene_textures(world, arena, bake);
+	}
+	compile_scene_textures(world, arena);
+
+	bvh_node scene(world.objects, 0, world.objects.size(), 0, 0, &arena);
+	arena.report();
+
+	scene_lights lights(collect_lights(world), environment);
+	LOG(LOG_TYPE::INFO, "Sampling " + std::to_string(lights.bvh.size()) + " lights through a light BVH of "
+		+ std::to_string(lights.bvh.node_count()) + " nodes"
+		+ (lights.environment ? " and an environment map" : ""));
+	LOG(LOG_TYPE::INFO, std::string("Sampler: ") + sampler_name(sampler_type));
+	if (medium.active())
+		LOG(LOG_TYPE::INFO, "Global medium with density " + std::to_string(medium.density));
+
+	// Camera rays in 8x8 packets, for the path tracer only.
+	std::unique_ptr<packet_bvh> packets;
+	if (primary_packets && integrator == integrator_kind::path) {
+		packets = std::make_unique<packet_bvh>(scene, cam.time0, cam.time1);
+		LOG(LOG_TYPE::INFO, "Tracing camera rays in packets through " + std::to_string(packets->node_count()) + " nodes");
+	}
 
-	std::vector<std::thread> threads;
-	
-	int inc = image_height / thread_count;
-	int st = 0;
-	int end = inc;
-	for (int i = 0; i < thread_count; i++) {
+	scene_features used;
+	if (specialize_kernels) {
+		used = analyze_scene(scene, cam, medium);
+		LOG(LOG_TYPE::INFO, "Render kernel with " + used.describe());
+	}
+	auto kernel = select_trace_kernel(used);
+
+	path_guide guide(scene.box);
+	path_guide* active_guide = nullptr;
+	std::unique_ptr<radiance_cache> cache;
+	radiance_cache* active_cache = nullptr;
+
+	std::unique_ptr<bdpt_integrator> bdpt;
+	std::unique_ptr<splat_buffer> splats;
+	if (integrator == integrator_kind::bdpt) {
+		bdpt = std::make_unique<bdpt_integrator>(scene, lights, cam, background, image_width, image_height, bdpt_max_depth);
+		splats = std::make_unique<splat_buffer>(image_width, image_height);
+		LOG(LOG_TYPE::INFO, "Bidirectional path tracing from " + std::to_string(bdpt->sampled_light_count())
+			+ " lights, max depth " + std::to_string(bdpt_max_depth));
+		if (medium.active())
+			LOG(LOG_TYPE::INFO, "BDPT ignores the global medium");
+		if (path_guiding) {
+			LOG(LOG_TYPE::INFO, "BDPT does not use path guiding");
+			path_guiding = false;
+		}
+		if (radiance_caching) {
+			LOG(LOG_TYPE::INFO, "BDPT does not use the radiance cache");
+			radiance_caching = false;
+		}
+	}
+	if (integrator == integrator_kind::sppm) {
+		if (medium.active())
+			LOG(LOG_TYPE::INFO, "Photon mapping ignores the global medium");
+		if (path_guiding) {
+			LOG(LOG_TYPE::INFO, "Photon mapping does not use path guiding");
+			path_guiding = false;
+		}
+		if (radiance_caching) {
+			LOG(LOG_TYPE::INFO, "Photon mapping does not use the radiance cache");
+			radiance_caching = false;
+		}
+	}
+	if (integrator == integrator_kind::wavefront) {
+		if (path_guiding) {
+			LOG(LOG_TYPE::INFO, "The wavefront path tracer does not use path guiding");
+			path_guiding = false;
+		}
+		if (radiance_caching) {
+			LOG(LOG_TYPE::INFO, "The wavefront path tracer does not use the radiance cache");
+			radiance_caching = false;
+		}
+	}
 
-		std::thread t(thread_trace, std::ref(colors), std::ref(background), std::ref(scene), cam, max_depth, st , end-1,
-			image_height, image_width, samples_per_pixel, start);
+	auto render = [&](std::vector<std::vector<color>>& target, feature_buffers& target_features, int spp, uint32_t seed) {
+		std::vector<std::thread> threads;
+		threadsDone = 0;
+
+		int inc = image_height / thread_count;
+		int st = 0;
+		int end = inc;
+		for (int i = 0; i < thread_count; i++) {
+
+			std::thread t(kernel, std::ref(target), std::ref(target_features), std::ref(background), std::ref(scene), std::cref(lights), std::cref(medium),
+				active_guide, active_cache, bdpt.get(), splats.get(), packets.get(), cam, sampler_type, seed, max_depth, st, end - 1, image_height, image_width, spp, start);
+
+			st += inc;
+			end += inc;
+
+			threadProgress[t.get_id()] = 0;
+			threads.push_back(std::move(t));
+		}
+
+		while (threadsDone < thread_count) {
+			std::stringstream ss;
+
+
+			int count = 1;
+			for (auto& t : threads) {
+				ss << "Thread " << count << " :"
+					<< threadProgress[t.get_id()] * 100.0 << '%' << '\n';
+				count++;
+			}
+			ss << "Threads remaining: " << thread_count - threadsDone << '\n';
+			ss << '\r';
+			std::cerr << ss.str();
+			std::cerr.flush();
+			std::this_thread::sleep_for(std::chrono::microseconds(500));
 
-		st += inc;
-		end += inc;
 
-		threadProgress[t.get_id()] = 0;
-		threads.push_back(std::move(t));
-	}
-	
-	while (threadsDone < thread_count) {
-		std::stringstream ss;
-		
 
-		int count = 1;
-		for (auto& t : threads) {
-			ss << "Thread " <<  count << " :"
-				<< threadProgress[t.get_id()] * 100.0 << '%' << '\n';
-			count++;
 		}
-		ss << "Threads remaining: " << thread_count - threadsDone << '\n';
-		ss << '\r';
-		std::cerr << ss.str();
-		std::cerr.flush();
-		std::this_thread::sleep_for(std::chrono::microseconds(500));
-		
 
+		for (auto& t : threads) {
+			t.join();
+		}
+	};
+
+	if (path_guiding) {
+		// Training images are thrown away. Each pass gets its own sampler
+		// seed so the guide stays independent of the samples that use it.
+		active_guide = &guide;
+		guide.recording = true;
+		std::vector<std::vector<color>> scratch(image_height, std::vector<color>(image_width));
+		feature_buffers scratch_features(image_width, image_height);
+		int trained = 0;
+		for (int pass = 0; trained < guiding_training_spp; pass++) {
+			auto spp = std::min(1 << pass, guiding_training_spp - trained);
+			render(scratch, scratch_features, spp, pass + 1);
+			guide.refine(pass);
+			trained += spp;
+		}
+		guide.recording = false;
+		LOG(LOG_TYPE::INFO, "Trained path guiding with " + std::to_string(trained) + " spp into "
+			+ std::to_string(guide.region_count()) + " regions and "
+			+ std::to_string(guide.directional_node_count()) + " directional nodes");
+	}
 
+	if (integrator == integrator_kind::sppm) {
+		sppm_integrator sppm(scene, lights, cam, background, image_width, image_height, sampler_type, photon_mapping);
+		sppm.render(samples_per_pixel, thread_count, colors, features);
+	}
+	else if (integrator == integrator_kind::wavefront) {
+		wavefront_integrator paths(scene, lights, medium, cam, background, image_width, image_height, max_depth, sampler_type, wavefront);
+		paths.render(samples_per_pixel, thread_count, colors, features);
+	}
+	else if (radiance_caching) {
+		// Passes of a few samples per pixel, each reading what the ones
+		// before it recorded. Pass n > 0 gets seed n << 16, apart from the
+		// seeds of guide training.
+		cache = std::make_unique<radiance_cache>(cache_settings, max_depth, cam.origin, cam.pixel_cone(image_height).spread);
+		active_cache = cache.get();
+		std::vector<std::vector<color>> pass_colors(image_height, std::vector<color>(image_width));
+		feature_buffers pass_features(image_width, image_height);
+		int rendered = 0;
+		for (int pass = 0; rendered < samples_per_pixel; pass++) {
+			auto spp = std::min(cache_settings.pass_spp, samples_per_pixel - rendered);
+			render(pass_colors, pass_features, spp, static_cast<uint32_t>(pass) << 16);
+			cache->refresh();
+			rendered += spp;
+
+			for (int j = 0; j < image_height; j++) {
+				for (int i = 0; i < image_width; i++) {
+					colors[j][i] += pass_colors[j][i];
+					features.albedo[j][i] += pass_features.albedo[j][i];
+					features.normal[j][i] += pass_features.normal[j][i];
+					features.luminance_squared[j][i] += pass_features.luminance_squared[j][i];
+				}
+			}
+		}
+		LOG(LOG_TYPE::INFO, "Radiance cache holds " + std::to_string(cache->used_cells()) + " of "
+			+ std::to_string(cache->capacity()) + " cells");
+	}
+	else {
+		render(colors, features, samples_per_pixel, 0);
 	}
 
-	for (auto& t : threads) {
-		t.join();
+	if (splats) {
+		// Light tracing hits pixels at random; its total is already per
+		// camera sample, like the pixel sums.
+		for (int j = 0; j < image_height; j++) {
+			for (int i = 0; i < image_width; i++) {
+				colors[j][i] += splats->at(i, j);
+			}
+		}
 	}
 
-	auto dur = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::high_resolution_clock::now() - start);
-	std::cout << "\nTime: " << dur << '\n';
+	auto dur = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start);
+	std::cout << "\nTime: " << dur.count() << "s\n";
+	texture_cache::global().report();
 
 	
 
@@ -543,10 +1034,22 @@ int main()
 
 	
 
+	int written_samples = samples_per_pixel;
+	if (denoise) {
+		features.write("albedo.ppm", "normal.ppm", samples_per_pixel);
+
+		auto denoise_start = std::chrono::steady_clock::now();
+		colors = denoiser(colors, features, samples_per_pixel).run();
+		written_samples = 1;
+
+		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - denoise_start);
+		LOG(LOG_TYPE::INFO, "Denoised in " + std::to_string(ms.count()) + "ms");
+	}
+
 	for (int i = colors.size() - 1; i >= 0; --i) {
 		auto cc = colors[i];
 		for (auto c : cc) {
-			write_color(imageFile, c, samples_per_pixel);
+			write_color(imageFile, c, written_samples);
 		}
 	}
 
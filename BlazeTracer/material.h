@@ -3,79 +3,226 @@
 
 #include "rtweekend.h"
 
+#include "arena.h"
 #include "hittable.h"
+#include "onb.h"
 #include "texture.h"
 
+// Type tag for the built-in materials, see hittable_kind.
+enum class material_kind : unsigned char {
+	custom,
+	lambertian,
+	metal,
+	dielectric,
+	diffuse_light,
+	isotropic
+};
+
+// Result of sampling a material. weight is the BSDF times the cosine term
+// divided by pdf, i.e. what the radiance along scattered gets multiplied by.
+// Specular (delta) samples have pdf 0 and cannot be combined with light
+// sampling.
+struct bsdf_sample {
+	ray scattered;
+	color weight;
+	real pdf;
+	bool is_specular;
+};
+
 class material {
 public:
-	virtual color emitted(double u, double v, const point3& p) const {
+	material_kind kind;
+public:
+	material(material_kind k = material_kind::custom) : kind(k) {}
+
+	virtual color emitted(real u, real v, const point3& p) const {
 		return color(0, 0, 0);
 	}
 	virtual bool scatter(const ray& r, const hit_record& rec, color& attenuation,
 		ray& scattered) const = 0;
+
+	virtual bool is_emissive() const { return false; }
+
+	// Reflectance at rec as a feature for the denoiser.
+	virtual color albedo_value(const hit_record& rec) const { return color(1, 1, 1); }
+
+	// Sample an outgoing direction. The default wraps scatter() and treats
+	// the result as specular, so materials that only implement scatter()
+	// keep working, they just don't take part in light sampling.
+	virtual bool sample(const ray& r, const hit_record& rec, bsdf_sample& s) const {
+		s.pdf = 0;
+		s.is_specular = true;
+		return scatter(r, rec, s.weight, s.scattered);
+	}
+
+	// Materials that are not specular get direct light through next-event
+	// estimation, which needs eval(): the BSDF times the cosine term for light
+	// arriving from direction wi (unit length), and pdf(): the solid angle
+	// density with which sample() picks wi.
+	virtual bool is_specular() const { return true; }
+	virtual color eval(const ray& r, const hit_record& rec, const vec3& wi) const {
+		return color(0, 0, 0);
+	}
+	virtual real pdf(const ray& r, const hit_record& rec, const vec3& wi) const {
+		return 0;
+	}
 };
 
-class lambertian : public material {
+class lambertian final : public material {
 public:
 	shared_ptr<texture> albedo;
 public:
-	lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
-	lambertian(shared_ptr<texture> a) : albedo(a) {}
+	// The solid color comes from arena when there is one, see box.
+	lambertian(const color& a, scene_arena* arena = nullptr)
+		: material(material_kind::lambertian), albedo(arena_make<solid_color>(arena, a)) {}
+	lambertian(shared_ptr<texture> a) : material(material_kind::lambertian), albedo(a) {}
 
 	virtual bool scatter(const ray& r, const hit_record& rec, color& attenuation,
 		ray& scattered) const override {
-		auto scatter_direction = rec.normal + random_unit_vector();
+		bsdf_sample s;
+		sample(r, rec, s);
+		attenuation = s.weight;
+		scattered = s.scattered;
 
-		//Catch degenerate scatter direction
-		if (scatter_direction.near_zero()) {
-			scatter_direction = rec.normal;
-		}
-		scattered = ray(rec.p, scatter_direction, r.time());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+		return true;
+	}
+
+	// Cosine weighted, so the weight is just the albedo.
+	virtual bool sample(const ray& r, const hit_record& rec, bsdf_sample& s) const override {
+		onb uvw;
+		uvw.build_from_w(rec.normal);
+		auto direction = uvw.local(random_cosine_direction());
+
+		s.scattered = ray(offset_ray_origin(rec.p, rec.normal, direction), direction, r.time());
+		s.weight = texture_value(*albedo, rec.u, rec.v, rec.p, rec.footprint_u, rec.footprint_v);
+		s.pdf = fmax(dot(rec.normal, direction), real(0)) / pi;
+		s.is_specular = false;
 
 		return true;
 	}
+
+	virtual color albedo_value(const hit_record& rec) const override {
+		return texture_value(*albedo, rec.u, rec.v, rec.p, rec.footprint_u, rec.footprint_v);
+	}
+
+	virtual bool is_specular() const override { return false; }
+
+	virtual color eval(const ray& r, const hit_record& rec, const vec3& wi) const override {
+		auto cosine = dot(rec.normal, wi);
+		if (cosine <= 0)
+			return color(0, 0, 0);
+
+		return (cosine / pi) * texture_value(*albedo, rec.u, rec.v, rec.p, rec.footprint_u, rec.footprint_v);
+	}
+
+	virtual real pdf(const ray& r, const hit_record& rec, const vec3& wi) const override {
+		auto cosine = dot(rec.normal, wi);
+		return cosine <= 0 ? 0 : cosine / pi;
+	}
 };
 
-class metal : public material {
+// Fuzzy metal reflects into a cos^n lobe around the mirror direction, with n
+// chosen so the lobe is roughly fuzz radians wide (fuzz 1 covers the whole
+// hemisphere). fuzz 0 is a perfect mirror.
+class metal final : public material {
 public:
 	color albedo;
-	double fuzz;
+	real fuzz;
 public:
-	metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+	metal(const color& a, real f) : material(material_kind::metal), albedo(a), fuzz(f < 1 ? f : 1) {}
 
 	virtual bool scatter(const ray& r, const hit_record& rec, color& attenuation,
 		ray& scattered) const override {
-		auto reflected = reflect(r.direction(), rec.normal);
+		bsdf_sample s;
+		if (!sample(r, rec, s))
+			return false;
+
+		attenuation = s.weight;
+		scattered = s.scattered;
+
+		return true;
+	}
+
+	virtual bool sample(const ray& r, const hit_record& rec, bsdf_sample& s) const override {
+		auto reflected = reflect(unit_vector(r.direction()), rec.normal);
+		auto direction = reflected;
+
+		if (fuzz > 0) {
+			onb uvw;
+			uvw.build_from_w(reflected);
+			direction = uvw.local(random_cosine_power_direction(exponent()));
+		}
+
+		//Catch degenerate scatter direction
+		if (dot(direction, rec.normal) <= 0)
+			return false;
+
+		s.scattered = ray(offset_ray_origin(rec.p, rec.normal, direction), direction, r.time());
+		s.weight = albedo;
+		s.pdf = fuzz > 0 ? lobe_pdf(reflected, direction) : 0;
+		s.is_specular = fuzz == 0;
+
+		return true;
+	}
 
-		scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r.time());
+	virtual color albedo_value(const hit_record& rec) const override { return albedo; }
 
-		attenuation = albedo;
+	virtual bool is_specular() const override { return fuzz == 0; }
 
-		//Catch degenerate scatter directio
-		return dot(scattered.direction(), rec.normal) > 0.0;
+	virtual color eval(const ray& r, const hit_record& rec, const vec3& wi) const override {
+		return pdf(r, rec, wi) * albedo;
+	}
+
+	virtual real pdf(const ray& r, const hit_record& rec, const vec3& wi) const override {
+		if (fuzz == 0 || dot(wi, rec.normal) <= 0)
+			return 0;
+
+		return lobe_pdf(reflect(unit_vector(r.direction()), rec.normal), wi);
+	}
+
+private:
+	real exponent() const {
+		return fmax(2 / (fuzz * fuzz) - 2, real(0));
+	}
+
+	real lobe_pdf(const vec3& reflected, const vec3& wi) const {
+		auto cosine = dot(reflected, wi);
+		if (cosine <= 0)
+			return 0;
+
+		auto n = exponent();
+		return (n + 1) / (2 * pi) * pow(cosine, n);
 	}
 };
 
 
-class dielectric : public material {
+class dielectric final : public material {
 public:
-	double ir;
+	real ir;
 public:
-	dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+	dielectric(real index_of_refraction) : material(material_kind::dielectric), ir(index_of_refraction) {}
 
 	virtual bool scatter(const ray& r, const hit_record& rec, color& attenuation,
 		ray& scattered) const override {
-		attenuation = color(1.0, 1.0, 1.0);
+		bsdf_sample s;
+		sample(r, rec, s);
+		attenuation = s.weight;
+		scattered = s.scattered;
+
+		return true;
+	}
 
-		
+	virtual bool sample(const ray& r, const hit_record& rec, bsdf_sample& s) const override {
+		s.weight = color(1.0, 1.0, 1.0);
+		s.pdf = 0;
+		s.is_specular = true;
 
-		double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
+		real refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
 		vec3 unit_direction = unit_vector(r.direction());
 
-		double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-		double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+		real cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+		real sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 
 		bool cannot_refract = refraction_ratio * sin_theta > 1.0;
 		vec3 direction;
@@ -86,13 +233,13 @@ public:
 			direction = refract(unit_direction, rec.normal, refraction_ratio);
 		}
 
-		scattered = ray(rec.p, direction, r.time());
+		s.scattered = ray(offset_ray_origin(rec.p, rec.normal, direction), direction, r.time());
 
 		return true;
 	}
 
 	private:
-		static double reflectance(double cosine, double ref_idx) {
+		static real reflectance(real cosine, real ref_idx) {
 			auto r0 = (1 - ref_idx) / (1 + ref_idx);
 			r0 = r0 * r0;
 
@@ -101,12 +248,13 @@ public:
 };
 
 
-class diffuse_light : public material {
+class diffuse_light final : public material {
 public:
 	shared_ptr<texture> emit;
 public:
-	diffuse_light(shared_ptr<texture> a) : emit(a) {}
-	diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
+	diffuse_light(shared_ptr<texture> a) : material(material_kind::diffuse_light), emit(a) {}
+	diffuse_light(color c, scene_arena* arena = nullptr)
+		: material(material_kind::diffuse_light), emit(arena_make<solid_color>(arena, c)) {}
 
 	virtual bool scatter(
 		const ray& r, const hit_record& rec, color& attenuation, ray& scattered)
@@ -114,26 +262,175 @@ public:
 		return false;
 	}
 
-	virtual color emitted(double u, double v, const point3& p) const override {
-		return emit->value(u, v, p);
+	virtual bool sample(const ray& r, const hit_record& rec, bsdf_sample& s) const override {
+		return false;
 	}
+
+	virtual color emitted(real u, real v, const point3& p) const override {
+		return texture_value(*emit, u, v, p);
+	}
+
+	virtual bool is_emissive() const override { return true; }
 };
 
-class isotropic : public material {
+class isotropic final : public material {
 public:
 	shared_ptr<texture> albedo;
 public:
-	isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
-	isotropic(shared_ptr<texture> a) : albedo(a) {}
+	isotropic(color c, scene_arena* arena = nullptr)
+		: material(material_kind::isotropic), albedo(arena_make<solid_color>(arena, c)) {}
+	isotropic(shared_ptr<texture> a) : material(material_kind::isotropic), albedo(a) {}
 
 	virtual bool scatter(const ray& r, const hit_record& rec, color& attenuation, ray& scattered)
 		const override {
+		bsdf_sample s;
+		sample(r, rec, s);
+		attenuation = s.weight;
+		scattered = s.scattered;
 
-		scattered = ray(rec.p, random_in_unit_sphere(), r.time());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+		return true;
+	}
+
+	virtual bool sample(const ray& r, const hit_record& rec, bsdf_sample& s) const override {
+		s.scattered = ray(rec.p, random_unit_vector(), r.time());
+		s.weight = texture_value(*albedo, rec.u, rec.v, rec.p, rec.footprint_u, rec.footprint_v);
+		s.pdf = 1 / (4 * pi);
+		s.is_specular = false;
 
 		return true;
 	}
+
+	virtual color albedo_value(const hit_record& rec) const override {
+		return texture_value(*albedo, rec.u, rec.v, rec.p, rec.footprint_u, rec.footprint_v);
+	}
+
+	virtual bool is_specular() const override { return false; }
+
+	// Uniform phase function, no cosine term inside a medium.
+	virtual color eval(const ray& r, const hit_record& rec, const vec3& wi) const override {
+		return (1 / (4 * pi)) * texture_value(*albedo, rec.u, rec.v, rec.p, rec.footprint_u, rec.footprint_v);
+	}
+
+	virtual real pdf(const ray& r, const hit_record& rec, const vec3& wi) const override {
+		return 1 / (4 * pi);
+	}
 };
 
+// Tag dispatch: built-in materials are called directly (and can be inlined
+// into the integrator), custom ones through the vtable.
+inline bool scatter_dispatch(const material& m, const ray& r, const hit_record& rec,
+	color& attenuation, ray& scattered) {
+	switch (m.kind) {
+	case material_kind::lambertian:
+		return static_cast<const lambertian&>(m).lambertian::scatter(r, rec, attenuation, scattered);
+	case material_kind::metal:
+		return static_cast<const metal&>(m).metal::scatter(r, rec, attenuation, scattered);
+	case material_kind::dielectric:
+		return static_cast<const dielectric&>(m).dielectric::scatter(r, rec, attenuation, scattered);
+	case material_kind::diffuse_light:
+		return false;
+	case material_kind::isotropic:
+		return static_cast<const isotropic&>(m).isotropic::scatter(r, rec, attenuation, scattered);
+	default:
+		return m.scatter(r, rec, attenuation, scattered);
+	}
+}
+
+inline bool sample_dispatch(const material& m, const ray& r, const hit_record& rec, bsdf_sample& s) {
+	switch (m.kind) {
+	case material_kind::lambertian:
+		return static_cast<const lambertian&>(m).lambertian::sample(r, rec, s);
+	case material_kind::metal:
+		return static_cast<const metal&>(m).metal::sample(r, rec, s);
+	case material_kind::dielectric:
+		return static_cast<const dielectric&>(m).dielectric::sample(r, rec, s);
+	case material_kind::diffuse_light:
+		return false;
+	case material_kind::isotropic:
+		return static_cast<const isotropic&>(m).isotropic::sample(r, rec, s);
+	default:
+		return m.sample(r, rec, s);
+	}
+}
+
+inline bool is_specular_dispatch(const material& m) {
+	switch (m.kind) {
+	case material_kind::lambertian:
+	case material_kind::isotropic:
+		return false;
+	case material_kind::metal:
+		return static_cast<const metal&>(m).metal::is_specular();
+	case material_kind::custom:
+		return m.is_specular();
+	default:
+		return true;
+	}
+}
+
+inline color eval_dispatch(const material& m, const ray& r, const hit_record& rec, const vec3& wi) {
+	switch (m.kind) {
+	case material_kind::lambertian:
+		return static_cast<const lambertian&>(m).lambertian::eval(r, rec, wi);
+	case material_kind::metal:
+		return static_cast<const metal&>(m).metal::eval(r, rec, wi);
+	case material_kind::isotropic:
+		return static_cast<const isotropic&>(m).isotropic::eval(r, rec, wi);
+	default:
+		return m.eval(r, rec, wi);
+	}
+}
+
+inline real pdf_dispatch(const material& m, const ray& r, const hit_record& rec, const vec3& wi) {
+	switch (m.kind) {
+	case material_kind::lambertian:
+		return static_cast<const lambertian&>(m).lambertian::pdf(r, rec, wi);
+	case material_kind::metal:
+		return static_cast<const metal&>(m).metal::pdf(r, rec, wi);
+	case material_kind::isotropic:
+		return static_cast<const isotropic&>(m).isotropic::pdf(r, rec, wi);
+	default:
+		return m.pdf(r, rec, wi);
+	}
+}
+
+inline color albedo_dispatch(const material& m, const hit_record& rec) {
+	switch (m.kind) {
+	case material_kind::lambertian:
+		return static_cast<const lambertian&>(m).lambertian::albedo_value(rec);
+	case material_kind::metal:
+		return static_cast<const metal&>(m).metal::albedo_value(rec);
+	case material_kind::isotropic:
+		return static_cast<const isotropic&>(m).isotropic::albedo_value(rec);
+	case material_kind::custom:
+		return m.albedo_value(rec);
+	default:
+		return color(1, 1, 1);
+	}
+}
+
+// The texture slot of a built-in material, nullptr if it has none.
+inline shared_ptr<texture>* material_texture(material& m) {
+	switch (m.kind) {
+	case material_kind::lambertian:
+		return &static_cast<lambertian&>(m).albedo;
+	case material_kind::isotropic:
+		return &static_cast<isotropic&>(m).albedo;
+	case material_kind::diffuse_light:
+		return &static_cast<diffuse_light&>(m).emit;
+	default:
+		return nullptr;
+	}
+}
+
+inline color emitted_dispatch(const material& m, real u, real v, const point3& p) {
+	switch (m.kind) {
+	case material_kind::diffuse_light:
+		return static_cast<const diffuse_light&>(m).diffuse_light::emitted(u, v, p);
+	case material_kind::custom:
+		return m.emitted(u, v, p);
+	default:
+		return color(0, 0, 0);
+	}
+}
+
 #endif
\ No newline at end of file
@@ -5,31 +5,36 @@
 #include "hittable.h"
 
 
-class moving_sphere : public hittable {
+class moving_sphere final : public hittable {
 public:
 	point3 center0, center1;
-	double time0, time1;
-	double radius;
+	real time0, time1;
+	real radius;
 	shared_ptr<material> mat_ptr;
+	// (center1 - center0) / (time1 - time0), so hits don't divide.
+	vec3 velocity;
 public:
 
-	moving_sphere() {}
+	moving_sphere() : hittable(hittable_kind::moving_sphere) {}
 	moving_sphere(
-		point3 cen0, point3 cen1, double _time0, double _time1, double r, shared_ptr<material> m)
-		: center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m)
+		point3 cen0, point3 cen1, real _time0, real _time1, real r, shared_ptr<material> m)
+		: hittable(hittable_kind::moving_sphere), center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m),
+		velocity(_time1 != _time0 ? (cen1 - cen0) / (_time1 - _time0) : vec3(0, 0, 0))
 	{}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
-	point3 center(double time) const;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
+	virtual const material* surface_material() const override { return mat_ptr.get(); }
+	point3 center(real time) const;
 };
 
-point3 moving_sphere::center(double time) const {
-	return center0 + ((time - time0) / (time1 - time0))* (center1 - center0);
+point3 moving_sphere::center(real time) const {
+	return center0 + (time - time0) * velocity;
 }
 
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-	vec3 oc = r.origin() - center(r.time());
+bool moving_sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+	auto cen = center(r.time());
+	vec3 oc = r.origin() - cen;
 	auto a = r.direction().length_squared();
 	auto half_b = dot(oc, r.direction());
 	auto c = oc.length_squared() - radius * radius;
@@ -49,14 +54,15 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
 
 	rec.t = root;
 	rec.p = r.at(rec.t);
-	vec3 outward_normal = (rec.p - center(r.time())) / radius;
+	vec3 outward_normal = (rec.p - cen) / radius;
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
+	rec.mat_ptr = mat_ptr.get();
+	rec.obj = this;
 
 	return true;
 }
 
-bool moving_sphere::bounding_box(double _time0, double _time1, aabb& output_box) const {
+bool moving_sphere::bounding_box(real _time0, real _time1, aabb& output_box) const {
 	aabb box0(
 		center(_time0) - vec3(radius, radius, radius),
 		center(_time0) + vec3(radius, radius, radius));
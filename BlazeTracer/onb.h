@@ -0,0 +1,75 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "rtweekend.h"
+
+// Orthonormal basis around a direction w, for sampling in local coordinates.
+class onb {
+public:
+	vec3 axis[3];
+public:
+	onb() {}
+
+	vec3 operator[](int i) const { return axis[i]; }
+
+	vec3 u() const { return axis[0]; }
+	vec3 v() const { return axis[1]; }
+	vec3 w() const { return axis[2]; }
+
+	vec3 local(real a, real b, real c) const {
+		return a * u() + b * v() + c * w();
+	}
+
+	vec3 local(const vec3& a) const {
+		return a.x() * u() + a.y() * v() + a.z() * w();
+	}
+
+	void build_from_w(const vec3& n) {
+		axis[2] = unit_vector(n);
+		vec3 a = (fabs(w().x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+		axis[1] = unit_vector(cross(w(), a));
+		axis[0] = cross(w(), v());
+	}
+};
+
+// Cosine weighted direction around +z, pdf cos(theta) / pi.
+inline vec3 random_cosine_direction() {
+	auto r1 = random_double();
+	auto r2 = random_double();
+
+	auto phi = 2 * pi * r1;
+	auto x = cos(phi) * sqrt(r2);
+	auto y = sin(phi) * sqrt(r2);
+	auto z = sqrt(1 - r2);
+
+	return vec3(x, y, z);
+}
+
+// Direction around +z distributed as cos(theta)^exponent,
+// pdf (exponent + 1) / (2 pi) * cos(theta)^exponent.
+inline vec3 random_cosine_power_direction(real exponent) {
+	auto r1 = random_double();
+	auto r2 = random_double();
+
+	auto phi = 2 * pi * r1;
+	auto z = pow(r2, 1 / (exponent + 1));
+	auto s = sqrt(fmax(real(0), 1 - z * z));
+
+	return vec3(cos(phi) * s, sin(phi) * s, z);
+}
+
+// Direction in the cone around +z that subtends a sphere of the given radius
+// at the given squared distance.
+inline vec3 random_to_sphere(real radius, real distance_squared) {
+	auto r1 = random_double();
+	auto r2 = random_double();
+	auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
+
+	auto phi = 2 * pi * r1;
+	auto x = cos(phi) * sqrt(1 - z * z);
+	auto y = sin(phi) * sqrt(1 - z * z);
+
+	return vec3(x, y, z);
+}
+
+#endif
@@ -0,0 +1,347 @@
+#ifndef PATH_GUIDING_H
+#define PATH_GUIDING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+// Path guiding after Mueller et al., "Practical Path Guiding for Efficient
+// Light-Transport Simulation": a binary tree over space whose leaves hold
+// quadtrees over directions (an SD-tree). Training passes record the
+// radiance their bounces bring back, each pass refines the trees, and later
+// passes sample bounces from the learned distributions, mixed with BSDF
+// sampling by one-sample MIS.
+
+// Unit direction <-> point in [0, 1)^2 with cos(theta) and phi as the axes.
+// The mapping preserves area, so densities differ by the constant 4 pi.
+inline vec3 square_to_direction(real u, real v) {
+	auto cos_theta = 2 * u - 1;
+	auto sin_theta = sqrt(fmax(real(0), 1 - cos_theta * cos_theta));
+	auto phi = 2 * pi * v;
+	return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+inline void direction_to_square(const vec3& d, real& u, real& v) {
+	u = fmin(fmax((d.z() + 1) / 2, real(0)), real(1) - real(1e-7));
+	auto phi = atan2(d.y(), d.x());
+	if (phi < 0) phi += 2 * pi;
+	v = fmin(phi / (2 * pi), real(1) - real(1e-7));
+}
+
+// Quadtree over the direction square. Every node keeps the energy recorded
+// in each of its quadrants, so a node's sums add up to its parent's entry.
+class direction_tree {
+public:
+	direction_tree() : nodes(1) {}
+
+	// Adds value to the quadrants containing (u, v) on every level. Called
+	// by all render threads at once.
+	void record(real u, real v, real value);
+
+	// Density over the square of sample(); zero where nothing was recorded.
+	real pdf(real u, real v) const;
+	void sample(real& u, real& v) const;
+
+	real total() const { return nodes[0].sum[0] + nodes[0].sum[1] + nodes[0].sum[2] + nodes[0].sum[3]; }
+	uint64_t sample_count() const { return samples; }
+	void set_sample_count(uint64_t n) { samples = n; }
+	size_t node_count() const { return nodes.size(); }
+
+	// Empty tree for the next pass: quadrants that got more than threshold
+	// of the energy are split, the others collapse into their parent.
+	direction_tree refined(real threshold, int max_depth) const;
+
+private:
+	struct node {
+		float sum[4] = { 0, 0, 0, 0 };
+		uint32_t child[4] = { 0, 0, 0, 0 };  // 0 for leaves, the root is never a child
+	};
+
+	static int quadrant(real& u, real& v) {
+		int q = (u >= real(0.5)) + 2 * (v >= real(0.5));
+		u = 2 * u - (q & 1);
+		v = 2 * v - (q >> 1);
+		return q;
+	}
+
+	std::vector<node> nodes;
+	uint64_t samples = 0;
+};
+
+void direction_tree::record(real u, real v, real value) {
+	std::atomic_ref<uint64_t>(samples).fetch_add(1, std::memory_order_relaxed);
+
+	uint32_t index = 0;
+	while (true) {
+		auto& n = nodes[index];
+		auto q = quadrant(u, v);
+		std::atomic_ref<float>(n.sum[q]).fetch_add(static_cast<float>(value), std::memory_order_relaxed);
+		if (!n.child[q])
+			return;
+		index = n.child[q];
+	}
+}
+
+real direction_tree::pdf(real u, real v) const {
+	real density = 1;
+	uint32_t index = 0;
+	while (true) {
+		const auto& n = nodes[index];
+		auto node_total = real(n.sum[0]) + n.sum[1] + n.sum[2] + n.sum[3];
+		if (!(node_total > 0))
+			return index == 0 ? 0 : density;
+
+		auto q = quadrant(u, v);
+		density *= 4 * n.sum[q] / node_total;
+		if (!n.child[q] || density == 0)
+			return density;
+		index = n.child[q];
+	}
+}
+
+void direction_tree::sample(real& u, real& v) const {
+	// One random number picks the whole chain of quadrants, rescaled to
+	// [0, 1) after every choice.
+	auto r = random_double();
+	real x = 0, y = 0, size = 1;
+	uint32_t index = 0;
+	while (true) {
+		const auto& n = nodes[index];
+		auto node_total = real(n.sum[0]) + n.sum[1] + n.sum[2] + n.sum[3];
+
+		int q = 0;
+		if (node_total > 0) {
+			auto target = r * node_total;
+			real below = 0;
+			while (q < 3 && below + n.sum[q] <= target) {
+				below += n.sum[q];
+				q++;
+			}
+			r = n.sum[q] > 0 ? fmin((target - below) / n.sum[q], real(1) - real(1e-7)) : 0;
+		}
+		else {
+			q = std::min(static_cast<int>(r * 4), 3);
+			r = r * 4 - q;
+		}
+
+		size /= 2;
+		x += (q & 1) * size;
+		y += (q >> 1) * size;
+		if (!n.child[q])
+			break;
+		index = n.child[q];
+	}
+
+	u = x + random_double() * size;
+	v = y + random_double() * size;
+}
+
+direction_tree direction_tree::refined(real threshold, int max_depth) const {
+	direction_tree next;
+	auto root_total = total();
+	if (!(root_total > 0)) {
+		next = *this;
+		next.samples = 0;
+		return next;
+	}
+
+	// Quadrants split below the learned structure get a quarter of their
+	// parent's energy each, so bright leaves keep subdividing.
+	struct item {
+		uint32_t old_index;  // 0 when the old tree ends above this node
+		uint32_t new_index;
+		real fraction;
+		int depth;
+	};
+	std::vector<item> stack = { { 0, 0, 1, 1 } };
+	bool root = true;
+	while (!stack.empty()) {
+		auto it = stack.back();
+		stack.pop_back();
+
+		for (int q = 0; q < 4; q++) {
+			bool has_old = root || it.old_index != 0;
+			auto f = has_old ? nodes[it.old_index].sum[q] / root_total : it.fraction / 4;
+			if (!(f > threshold) || it.depth >= max_depth)
+				continue;
+
+			auto child = static_cast<uint32_t>(next.nodes.size());
+			next.nodes.emplace_back();
+			next.nodes[it.new_index].child[q] = child;
+			stack.push_back({ has_old ? nodes[it.old_index].child[q] : 0, child, f, it.depth + 1 });
+		}
+		root = false;
+	}
+	return next;
+}
+
+// Everything the integrator needs at one vertex: where to record and, once
+// something was learned there, the distribution to sample.
+struct guided_vertex {
+	direction_tree* recorder = nullptr;
+	const direction_tree* distribution = nullptr;
+	// Probability of sampling the BSDF rather than the guide.
+	real bsdf_fraction = 1;
+
+	bool guided() const { return distribution != nullptr; }
+
+	vec3 sample() const {
+		real u, v;
+		distribution->sample(u, v);
+		return square_to_direction(u, v);
+	}
+
+	// Solid angle density of the mixture picking the unit direction wi.
+	real pdf(const vec3& wi, real bsdf_pdf) const {
+		if (!distribution)
+			return bsdf_pdf;
+
+		real u, v;
+		direction_to_square(wi, u, v);
+		return bsdf_fraction * bsdf_pdf + (1 - bsdf_fraction) * distribution->pdf(u, v) / (4 * pi);
+	}
+
+	// Radiance arriving from the unit direction wi, sampled with density pdf.
+	void record(const vec3& wi, real radiance, real pdf) const {
+		if (!recorder || !(pdf > 0) || !std::isfinite(radiance))
+			return;
+
+		real u, v;
+		direction_to_square(wi, u, v);
+		recorder->record(u, v, radiance / pdf);
+	}
+};
+
+// Binary tree over the scene bounds, halving along x, y and z in turn.
+class path_guide {
+public:
+	// Training passes record into the trees; set while they render.
+	bool recording = false;
+	real bsdf_fraction = real(0.5);
+	// Regions are split once they get more than this many samples times
+	// sqrt(2^pass), directional leaves when they hold more than the given
+	// fraction of their tree's energy.
+	real spatial_threshold = 12000;
+	real directional_threshold = real(0.01);
+	int max_directional_depth = 20;
+public:
+	path_guide(const aabb& bounds);
+
+	guided_vertex at(const point3& p);
+
+	// Ends a training pass: splits busy regions and turns what every region
+	// recorded into the distribution the next passes sample.
+	void refine(int pass);
+
+	size_t region_count() const { return regions.size(); }
+	size_t directional_node_count() const;
+
+private:
+	struct spatial_node {
+		int axis = 0;
+		real split = 0;
+		uint32_t child[2] = { 0, 0 };
+		int region = -1;  // leaf when >= 0
+	};
+	struct region {
+		direction_tree sampling;
+		direction_tree building;
+	};
+
+	aabb bounds;
+	std::vector<spatial_node> nodes;
+	std::vector<region> regions;
+};
+
+path_guide::path_guide(const aabb& scene_bounds) : nodes(1), regions(1) {
+	// A little margin so points on the bounding faces fall inside.
+	auto margin = (scene_bounds.max() - scene_bounds.min()) * real(1e-3) + vec3(1e-4, 1e-4, 1e-4);
+	bounds = aabb(scene_bounds.min() - margin, scene_bounds.max() + margin);
+	nodes[0].region = 0;
+}
+
+guided_vertex path_guide::at(const point3& p) {
+	uint32_t index = 0;
+	while (nodes[index].region < 0) {
+		const auto& n = nodes[index];
+		index = n.child[p[n.axis] < n.split ? 0 : 1];
+	}
+
+	auto& r = regions[nodes[index].region];
+	guided_vertex g;
+	g.recorder = recording ? &r.building : nullptr;
+	if (r.sampling.total() > 0) {
+		g.distribution = &r.sampling;
+		g.bsdf_fraction = bsdf_fraction;
+	}
+	return g;
+}
+
+void path_guide::refine(int pass) {
+	auto threshold = spatial_threshold * sqrt(std::pow(2.0, pass));
+
+	// Split leaves along the next axis, the halves sharing the samples of
+	// the directional tree both of them start from.
+	struct item { uint32_t node; aabb box; int depth; };
+	std::vector<item> stack = { { 0, bounds, 0 } };
+	while (!stack.empty()) {
+		auto it = stack.back();
+		stack.pop_back();
+
+		if (nodes[it.node].region < 0) {
+			const auto n = nodes[it.node];
+			auto low_max = it.box.max(), high_min = it.box.min();
+			low_max[n.axis] = n.split;
+			high_min[n.axis] = n.split;
+			stack.push_back({ n.child[0], aabb(it.box.min(), low_max), it.depth + 1 });
+			stack.push_back({ n.child[1], aabb(high_min, it.box.max()), it.depth + 1 });
+			continue;
+		}
+
+		auto region_index = nodes[it.node].region;
+		auto samples = regions[region_index].building.sample_count();
+		if (samples <= threshold)
+			continue;
+
+		auto axis = it.depth % 3;
+		auto split = (it.box.min()[axis] + it.box.max()[axis]) / 2;
+		auto half = regions[region_index];
+		half.building.set_sample_count(samples / 2);
+		regions[region_index] = half;
+		regions.push_back(half);
+
+		auto low = static_cast<uint32_t>(nodes.size());
+		nodes.resize(nodes.size() + 2);
+		nodes[low].region = region_index;
+		nodes[low + 1].region = static_cast<int>(regions.size()) - 1;
+		auto& parent = nodes[it.node];
+		parent.axis = axis;
+		parent.split = split;
+		parent.child[0] = low;
+		parent.child[1] = low + 1;
+		parent.region = -1;
+
+		// Look at the new node again to split it further if needed.
+		stack.push_back(it);
+	}
+
+	for (auto& r : regions) {
+		r.sampling = r.building;
+		r.building = r.sampling.refined(directional_threshold, max_directional_depth);
+	}
+}
+
+size_t path_guide::directional_node_count() const {
+	size_t count = 0;
+	for (const auto& r : regions) {
+		count += r.sampling.node_count();
+	}
+	return count;
+}
+
+#endif
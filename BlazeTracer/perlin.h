@@ -3,14 +3,29 @@
 
 #include "rtweekend.h"
 
+#if defined(BLAZE_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define BLAZE_PERLIN_GATHER
+#endif
+
 class perlin {
 private:
 	static const int point_count = 256;
+	// turb() evaluates this many octaves side by side.
+	static constexpr int octave_lanes = 8;
+
 	vec3* ranvec;
 	int* perm_x;
 	int* perm_y;
 	int* perm_z;
 
+	// ranvec split per axis and the hash permutation as 32-bit ints, so the
+	// octave lanes can gather from them.
+	alignas(32) real grad_x[point_count];
+	alignas(32) real grad_y[point_count];
+	alignas(32) real grad_z[point_count];
+	alignas(32) int32_t perm[point_count];
+
 public:
 
 	perlin() {
@@ -22,6 +37,13 @@ public:
 		perm_x = perlin_generate_perm();
 		perm_y = perlin_generate_perm();
 		perm_z = perlin_generate_perm();
+
+		for (int i = 0; i < point_count; ++i) {
+			grad_x[i] = ranvec[i].x();
+			grad_y[i] = ranvec[i].y();
+			grad_z[i] = ranvec[i].z();
+			perm[i] = perm_x[i];
+		}
 	}
 
 	~perlin() {
@@ -31,7 +53,7 @@ public:
 		delete[] perm_z;
 	}
 
-	double noise(const point3& p) const { 
+	real noise(const point3& p) const { 
 		auto u = p.x() - floor(p.x());
 		auto v = p.y() - floor(p.y());
 		auto w = p.z() - floor(p.z());
@@ -57,15 +79,51 @@ public:
 		return perlin_interp(c, u, v, w);
 	}
 
-	double turb(const point3& p, int depth = 7) const {
-		auto accum = 0.0;
-		auto temp_p = p;
-		auto weight = 1.0;
+	// Folds the lattice tables into an FNV-1a hash, for caching anything
+	// derived from this noise.
+	uint64_t hash(uint64_t h) const {
+		auto fold = [&h](const void* data, size_t size) {
+			auto bytes = static_cast<const unsigned char*>(data);
+			for (size_t i = 0; i < size; i++) {
+				h ^= bytes[i];
+				h *= 0x100000001b3ULL;
+			}
+		};
+		fold(grad_x, sizeof(grad_x));
+		fold(grad_y, sizeof(grad_y));
+		fold(grad_z, sizeof(grad_z));
+		fold(perm, sizeof(perm));
+		return h;
+	}
+
+	// Sum of depth octaves of noise(), computed in batches of octave_lanes.
+	real turb(const point3& p, int depth = 7) const {
+		alignas(32) real x[octave_lanes], y[octave_lanes], z[octave_lanes];
+		alignas(32) real n[octave_lanes];
 
-		for (int i = 0; i < depth; ++i) {
-			accum += weight * noise(temp_p);
-			weight *= 0.5;
-			temp_p *= 2;
+		real accum = 0;
+		real scale = 1;
+		real weight = 1;
+		for (int first = 0; first < depth; first += octave_lanes) {
+			int count = std::min(depth - first, octave_lanes);
+
+			real lane_scale = scale;
+			for (int l = 0; l < octave_lanes; l++) {
+				// Unused lanes get a harmless point.
+				auto s = l < count ? lane_scale : 0;
+				x[l] = p.x() * s;
+				y[l] = p.y() * s;
+				z[l] = p.z() * s;
+				lane_scale *= 2;
+			}
+
+			noise_lanes(x, y, z, n);
+
+			for (int l = 0; l < count; l++) {
+				accum += weight * n[l];
+				weight *= real(0.5);
+				scale *= 2;
+			}
 		}
 
 		return fabs(accum);
@@ -74,6 +132,101 @@ public:
 
 private:
 
+	// noise() at octave_lanes points at once. Mirrors it exactly, including
+	// the x permutation hashing all three axes and the fade applied twice.
+	void noise_lanes(const real* x, const real* y, const real* z, real* out) const {
+		constexpr int n = octave_lanes;
+		alignas(32) real u[n], v[n], w[n];
+		alignas(32) real uu[n], vv[n], ww[n];
+		alignas(32) int32_t cell[3][2][n];
+		alignas(32) int32_t hash[3][2][n];
+
+		// floor() as truncation fixed up for negatives, which vectorizes.
+		for (int l = 0; l < n; l++) {
+			auto ix = static_cast<int32_t>(x[l]);
+			auto iy = static_cast<int32_t>(y[l]);
+			auto iz = static_cast<int32_t>(z[l]);
+			ix -= x[l] < ix;
+			iy -= y[l] < iy;
+			iz -= z[l] < iz;
+			cell[0][0][l] = ix & 255;
+			cell[1][0][l] = iy & 255;
+			cell[2][0][l] = iz & 255;
+			u[l] = x[l] - ix;
+			v[l] = y[l] - iy;
+			w[l] = z[l] - iz;
+		}
+
+		for (int l = 0; l < n; l++) {
+			u[l] = u[l] * u[l] * (3 - 2 * u[l]);
+			v[l] = v[l] * v[l] * (3 - 2 * v[l]);
+			w[l] = w[l] * w[l] * (3 - 2 * w[l]);
+			uu[l] = u[l] * u[l] * (3 - 2 * u[l]);
+			vv[l] = v[l] * v[l] * (3 - 2 * v[l]);
+			ww[l] = w[l] * w[l] * (3 - 2 * w[l]);
+			for (int a = 0; a < 3; a++) {
+				cell[a][1][l] = (cell[a][0][l] + 1) & 255;
+			}
+		}
+
+		for (int a = 0; a < 3; a++) {
+			for (int d = 0; d < 2; d++) {
+				gather_lanes(perm, cell[a][d], hash[a][d]);
+			}
+		}
+
+		for (int l = 0; l < n; l++) {
+			out[l] = 0;
+		}
+
+		alignas(32) int32_t index[n];
+		alignas(32) real gx[n], gy[n], gz[n];
+		for (int di = 0; di < 2; di++) {
+			for (int dj = 0; dj < 2; dj++) {
+				for (int dk = 0; dk < 2; dk++) {
+					for (int l = 0; l < n; l++) {
+						index[l] = hash[0][di][l] ^ hash[1][dj][l] ^ hash[2][dk][l];
+					}
+
+					gather_lanes(grad_x, index, gx);
+					gather_lanes(grad_y, index, gy);
+					gather_lanes(grad_z, index, gz);
+
+					for (int l = 0; l < n; l++) {
+						auto weight = (di ? uu[l] : 1 - uu[l]) * (dj ? vv[l] : 1 - vv[l]) * (dk ? ww[l] : 1 - ww[l]);
+						out[l] += weight * (gx[l] * (u[l] - di) + gy[l] * (v[l] - dj) + gz[l] * (w[l] - dk));
+					}
+				}
+			}
+		}
+	}
+
+	static void gather_lanes(const int32_t* table, const int32_t* index, int32_t* out) {
+#if defined(BLAZE_PERLIN_GATHER)
+		auto i = _mm256_load_si256(reinterpret_cast<const __m256i*>(index));
+		_mm256_store_si256(reinterpret_cast<__m256i*>(out), _mm256_i32gather_epi32(table, i, 4));
+#else
+		for (int l = 0; l < octave_lanes; l++) out[l] = table[index[l]];
+#endif
+	}
+
+	static void gather_lanes(const real* table, const int32_t* index, real* out) {
+#if defined(BLAZE_PERLIN_GATHER) && defined(BLAZE_USE_FLOAT)
+		auto i = _mm256_load_si256(reinterpret_cast<const __m256i*>(index));
+		_mm256_store_ps(out, _mm256_i32gather_ps(table, i, 4));
+#elif defined(BLAZE_PERLIN_GATHER)
+		// The masked form with a zero source; GCC's _mm256_i32gather_pd
+		// passes an undefined one and trips -Wuninitialized.
+		auto all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+		for (int half = 0; half < octave_lanes; half += 4) {
+			auto i = _mm_load_si128(reinterpret_cast<const __m128i*>(index + half));
+			_mm256_store_pd(out + half, _mm256_mask_i32gather_pd(_mm256_setzero_pd(), table, i, all, 8));
+		}
+#else
+		for (int l = 0; l < octave_lanes; l++) out[l] = table[index[l]];
+#endif
+	}
+
 	static int* perlin_generate_perm() {
 		auto p = new int[point_count];
 
@@ -96,7 +249,7 @@ private:
 		}
 	}
 
-	static double trilinear_interp(double c[2][2][2], double u, double v, double w) {
+	static real trilinear_interp(real c[2][2][2], real u, real v, real w) {
 		auto accum = 0.0;
 		for (int i = 0; i < 2; i++) {
 			for (int j = 0; j < 2; j++) {
@@ -111,7 +264,7 @@ private:
 		return accum;
 	}
 
-	static double perlin_interp(vec3 c[2][2][2], double u, double v, double w) {
+	static real perlin_interp(vec3 c[2][2][2], real u, real v, real w) {
 		auto uu = u * u * (3 - 2 * u);
 		auto vv = v * v * (3 - 2 * v);
 		auto ww = w * w * (3 - 2 * w);
@@ -0,0 +1,12 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+// Scalar type used for geometry and shading. Configure with
+// -DBLAZE_USE_FLOAT=ON to build the whole renderer in single precision.
+#ifdef BLAZE_USE_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+
+struct radiance_cache_settings {
+	// Paths end in the cache at the first diffuse vertex after this many
+	// bounces. 1 is the fast, blotchy preview; more bounces push the bias
+	// further down the path where it matters less.
+	int terminate_bounces = 2;
+	// Cell edge in pixel footprints at the cell's distance from the camera,
+	// rounded up to a power of two. Bigger cells average more paths and
+	// blur more light.
+	real cell_pixels = 16;
+	// Cells are only used once this many paths have been recorded in them.
+	real min_samples = 4;
+	// Weight the estimate from earlier passes keeps when a pass is folded in;
+	// 1 averages over all passes, less forgets the first, biased ones.
+	real history = real(0.75);
+	// The render runs in passes of this many samples per pixel, the cache
+	// refreshed in between.
+	int pass_spp = 4;
+	// log2 of the number of cells.
+	int capacity_log2 = 20;
+};
+
+// Outgoing radiance of diffuse surfaces and media in a spatial hash grid, after
+// Binder et al., "Fast Path Space Filtering by Jittered Spatial Hashing".
+// Cells are keyed by quantized position, level of detail and normal; paths
+// look up a jittered position so cell borders don't show. Render threads
+// record concurrently without locks, new cells being claimed by a compare
+// and swap on their key. What a pass records is only read after refresh().
+class radiance_cache {
+public:
+	// Paths start at max_depth and count down, see ray_color.
+	radiance_cache(const radiance_cache_settings& settings, int max_depth, const point3& camera_origin, real pixel_spread);
+
+	// Whether a path with depth left has bounced enough to end in the cache.
+	bool terminates(int depth) const { return max_depth - depth >= settings.terminate_bounces; }
+
+	// Whether a vertex of mat keeps its outgoing radiance regardless of
+	// where it is seen from, so that it can be cached.
+	static bool caches(const material& mat) {
+		return mat.kind == material_kind::lambertian || mat.kind == material_kind::isotropic;
+	}
+
+	// Radiance the cache holds for rec seen along r, false if it has none.
+	bool lookup(const ray& r, const hit_record& rec, color& radiance) const;
+
+	// Adds the reflected radiance a path found leaving rec along r.
+	void record(const ray& r, const hit_record& rec, const color& radiance);
+
+	// Ends a pass: folds what it recorded into the estimates lookups return.
+	void refresh();
+
+	size_t used_cells() const;
+	size_t capacity() const { return size_t(1) << settings.capacity_log2; }
+
+public:
+	radiance_cache_settings settings;
+
+private:
+	struct cell {
+		std::atomic<uint64_t> key{ 0 };  // 0 for free cells
+		float sum[3] = { 0, 0, 0 };
+		float count = 0;
+		float radiance[3] = { 0, 0, 0 };
+		float weight = 0;
+	};
+
+	uint64_t key(const point3& p, const hit_record& rec, const ray& r) const;
+	const cell* find(uint64_t k) const;
+	cell* claim(uint64_t k);
+
+	static constexpr int max_probes = 16;
+
+	int max_depth;
+	point3 camera_origin;
+	real pixel_spread;
+	std::unique_ptr<cell[]> cells;
+	uint64_t mask;
+};
+
+radiance_cache::radiance_cache(const radiance_cache_settings& s, int depth, const point3& origin, real spread)
+	: settings(s), max_depth(depth), camera_origin(origin), pixel_spread(spread),
+	cells(new cell[size_t(1) << s.capacity_log2]), mask((uint64_t(1) << s.capacity_log2) - 1) {}
+
+inline uint64_t mix_key(uint64_t k) {
+	k ^= k >> 30;
+	k *= 0xbf58476d1ce4e5b9ull;
+	k ^= k >> 27;
+	k *= 0x94d049bb133111ebull;
+	k ^= k >> 31;
+	return k;
+}
+
+uint64_t radiance_cache::key(const point3& p, const hit_record& rec, const ray& r) const {
+	auto footprint = fmax(settings.cell_pixels * pixel_spread * (p - camera_origin).length(), real(1e-6));
+	auto level = static_cast<int>(std::ceil(std::log2(footprint)));
+	auto size = std::ldexp(real(1), level);
+
+	// Media have no orientation; surfaces are split by the side the path
+	// arrived from, in 4 buckets per axis.
+	uint64_t normal_bits = 63;
+	if (rec.mat_ptr->kind != material_kind::isotropic) {
+		auto n = dot(r.direction(), rec.normal) > 0 ? -rec.normal : rec.normal;
+		normal_bits = 0;
+		for (int a = 0; a < 3; a++) {
+			normal_bits = normal_bits * 4 + std::min(static_cast<int>((n[a] + 1) * 2), 3);
+		}
+	}
+
+	// 16 bits per coordinate wrap around, which only makes far apart cells
+	// share an entry.
+	uint64_t k = uint64_t(level & 0xff) << 54 | normal_bits << 48;
+	for (int a = 0; a < 3; a++) {
+		k |= (uint64_t(static_cast<int64_t>(std::floor(p[a] / size))) & 0xffff) << (16 * a);
+	}
+	return k + 1;
+}
+
+const radiance_cache::cell* radiance_cache::find(uint64_t k) const {
+	auto slot = mix_key(k);
+	for (int i = 0; i < max_probes; i++) {
+		const auto& c = cells[(slot + i) & mask];
+		auto stored = c.key.load(std::memory_order_acquire);
+		if (stored == k) return &c;
+		if (stored == 0) return nullptr;
+	}
+	return nullptr;
+}
+
+radiance_cache::cell* radiance_cache::claim(uint64_t k) {
+	auto slot = mix_key(k);
+	for (int i = 0; i < max_probes; i++) {
+		auto& c = cells[(slot + i) & mask];
+		uint64_t stored = 0;
+		if (c.key.compare_exchange_strong(stored, k, std::memory_order_acq_rel) || stored == k)
+			return &c;
+	}
+	// A full neighbourhood drops the record.
+	return nullptr;
+}
+
+bool radiance_cache::lookup(const ray& r, const hit_record& rec, color& radiance) const {
+	// Jitter by up to half a cell so neighbouring cells blend.
+	auto footprint = settings.cell_pixels * pixel_spread * (rec.p - camera_origin).length();
+	auto jitter = vec3(random_double() - 0.5, random_double() - 0.5, random_double() - 0.5) * footprint;
+	auto c = find(key(rec.p + jitter, rec, r));
+	if (!c || c->weight < settings.min_samples)
+		return false;
+
+	radiance = color(c->radiance[0], c->radiance[1], c->radiance[2]);
+	return true;
+}
+
+void radiance_cache::record(const ray& r, const hit_record& rec, const color& radiance) {
+	if (!std::isfinite(radiance.x() + radiance.y() + radiance.z()))
+		return;
+
+	auto c = claim(key(rec.p, rec, r));
+	if (!c)
+		return;
+
+	for (int a = 0; a < 3; a++) {
+		std::atomic_ref<float>(c->sum[a]).fetch_add(static_cast<float>(radiance[a]), std::memory_order_relaxed);
+	}
+	std::atomic_ref<float>(c->count).fetch_add(1.0f, std::memory_order_relaxed);
+}
+
+void radiance_cache::refresh() {
+	for (size_t i = 0; i <= mask; i++) {
+		auto& c = cells[i];
+		if (c.count == 0) continue;
+
+		auto kept = c.weight * static_cast<float>(settings.history);
+		auto weight = kept + c.count;
+		for (int a = 0; a < 3; a++) {
+			c.radiance[a] = (c.radiance[a] * kept + c.sum[a]) / weight;
+			c.sum[a] = 0;
+		}
+		c.weight = weight;
+		c.count = 0;
+	}
+}
+
+size_t radiance_cache::used_cells() const {
+	size_t used = 0;
+	for (size_t i = 0; i <= mask; i++) {
+		if (cells[i].key.load(std::memory_order_relaxed) != 0) used++;
+	}
+	return used;
+}
+
+#endif
@@ -1,24 +1,69 @@
 #ifndef RAY_H
 #define RAY_H
+
+#include <bit>
+#include <cstdint>
+
 #include "vec3.h"
 
-class ray {
+// What a ray is traced for. Objects only intersect the rays whose type is
+// set in their visibility mask.
+enum ray_type : unsigned char {
+	camera_ray = 1,
+	shadow_ray = 2,
+	diffuse_ray = 4,
+	specular_ray = 8,
+	all_rays = camera_ray | shadow_ray | diffuse_ray | specular_ray
+};
+
+template <typename T>
+class ray_t {
 public:
-	point3 orig;
-	vec3 dir;
-	double tm;
+	vec3_t<T> orig;
+	vec3_t<T> dir;
+	T tm;
+	unsigned char type = all_rays;
 public:
-	ray() {}
-	ray(const point3 &origin, const vec3 &direction, double time = 0)
-		: orig(origin), dir(direction), tm(time) {}
+	ray_t() {}
+	ray_t(const vec3_t<T> &origin, const vec3_t<T> &direction, T time = 0, unsigned char ray_type = all_rays)
+		: orig(origin), dir(direction), tm(time), type(ray_type) {}
 
-	point3 origin() const { return orig; }
-	vec3 direction() const { return dir; }
-	double time() const { return tm; }
+	vec3_t<T> origin() const { return orig; }
+	vec3_t<T> direction() const { return dir; }
+	T time() const { return tm; }
 
-	point3 at(double t) const {
+	vec3_t<T> at(T t) const {
 		return orig + t * dir;
 	}
 };
 
-#endif
\ No newline at end of file
+using ray = ray_t<real>;
+
+// Integer type with the same width as T, for stepping a value by whole ULPs.
+template <typename T>
+using ulp_int = std::conditional_t<sizeof(T) == 4, std::int32_t, std::int64_t>;
+
+// Move a surface point off the surface along the normal n, to the side
+// that dir leaves through. The offset is a fixed number of ULPs of the
+// point itself (Waechter & Binder, Ray Tracing Gems ch. 6), so it grows with
+// the hit point's magnitude and single precision does not self-intersect.
+// In double precision the step is negligible and t_min does the work.
+template <typename T>
+inline vec3_t<T> offset_ray_origin(const vec3_t<T>& p, vec3_t<T> n, const vec3_t<T>& dir) {
+	const T origin = T(1.0 / 32.0);
+	const T float_scale = T(1.0 / 65536.0);
+	const T int_scale = T(256.0);
+
+	if (dot(n, dir) < 0) n = -n;
+
+	vec3_t<T> result;
+	for (int a = 0; a < 3; a++) {
+		auto of_i = static_cast<ulp_int<T>>(int_scale * n[a]);
+		auto p_i = std::bit_cast<T>(std::bit_cast<ulp_int<T>>(p[a]) + (p[a] < 0 ? -of_i : of_i));
+		result[a] = fabs(p[a]) < origin ? p[a] + float_scale * n[a] : p_i;
+	}
+
+	return result;
+}
+
+#endif
@@ -0,0 +1,561 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "dispatch.h"
+
+// Camera rays of a pixel tile, traced together through packet_bvh. Stored
+// one array per component so the kernels below load four rays at once.
+struct ray_packet {
+	static constexpr int max_rays = 64;
+
+	int count = 0;
+	alignas(32) real ox[max_rays], oy[max_rays], oz[max_rays];
+	alignas(32) real dx[max_rays], dy[max_rays], dz[max_rays];
+	alignas(32) real inv_dx[max_rays], inv_dy[max_rays], inv_dz[max_rays];
+	alignas(32) real time[max_rays];
+
+	// Range of the origins and inverse directions over the packet, for
+	// rejecting whole nodes by interval arithmetic.
+	real origin_lo[3], origin_hi[3], inv_lo[3], inv_hi[3];
+
+	void clear() { count = 0; }
+	void add(const ray& r);
+	// Call after the last add().
+	void finish();
+
+	ray get(int i) const {
+		return ray(point3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]), time[i], camera_ray);
+	}
+	uint64_t all() const { return count == max_rays ? ~uint64_t(0) : (uint64_t(1) << count) - 1; }
+};
+
+void ray_packet::add(const ray& r) {
+	auto i = count++;
+	ox[i] = r.origin().x(); oy[i] = r.origin().y(); oz[i] = r.origin().z();
+	dx[i] = r.direction().x(); dy[i] = r.direction().y(); dz[i] = r.direction().z();
+	inv_dx[i] = 1 / dx[i]; inv_dy[i] = 1 / dy[i]; inv_dz[i] = 1 / dz[i];
+	time[i] = r.time();
+}
+
+void ray_packet::finish() {
+	const real* o[3] = { ox, oy, oz };
+	const real* inv[3] = { inv_dx, inv_dy, inv_dz };
+	for (int a = 0; a < 3; a++) {
+		origin_lo[a] = origin_hi[a] = o[a][0];
+		inv_lo[a] = inv_hi[a] = inv[a][0];
+		for (int i = 1; i < count; i++) {
+			origin_lo[a] = std::min(origin_lo[a], o[a][i]);
+			origin_hi[a] = std::max(origin_hi[a], o[a][i]);
+			inv_lo[a] = std::min(inv_lo[a], inv[a][i]);
+			inv_hi[a] = std::max(inv_hi[a], inv[a][i]);
+		}
+	}
+
+	// Pad to whole groups of four so the kernels never read garbage.
+	for (int i = count; i < (count + 3) / 4 * 4; i++) {
+		ox[i] = ox[0]; oy[i] = oy[0]; oz[i] = oz[0];
+		dx[i] = dx[0]; dy[i] = dy[0]; dz[i] = dz[0];
+		inv_dx[i] = inv_dx[0]; inv_dy[i] = inv_dy[0]; inv_dz[i] = inv_dz[0];
+		time[i] = time[0];
+	}
+}
+
+// Closest hits of a packet. object is what was hit, nullptr for misses; rec
+// is filled in by packet_bvh::trace before it returns.
+struct packet_hits {
+	alignas(32) real t[ray_packet::max_rays];
+	const hittable* object[ray_packet::max_rays];
+	hit_record rec[ray_packet::max_rays];
+	// Rays that reached something drawing random numbers (media, custom
+	// hittables) and have to be traced alone to keep their samples in order,
+	// or a subtree too deep for the traversal stack.
+	uint64_t deferred = 0;
+	// Rays whose rec is already complete.
+	uint64_t recorded = 0;
+
+	bool hit(int i) const { return object[i] != nullptr; }
+	bool is_deferred(int i) const { return (deferred >> i) & 1; }
+};
+
+// Ray-vs-box and ray-vs-primitive tests on the rays of mask. Hits closer than
+// hits.t replace it and set object to primitive. Only double precision builds
+// with AVX test four rays at a time (the specialization below); SSE2-only and
+// scalar builds, and every float build, use this loop one ray at a time.
+template <typename T>
+struct packet_kernels {
+	static uint64_t box(const ray_packet& p, const T* bounds, uint64_t mask, const T* t_max, T t_min) {
+		uint64_t result = 0;
+		const T* o[3] = { p.ox, p.oy, p.oz };
+		const T* inv[3] = { p.inv_dx, p.inv_dy, p.inv_dz };
+		for (auto m = mask; m; m &= m - 1) {
+			auto i = std::countr_zero(m);
+			auto near = t_min, far = t_max[i];
+			for (int a = 0; a < 3; a++) {
+				auto t0 = (bounds[a] - o[a][i]) * inv[a][i];
+				auto t1 = (bounds[a + 3] - o[a][i]) * inv[a][i];
+				near = std::max(near, std::min(t0, t1));
+				far = std::min(far, std::max(t0, t1));
+			}
+			if (far > near) result |= uint64_t(1) << i;
+		}
+		return result;
+	}
+
+	static void sphere(const ray_packet& p, const point3& center, T radius, uint64_t mask, T t_min,
+		packet_hits& hits, const hittable* primitive) {
+		for (auto m = mask; m; m &= m - 1) {
+			auto i = std::countr_zero(m);
+			auto ocx = p.ox[i] - center.x(), ocy = p.oy[i] - center.y(), ocz = p.oz[i] - center.z();
+			auto a = p.dx[i] * p.dx[i] + p.dy[i] * p.dy[i] + p.dz[i] * p.dz[i];
+			auto half_b = ocx * p.dx[i] + ocy * p.dy[i] + ocz * p.dz[i];
+			auto c = ocx * ocx + ocy * ocy + ocz * ocz - radius * radius;
+			auto discriminant = half_b * half_b - a * c;
+			if (discriminant < 0) continue;
+
+			auto sqrtd = std::sqrt(discriminant);
+			auto root = (-half_b - sqrtd) / a;
+			if (root < t_min || hits.t[i] < root) {
+				root = (-half_b + sqrtd) / a;
+				if (root < t_min || hits.t[i] < root) continue;
+			}
+			hits.t[i] = root;
+			hits.object[i] = primitive;
+		}
+	}
+
+	// Rectangle at k on axis, spanning [b0, b1] x [c0, c1] on the two others
+	// in order.
+	static void rect(const ray_packet& p, int axis, T k, T b0, T b1, T c0, T c1, uint64_t mask, T t_min,
+		packet_hits& hits, const hittable* primitive) {
+		const T* o[3] = { p.ox, p.oy, p.oz };
+		const T* d[3] = { p.dx, p.dy, p.dz };
+		auto b = axis == 0 ? 1 : 0, c = axis == 2 ? 1 : 2;
+		for (auto m = mask; m; m &= m - 1) {
+			auto i = std::countr_zero(m);
+			auto t = (k - o[axis][i]) / d[axis][i];
+			if (t < t_min || t > hits.t[i]) continue;
+
+			auto x = o[b][i] + t * d[b][i];
+			auto y = o[c][i] + t * d[c][i];
+			if (x < b0 || x > b1 || y < c0 || y > c1) continue;
+			hits.t[i] = t;
+			hits.object[i] = primitive;
+		}
+	}
+};
+
+#if defined(BLAZE_SIMD_AVX) && !defined(BLAZE_USE_FLOAT)
+
+template <>
+struct packet_kernels<double> {
+	// Groups of four rays with any bit set in mask.
+	template <typename F>
+	static void for_groups(uint64_t mask, F&& f) {
+		while (mask) {
+			auto g = std::countr_zero(mask) & ~3;
+			f(g, static_cast<int>((mask >> g) & 0xf));
+			mask &= ~(uint64_t(0xf) << g);
+		}
+	}
+
+	static uint64_t box(const ray_packet& p, const double* bounds, uint64_t mask, const double* t_max, double t_min) {
+		uint64_t result = 0;
+		const double* o[3] = { p.ox, p.oy, p.oz };
+		const double* inv[3] = { p.inv_dx, p.inv_dy, p.inv_dz };
+		for_groups(mask, [&](int g, int lanes) {
+			__m256d near = _mm256_set1_pd(t_min);
+			__m256d far = _mm256_load_pd(t_max + g);
+			for (int a = 0; a < 3; a++) {
+				__m256d org = _mm256_load_pd(o[a] + g);
+				__m256d id = _mm256_load_pd(inv[a] + g);
+				__m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(bounds[a]), org), id);
+				__m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(bounds[a + 3]), org), id);
+				near = _mm256_max_pd(near, _mm256_min_pd(t0, t1));
+				far = _mm256_min_pd(far, _mm256_max_pd(t0, t1));
+			}
+			auto bits = _mm256_movemask_pd(_mm256_cmp_pd(far, near, _CMP_GT_OQ)) & lanes;
+			result |= uint64_t(bits) << g;
+		});
+		return result;
+	}
+
+	// Stores t in the lanes of bits and points them at primitive.
+	static void accept(packet_hits& hits, int g, int bits, __m256d t, const hittable* primitive) {
+		if (!bits) return;
+		__m256d old = _mm256_load_pd(hits.t + g);
+		__m256d take = _mm256_castsi256_pd(_mm256_set_epi64x(bits & 8 ? -1 : 0, bits & 4 ? -1 : 0,
+			bits & 2 ? -1 : 0, bits & 1 ? -1 : 0));
+		_mm256_store_pd(hits.t + g, _mm256_blendv_pd(old, t, take));
+		for (int l = 0; l < 4; l++) {
+			if (bits & (1 << l)) hits.object[g + l] = primitive;
+		}
+	}
+
+	static void sphere(const ray_packet& p, const point3& center, double radius, uint64_t mask, double t_min,
+		packet_hits& hits, const hittable* primitive) {
+		__m256d cx = _mm256_set1_pd(center.x()), cy = _mm256_set1_pd(center.y()), cz = _mm256_set1_pd(center.z());
+		__m256d r2 = _mm256_set1_pd(radius * radius);
+		__m256d lo = _mm256_set1_pd(t_min);
+		for_groups(mask, [&](int g, int lanes) {
+			__m256d dx = _mm256_load_pd(p.dx + g), dy = _mm256_load_pd(p.dy + g), dz = _mm256_load_pd(p.dz + g);
+			__m256d ocx = _mm256_sub_pd(_mm256_load_pd(p.ox + g), cx);
+			__m256d ocy = _mm256_sub_pd(_mm256_load_pd(p.oy + g), cy);
+			__m256d ocz = _mm256_sub_pd(_mm256_load_pd(p.oz + g), cz);
+			__m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+			__m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+			__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)),
+				_mm256_mul_pd(ocz, ocz)), r2);
+			__m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+			__m256d real_roots = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ);
+			__m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(discriminant, _mm256_setzero_pd()));
+
+			__m256d hi = _mm256_load_pd(hits.t + g);
+			__m256d near = _mm256_div_pd(_mm256_sub_pd(_mm256_setzero_pd(), _mm256_add_pd(half_b, sqrtd)), a);
+			__m256d far = _mm256_div_pd(_mm256_sub_pd(sqrtd, half_b), a);
+			__m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(near, lo, _CMP_GE_OQ), _mm256_cmp_pd(near, hi, _CMP_LE_OQ));
+			__m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(far, lo, _CMP_GE_OQ), _mm256_cmp_pd(far, hi, _CMP_LE_OQ));
+			__m256d ok = _mm256_and_pd(real_roots, _mm256_or_pd(near_ok, far_ok));
+			accept(hits, g, _mm256_movemask_pd(ok) & lanes, _mm256_blendv_pd(far, near, near_ok), primitive);
+		});
+	}
+
+	static void rect(const ray_packet& p, int axis, double k, double b0, double b1, double c0, double c1,
+		uint64_t mask, double t_min, packet_hits& hits, const hittable* primitive) {
+		const double* o[3] = { p.ox, p.oy, p.oz };
+		const double* d[3] = { p.dx, p.dy, p.dz };
+		auto b = axis == 0 ? 1 : 0, c = axis == 2 ? 1 : 2;
+		__m256d lo = _mm256_set1_pd(t_min);
+		for_groups(mask, [&](int g, int lanes) {
+			__m256d t = _mm256_div_pd(_mm256_sub_pd(_mm256_set1_pd(k), _mm256_load_pd(o[axis] + g)), _mm256_load_pd(d[axis] + g));
+			__m256d x = _mm256_add_pd(_mm256_load_pd(o[b] + g), _mm256_mul_pd(t, _mm256_load_pd(d[b] + g)));
+			__m256d y = _mm256_add_pd(_mm256_load_pd(o[c] + g), _mm256_mul_pd(t, _mm256_load_pd(d[c] + g)));
+			__m256d ok = _mm256_and_pd(_mm256_cmp_pd(t, lo, _CMP_GE_OQ), _mm256_cmp_pd(t, _mm256_load_pd(hits.t + g), _CMP_LE_OQ));
+			ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(x, _mm256_set1_pd(b0), _CMP_GE_OQ), _mm256_cmp_pd(x, _mm256_set1_pd(b1), _CMP_LE_OQ)));
+			ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(y, _mm256_set1_pd(c0), _CMP_GE_OQ), _mm256_cmp_pd(y, _mm256_set1_pd(c1), _CMP_LE_OQ)));
+			accept(hits, g, _mm256_movemask_pd(ok) & lanes, t, primitive);
+		});
+	}
+};
+
+#endif
+
+// Flattened copy of the camera-visible part of a scene, traversed by whole
+// packets: a node is skipped when interval arithmetic over the packet shows
+// no ray can reach it, otherwise its box is tested ray by ray and only the
+// rays that hit go on. Once few rays are left the packet has diverged and
+// they finish the subtree one at a time through the scene's own BVH.
+class packet_bvh {
+public:
+	// Below this many active rays a subtree is traced ray by ray.
+	int scalar_rays = 4;
+public:
+	// Leaf boxes cover the shutter interval [time0, time1].
+	packet_bvh(const hittable& root, real time0, real time1);
+
+	// Closest hits in (t_min, infinity) of the rays in packet, the same ones
+	// hit_dispatch finds up to rounding.
+	void trace(const ray_packet& packet, real t_min, packet_hits& hits) const;
+
+	size_t node_count() const { return nodes.size(); }
+
+private:
+	enum class node_kind : unsigned char {
+		interior,
+		sphere,
+		xy_rect,
+		xz_rect,
+		yz_rect,
+		scalar,    // other primitives, hit one ray at a time
+		deferred   // draws random numbers, see packet_hits
+	};
+
+	struct node {
+		real bounds[6];  // min x, y, z then max x, y, z
+		uint32_t child[2] = { 0, 0 };
+		// The primitive of leaves; the BVH node an interior node mirrors, if
+		// any, for tracing diverged rays.
+		const hittable* object = nullptr;
+		node_kind kind = node_kind::interior;
+		bool draws_random = false;  // somewhere in the subtree
+	};
+
+	static constexpr uint32_t none = ~uint32_t(0);
+
+	uint32_t build(const hittable& h);
+	uint32_t build_list(const std::vector<const hittable*>& objects, size_t start, size_t end);
+	uint32_t make_interior(uint32_t left, uint32_t right, const hittable* source);
+	uint32_t make_leaf(const hittable& h, node_kind kind);
+	bool packet_misses(const ray_packet& p, const node& n, real t_min, real t_max) const;
+
+	std::vector<node> nodes;
+	uint32_t root = none;
+	real time0, time1;
+};
+
+packet_bvh::packet_bvh(const hittable& scene, real time0, real time1)
+	: time0(time0), time1(time1) {
+	root = build(scene);
+}
+
+// Whether hitting h may consume random numbers.
+inline bool hit_draws_random(const hittable& h) {
+	switch (h.kind) {
+	case hittable_kind::custom:
+	case hittable_kind::constant_medium:
+	case hittable_kind::grid_medium:
+		return true;
+	case hittable_kind::hittable_list:
+		for (const auto& object : static_cast<const hittable_list&>(h).objects) {
+			if (hit_draws_random(*object)) return true;
+		}
+		return false;
+	case hittable_kind::bvh_node: {
+		const auto& n = static_cast<const bvh_node&>(h);
+		return hit_draws_random(*n.left) || hit_draws_random(*n.right);
+	}
+	case hittable_kind::box:
+		return hit_draws_random(static_cast<const box&>(h).sides);
+	case hittable_kind::translate:
+		return hit_draws_random(*static_cast<const translate&>(h).ptr);
+	case hittable_kind::rotate_y:
+		return hit_draws_random(*static_cast<const rotate_y&>(h).ptr);
+	default:
+		return false;
+	}
+}
+
+uint32_t packet_bvh::build(const hittable& h) {
+	if (!(h.visibility & camera_ray))
+		return none;
+
+	switch (h.kind) {
+	case hittable_kind::bvh_node: {
+		// Nodes keep the BVH's own boxes so they cull exactly the rays it
+		// culls, even where those are tighter than their children's.
+		const auto& n = static_cast<const bvh_node&>(h);
+		auto index = n.left == n.right ? build(*n.left) : make_interior(build(*n.left), build(*n.right), &h);
+		if (index != none) {
+			for (int a = 0; a < 3; a++) {
+				nodes[index].bounds[a] = n.box.min()[a];
+				nodes[index].bounds[a + 3] = n.box.max()[a];
+			}
+		}
+		return index;
+	}
+	case hittable_kind::hittable_list:
+	case hittable_kind::box: {
+		const auto& list = h.kind == hittable_kind::box ? static_cast<const box&>(h).sides : static_cast<const hittable_list&>(h);
+		std::vector<const hittable*> objects;
+		for (const auto& object : list.objects) objects.push_back(object.get());
+		return build_list(objects, 0, objects.size());
+	}
+	case hittable_kind::sphere:
+		return make_leaf(h, node_kind::sphere);
+	case hittable_kind::xy_rect:
+		return make_leaf(h, node_kind::xy_rect);
+	case hittable_kind::xz_rect:
+		return make_leaf(h, node_kind::xz_rect);
+	case hittable_kind::yz_rect:
+		return make_leaf(h, node_kind::yz_rect);
+	default:
+		return make_leaf(h, hit_draws_random(h) ? node_kind::deferred : node_kind::scalar);
+	}
+}
+
+// Balanced tree over a list; traversal still visits the objects in order,
+// so ties go the way hittable_list::hit resolves them.
+uint32_t packet_bvh::build_list(const std::vector<const hittable*>& objects, size_t start, size_t end) {
+	if (end - start == 0)
+		return none;
+	if (end - start == 1)
+		return build(*objects[start]);
+
+	auto mid = start + (end - start) / 2;
+	return make_interior(build_list(objects, start, mid), build_list(objects, mid, end), nullptr);
+}
+
+uint32_t packet_bvh::make_interior(uint32_t left, uint32_t right, const hittable* source) {
+	if (left == none) return right;
+	if (right == none) return left;
+
+	node n;
+	n.child[0] = left;
+	n.child[1] = right;
+	n.object = source;
+	n.draws_random = nodes[left].draws_random || nodes[right].draws_random;
+	for (int a = 0; a < 3; a++) {
+		n.bounds[a] = std::min(nodes[left].bounds[a], nodes[right].bounds[a]);
+		n.bounds[a + 3] = std::max(nodes[left].bounds[a + 3], nodes[right].bounds[a + 3]);
+	}
+	nodes.push_back(n);
+	return static_cast<uint32_t>(nodes.size() - 1);
+}
+
+uint32_t packet_bvh::make_leaf(const hittable& h, node_kind kind) {
+	// Boxes over the whole shutter interval of the camera.
+	aabb box(point3(-infinity, -infinity, -infinity), point3(infinity, infinity, infinity));
+	h.bounding_box(time0, time1, box);
+
+	node n;
+	n.object = &h;
+	n.kind = kind;
+	n.draws_random = kind == node_kind::deferred;
+	for (int a = 0; a < 3; a++) {
+		n.bounds[a] = box.min()[a];
+		n.bounds[a + 3] = box.max()[a];
+	}
+	nodes.push_back(n);
+	return static_cast<uint32_t>(nodes.size() - 1);
+}
+
+// Conservative: slab intervals over every origin and inverse direction the
+// packet holds. Only used while all its directions agree in sign per axis.
+bool packet_bvh::packet_misses(const ray_packet& p, const node& n, real t_min, real t_max) const {
+	auto near = t_min, far = t_max;
+	for (int a = 0; a < 3; a++) {
+		if (p.inv_lo[a] < 0 && p.inv_hi[a] > 0)
+			return false;
+
+		// Products of the intervals [bound - origin] and [inv].
+		auto slab = [&](real bound, real& lo, real& hi) {
+			auto d0 = bound - p.origin_hi[a], d1 = bound - p.origin_lo[a];
+			real products[4] = { d0 * p.inv_lo[a], d0 * p.inv_hi[a], d1 * p.inv_lo[a], d1 * p.inv_hi[a] };
+			lo = *std::min_element(products, products + 4);
+			hi = *std::max_element(products, products + 4);
+		};
+		real lo0, hi0, lo1, hi1;
+		slab(n.bounds[a], lo0, hi0);
+		slab(n.bounds[a + 3], lo1, hi1);
+		// Entering the slab happens at the nearer plane, leaving at the
+		// farther one; the sign of the directions says which is which.
+		if (p.inv_lo[a] >= 0) {
+			near = std::max(near, lo0);
+			far = std::min(far, hi1);
+		}
+		else {
+			near = std::max(near, lo1);
+			far = std::min(far, hi0);
+		}
+	}
+	// Slack for rounding, which the per-ray test may resolve differently.
+	return near > far + 1e-6 * (fabs(near) + fabs(far));
+}
+
+void packet_bvh::trace(const ray_packet& packet, real t_min, packet_hits& hits) const {
+	using kernels = packet_kernels<real>;
+
+	hits.deferred = 0;
+	hits.recorded = 0;
+	for (int i = 0; i < ray_packet::max_rays; i++) {
+		hits.t[i] = infinity;
+		hits.object[i] = nullptr;
+	}
+	if (root == none)
+		return;
+
+	auto trace_alone = [&](const hittable& h, uint64_t mask) {
+		for (auto m = mask; m; m &= m - 1) {
+			auto i = std::countr_zero(m);
+			if (hit_dispatch(h, packet.get(i), t_min, hits.t[i], hits.rec[i])) {
+				hits.t[i] = hits.rec[i].t;
+				hits.object[i] = &h;
+				hits.recorded |= uint64_t(1) << i;
+			}
+		}
+	};
+
+	struct entry { uint32_t node; uint64_t mask; };
+	constexpr int stack_size = 128;
+	entry stack[stack_size];
+	int top = 0;
+	stack[top++] = { root, packet.all() };
+	while (top > 0) {
+		auto [index, mask] = stack[--top];
+		mask &= ~hits.deferred;
+		if (!mask) continue;
+
+		const auto& n = nodes[index];
+		bool leaf_kernel = n.kind != node_kind::interior && n.kind != node_kind::scalar && n.kind != node_kind::deferred;
+		if (!leaf_kernel) {
+			real t_max = 0;
+			for (auto m = mask; m; m &= m - 1) t_max = std::max(t_max, hits.t[std::countr_zero(m)]);
+			if (packet_misses(packet, n, t_min, t_max))
+				continue;
+			mask = kernels::box(packet, n.bounds, mask, hits.t, t_min);
+			if (!mask) continue;
+		}
+
+		// Kernel hits replace whatever record an earlier primitive left.
+		auto kernel_hit = [&](auto&& run) {
+			run();
+			for (auto m = mask & hits.recorded; m; m &= m - 1) {
+				auto i = std::countr_zero(m);
+				if (hits.object[i] == n.object) hits.recorded &= ~(uint64_t(1) << i);
+			}
+		};
+
+		switch (n.kind) {
+		case node_kind::interior:
+			if (n.object && !n.draws_random && std::popcount(mask) < scalar_rays) {
+				trace_alone(*n.object, mask);
+				break;
+			}
+			// Too deep for the stack: finish the subtree ray by ray, or
+			// leave the rays to the scalar tracer if there is no BVH node
+			// to do it through.
+			if (top + 2 > stack_size) {
+				if (n.object && !n.draws_random)
+					trace_alone(*n.object, mask);
+				else
+					hits.deferred |= mask;
+				break;
+			}
+			stack[top++] = { n.child[1], mask };
+			stack[top++] = { n.child[0], mask };
+			break;
+		case node_kind::sphere: {
+			const auto& s = static_cast<const sphere&>(*n.object);
+			kernel_hit([&] { kernels::sphere(packet, s.center, s.radius, mask, t_min, hits, n.object); });
+			break;
+		}
+		case node_kind::xy_rect: {
+			const auto& r = static_cast<const xy_rect&>(*n.object);
+			kernel_hit([&] { kernels::rect(packet, 2, r.k, r.x0, r.x1, r.y0, r.y1, mask, t_min, hits, n.object); });
+			break;
+		}
+		case node_kind::xz_rect: {
+			const auto& r = static_cast<const xz_rect&>(*n.object);
+			kernel_hit([&] { kernels::rect(packet, 1, r.k, r.x0, r.x1, r.z0, r.z1, mask, t_min, hits, n.object); });
+			break;
+		}
+		case node_kind::yz_rect: {
+			const auto& r = static_cast<const yz_rect&>(*n.object);
+			kernel_hit([&] { kernels::rect(packet, 0, r.k, r.y0, r.y1, r.z0, r.z1, mask, t_min, hits, n.object); });
+			break;
+		}
+		case node_kind::scalar:
+			trace_alone(*n.object, mask);
+			break;
+		case node_kind::deferred:
+			hits.deferred |= mask;
+			break;
+		}
+	}
+
+	// The kernels only find the closest primitive; its own hit() fills in
+	// the record.
+	for (auto m = packet.all() & ~hits.deferred & ~hits.recorded; m; m &= m - 1) {
+		auto i = std::countr_zero(m);
+		if (hits.object[i] && !hit_dispatch(*hits.object[i], packet.get(i), t_min, infinity, hits.rec[i]))
+			hits.object[i] = nullptr;
+	}
+}
+
+#endif
@@ -6,22 +6,37 @@
 #include <memory>
 #include <random>
 
+#include "precision.h"
+
 //USING
 
 using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
-const double infinity = std::numeric_limits<double>::infinity();
+const real infinity = std::numeric_limits<real>::infinity();
 
-const double pi = 3.1415926535897932385;
+const real pi = real(3.1415926535897932385);
 
-inline double degrees_to_radians(double degrees) {
+inline real degrees_to_radians(real degrees) {
 	return degrees * pi / 180.0;
 }
 
 
+// Source of the random numbers of the current pixel sample. Render threads
+// install their sampler (see sampler.h) so every random_double() on a path
+// draws its next dimension; scene setup falls back to the shared generator.
+class sample_source {
+public:
+    virtual double next() = 0;
+};
+
+inline thread_local sample_source* active_sample_source = nullptr;
+
 inline double random_double() {
+    if (active_sample_source)
+        return active_sample_source->next();
+
     static std::uniform_real_distribution<double> distribution(0.0, 1.0);
     static std::mt19937 generator;
     return distribution(generator);
@@ -0,0 +1,444 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "rtweekend.h"
+
+// Pixel sample generators. Each pixel sample is a point in an unbounded
+// number of dimensions: thread_trace asks for the film position and the lens
+// position as 2D samples and the shutter time as a 1D one, and once a sampler
+// is installed as the thread's sample_source every random_double() along the
+// path takes the next dimension. Dimensions are decorrelated by hashing the
+// dimension index into the scramble / permutation of each one.
+enum class sampler_kind {
+	independent,
+	sobol,
+	cmj,
+	rank1
+};
+
+inline const char* sampler_name(sampler_kind kind) {
+	switch (kind) {
+	case sampler_kind::sobol: return "Owen-scrambled Sobol";
+	case sampler_kind::cmj: return "correlated multi-jittered";
+	case sampler_kind::rank1: return "blue-noise rank-1 lattice";
+	default: return "independent";
+	}
+}
+
+const double one_minus_epsilon = 0x1.fffffffffffffp-1;
+
+inline uint32_t mix_bits(uint32_t v) {
+	v ^= v >> 16;
+	v *= 0x7feb352du;
+	v ^= v >> 15;
+	v *= 0x846ca68bu;
+	v ^= v >> 16;
+	return v;
+}
+
+inline uint32_t hash_combine(uint32_t a, uint32_t b) {
+	return mix_bits(a ^ (b + 0x9e3779b9u + (a << 6) + (a >> 2)));
+}
+
+inline double to_unit(uint32_t bits) {
+	return std::min(bits * 0x1p-32, one_minus_epsilon);
+}
+
+class sampler : public sample_source {
+public:
+	sampler(int samples_per_pixel, uint32_t seed = 0) : samples_per_pixel(samples_per_pixel), seed(seed) {}
+	virtual ~sampler() {}
+
+	sampler_kind kind() const { return type; }
+
+	virtual void start_pixel_sample(int x, int y, int index) {
+		pixel_x = x;
+		pixel_y = y;
+		pixel_seed = hash_combine(hash_combine(seed, static_cast<uint32_t>(x)), static_cast<uint32_t>(y));
+		sample_index = static_cast<uint32_t>(index);
+		dimension = 0;
+	}
+
+	virtual double get_1d() = 0;
+	virtual void get_2d(double& u, double& v) = 0;
+
+	virtual double next() override { return get_1d(); }
+
+	// How far a pixel sample has got, so it can be put aside and continued
+	// later, also on another sampler with the same settings. The wavefront
+	// integrator keeps one per path.
+	struct position {
+		int x, y;
+		uint32_t pixel_seed, index, dimension;
+		uint64_t state;  // generator state, for samplers that have one
+	};
+
+	virtual position save() const { return { pixel_x, pixel_y, pixel_seed, sample_index, dimension, 0 }; }
+	virtual void restore(const position& p) {
+		pixel_x = p.x;
+		pixel_y = p.y;
+		pixel_seed = p.pixel_seed;
+		sample_index = p.index;
+		dimension = p.dimension;
+	}
+
+protected:
+	sampler_kind type = sampler_kind::independent;
+	int samples_per_pixel;
+	uint32_t seed;
+
+	int pixel_x = 0, pixel_y = 0;
+	uint32_t pixel_seed = 0;
+	uint32_t sample_index = 0;
+	uint32_t dimension = 0;
+};
+
+// Plain uniform random numbers from a PCG32 stream per pixel sample.
+class independent_sampler : public sampler {
+public:
+	independent_sampler(int samples_per_pixel, uint32_t seed = 0) : sampler(samples_per_pixel, seed) {
+		type = sampler_kind::independent;
+	}
+
+	virtual void start_pixel_sample(int x, int y, int index) override {
+		sampler::start_pixel_sample(x, y, index);
+		state = uint64_t(hash_combine(pixel_seed, sample_index)) << 32
+			| hash_combine(sample_index, pixel_seed ^ 0x85ebca6bu);
+		next_u32();
+	}
+
+	virtual double get_1d() override { return to_unit(next_u32()); }
+	virtual void get_2d(double& u, double& v) override {
+		u = get_1d();
+		v = get_1d();
+	}
+
+	virtual position save() const override {
+		auto p = sampler::save();
+		p.state = state;
+		return p;
+	}
+	virtual void restore(const position& p) override {
+		sampler::restore(p);
+		state = p.state;
+	}
+
+private:
+	uint32_t next_u32() {
+		auto old = state;
+		state = old * 6364136223846793005ull + 1442695040888963407ull;
+		uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = static_cast<uint32_t>(old >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+
+	uint64_t state = 0;
+};
+
+inline uint32_t reverse_bits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// Hash based Owen scrambling (Burley, "Practical Hash-based Owen
+// Scrambling"): the Laine-Karras permutation applied to the reversed bits
+// flips every bit depending only on the bits above it.
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+// Second Sobol dimension (the first is the bit reversal of the index).
+inline uint32_t sobol_dimension_1(uint32_t index) {
+	uint32_t result = 0;
+	uint32_t direction = 0x80000000u;
+	for (; index; index >>= 1) {
+		if (index & 1) result ^= direction;
+		direction ^= direction >> 1;
+	}
+	return result;
+}
+
+// Owen-scrambled Sobol padded across dimensions: every 1D and 2D request
+// shuffles the sample index and scrambles the point with seeds hashed from
+// the pixel and dimension, so each dimension is well stratified on its own
+// and independent of the others.
+class sobol_sampler : public sampler {
+public:
+	sobol_sampler(int samples_per_pixel, uint32_t seed = 0) : sampler(samples_per_pixel, seed) {
+		type = sampler_kind::sobol;
+	}
+
+	virtual double get_1d() override {
+		auto dim_seed = hash_combine(pixel_seed, dimension++);
+		auto index = nested_uniform_scramble(sample_index, dim_seed);
+		return to_unit(nested_uniform_scramble(reverse_bits(index), mix_bits(dim_seed ^ 0x68bc21ebu)));
+	}
+
+	virtual void get_2d(double& u, double& v) override {
+		auto dim_seed = hash_combine(pixel_seed, dimension++);
+		auto index = nested_uniform_scramble(sample_index, dim_seed);
+		u = to_unit(nested_uniform_scramble(reverse_bits(index), mix_bits(dim_seed ^ 0xa511e9b3u)));
+		v = to_unit(nested_uniform_scramble(sobol_dimension_1(index), mix_bits(dim_seed ^ 0x63d83595u)));
+	}
+};
+
+// Kensler, "Correlated Multi-Jittered Sampling": random permutation of i in
+// [0, l) selected by p.
+inline uint32_t cmj_permute(uint32_t i, uint32_t l, uint32_t p) {
+	if (l <= 1) return 0;
+
+	uint32_t w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= p;
+		i *= 0xe170893du;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3fu;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303u;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= l);
+	return (i + p) % l;
+}
+
+inline double cmj_randfloat(uint32_t i, uint32_t p) {
+	i ^= p;
+	i ^= i >> 17;
+	i ^= i >> 10;
+	i *= 0xb36534e5u;
+	i ^= i >> 12;
+	i ^= i >> 21;
+	i *= 0x93fc4795u;
+	i ^= 0xdf6e307fu;
+	i ^= i >> 17;
+	i *= 1 | p >> 18;
+	return to_unit(i);
+}
+
+// Correlated multi-jittered: the samples of a pixel form an m x n jittered
+// grid that is also stratified in both 1D projections. Needs the sample count
+// up front; sample indices past it start a new pattern.
+class cmj_sampler : public sampler {
+public:
+	cmj_sampler(int samples_per_pixel, uint32_t seed = 0) : sampler(samples_per_pixel, seed) {
+		type = sampler_kind::cmj;
+		m = static_cast<uint32_t>(ceil(sqrt(static_cast<double>(samples_per_pixel))));
+		n = (samples_per_pixel + m - 1) / m;
+	}
+
+	virtual double get_1d() override {
+		uint32_t count = samples_per_pixel;
+		auto p = pattern();
+		auto s = cmj_permute(sample_index % count, count, p * 0x68bc21ebu);
+		return std::min((s + cmj_randfloat(sample_index, p * 0x02e5be93u)) / count, one_minus_epsilon);
+	}
+
+	virtual void get_2d(double& u, double& v) override {
+		uint32_t count = m * n;
+		auto p = pattern();
+		auto s = cmj_permute(sample_index % count, count, p * 0x51633e2du);
+		auto sx = cmj_permute(s % m, m, p * 0xa511e9b3u);
+		auto sy = cmj_permute(s / m, n, p * 0x63d83595u);
+		auto jx = cmj_randfloat(s, p * 0xa399d265u);
+		auto jy = cmj_randfloat(s, p * 0x711ad6a5u);
+		u = std::min((s % m + (sy + jx) / n) / m, one_minus_epsilon);
+		v = std::min((s / m + (sx + jy) / m) / n, one_minus_epsilon);
+	}
+
+private:
+	uint32_t pattern() {
+		auto round = sample_index / static_cast<uint32_t>(samples_per_pixel);
+		return hash_combine(hash_combine(pixel_seed, dimension++), round);
+	}
+
+	uint32_t m, n;
+};
+
+// 64x64 blue noise ranks from void-and-cluster (Ulichney), built once.
+class blue_noise_mask {
+public:
+	static const int size = 64;
+
+	static const blue_noise_mask& get() {
+		static const blue_noise_mask mask;
+		return mask;
+	}
+
+	// Value in [0, 1) at a toroidally wrapped pixel.
+	double value(int x, int y) const {
+		x &= size - 1;
+		y &= size - 1;
+		return (ranks[y * size + x] + 0.5) / (size * size);
+	}
+
+private:
+	blue_noise_mask();
+
+	std::vector<int> ranks;
+};
+
+blue_noise_mask::blue_noise_mask() : ranks(size * size) {
+	const int count = size * size;
+	const double sigma = 1.9;
+
+	// Gaussian energy splat for every toroidal offset.
+	std::vector<double> kernel(count);
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			int dx = std::min(x, size - x);
+			int dy = std::min(y, size - y);
+			kernel[y * size + x] = exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+		}
+	}
+
+	std::vector<char> on(count, 0);
+	std::vector<double> energy(count, 0);
+	auto toggle = [&](int i, bool set) {
+		on[i] = set;
+		int px = i % size, py = i / size;
+		double sign = set ? 1 : -1;
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				energy[y * size + x] += sign * kernel[((y - py) & (size - 1)) * size + ((x - px) & (size - 1))];
+			}
+		}
+	};
+	auto tightest_cluster = [&]() {
+		int best = -1;
+		for (int i = 0; i < count; i++)
+			if (on[i] && (best < 0 || energy[i] > energy[best])) best = i;
+		return best;
+	};
+	auto largest_void = [&]() {
+		int best = -1;
+		for (int i = 0; i < count; i++)
+			if (!on[i] && (best < 0 || energy[i] < energy[best])) best = i;
+		return best;
+	};
+
+	// Initial pattern: random points, relaxed until moving the tightest
+	// cluster into the largest void puts it straight back.
+	std::mt19937 rng(7);
+	int initial = count / 10;
+	for (int k = 0; k < initial;) {
+		int i = static_cast<int>(rng() % count);
+		if (!on[i]) { toggle(i, true); k++; }
+	}
+	for (int iteration = 0; iteration < count; iteration++) {
+		int cluster = tightest_cluster();
+		toggle(cluster, false);
+		int empty = largest_void();
+		toggle(empty, true);
+		if (empty == cluster) break;
+	}
+
+	auto prototype = on;
+	auto prototype_energy = energy;
+
+	// Ranks below the initial count: remove clusters one by one.
+	for (int rank = initial - 1; rank >= 0; rank--) {
+		int cluster = tightest_cluster();
+		toggle(cluster, false);
+		ranks[cluster] = rank;
+	}
+
+	// Ranks above it: fill voids until the mask is full.
+	on = prototype;
+	energy = prototype_energy;
+	for (int rank = initial; rank < count; rank++) {
+		int empty = largest_void();
+		toggle(empty, true);
+		ranks[empty] = rank;
+	}
+}
+
+// Every pixel gets the same rank-1 lattice (a Fibonacci-like lattice with
+// generator (1, a), a ~ N / golden ratio), shifted per pixel by a blue noise
+// mask so the error left between neighbouring pixels is blue noise as well.
+// Dimensions use different index permutations and mask offsets.
+class rank1_sampler : public sampler {
+public:
+	rank1_sampler(int samples_per_pixel, uint32_t seed = 0)
+		: sampler(samples_per_pixel, seed), mask(blue_noise_mask::get()) {
+		type = sampler_kind::rank1;
+
+		uint32_t count = samples_per_pixel;
+		generator = std::max(1u, static_cast<uint32_t>(count * 0.6180339887498949 + 0.5));
+		while (generator > 1 && std::gcd(generator, count) != 1) generator--;
+	}
+
+	virtual double get_1d() override {
+		uint32_t count = samples_per_pixel;
+		auto dim_seed = hash_combine(seed, dimension++);
+		auto k = cmj_permute(sample_index % count, count, dim_seed);
+		return wrap(static_cast<double>(k) / count + shift(dim_seed, 0));
+	}
+
+	virtual void get_2d(double& u, double& v) override {
+		uint32_t count = samples_per_pixel;
+		auto dim_seed = hash_combine(seed, dimension++);
+		auto k = cmj_permute(sample_index % count, count, dim_seed);
+		u = wrap(static_cast<double>(k) / count + shift(dim_seed, 0));
+		v = wrap(static_cast<double>(uint64_t(k) * generator % count) / count + shift(dim_seed, 1));
+	}
+
+private:
+	double shift(uint32_t dim_seed, uint32_t channel) const {
+		auto h = hash_combine(dim_seed, channel);
+		return mask.value(pixel_x + static_cast<int>(h & 63), pixel_y + static_cast<int>((h >> 6) & 63));
+	}
+
+	static double wrap(double x) {
+		return std::min(x - floor(x), one_minus_epsilon);
+	}
+
+	const blue_noise_mask& mask;
+	uint32_t generator;
+};
+
+inline std::unique_ptr<sampler> make_sampler(sampler_kind kind, int samples_per_pixel, uint32_t seed = 0) {
+	switch (kind) {
+	case sampler_kind::sobol:
+		return std::make_unique<sobol_sampler>(samples_per_pixel, seed);
+	case sampler_kind::cmj:
+		return std::make_unique<cmj_sampler>(samples_per_pixel, seed);
+	case sampler_kind::rank1:
+		return std::make_unique<rank1_sampler>(samples_per_pixel, seed);
+	default:
+		return std::make_unique<independent_sampler>(samples_per_pixel, seed);
+	}
+}
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef SCENE_FEATURES_H
+#define SCENE_FEATURES_H
+
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "dispatch.h"
+#include "global_medium.h"
+#include "material.h"
+#include "texture.h"
+
+// What a scene uses, found once it is built. The path tracer's kernels are
+// instantiated for every combination (see select_trace_kernel in main.cpp),
+// so the work of whatever is off is compiled out of the hot loop. The
+// default has everything on and renders any scene.
+struct scene_features {
+	bool motion_blur = true;        // things move while the shutter is open
+	bool depth_of_field = true;     // the lens has an aperture
+	bool media = true;              // a global medium fills the scene
+	bool emitters = true;           // some surface or medium emits light
+	bool filtered_textures = true;  // some texture lookup uses the ray cone
+
+	static constexpr int count = 5;
+
+	static constexpr scene_features from_bits(unsigned bits) {
+		return { (bits & 1) != 0, (bits & 2) != 0, (bits & 4) != 0, (bits & 8) != 0, (bits & 16) != 0 };
+	}
+	constexpr unsigned bits() const {
+		return unsigned(motion_blur) | unsigned(depth_of_field) << 1 | unsigned(media) << 2
+			| unsigned(emitters) << 3 | unsigned(filtered_textures) << 4;
+	}
+
+	std::string describe() const;
+};
+
+// Whether pred holds for h or anything below it.
+template <typename Pred>
+bool any_hittable(const hittable& h, Pred pred) {
+	if (pred(h))
+		return true;
+
+	switch (h.kind) {
+	case hittable_kind::hittable_list:
+		for (const auto& object : static_cast<const hittable_list&>(h).objects) {
+			if (any_hittable(*object, pred)) return true;
+		}
+		return false;
+	case hittable_kind::bvh_node: {
+		const auto& node = static_cast<const bvh_node&>(h);
+		return any_hittable(*node.left, pred) || (node.right != node.left && any_hittable(*node.right, pred));
+	}
+	case hittable_kind::box:
+		return any_hittable(static_cast<const box&>(h).sides, pred);
+	case hittable_kind::translate:
+		return any_hittable(*static_cast<const translate&>(h).ptr, pred);
+	case hittable_kind::rotate_y:
+		return any_hittable(*static_cast<const rotate_y&>(h).ptr, pred);
+	case hittable_kind::constant_medium:
+		return any_hittable(*static_cast<const constant_medium&>(h).boundary, pred);
+	case hittable_kind::grid_medium: {
+		// The boundary is optional.
+		const auto& boundary = static_cast<const grid_medium&>(h).boundary;
+		return boundary && any_hittable(*boundary, pred);
+	}
+	default:
+		return false;
+	}
+}
+
+// Whether anything below h moves with time. Custom hittables might.
+inline bool has_motion(const hittable& h) {
+	return any_hittable(h, [](const hittable& o) {
+		return o.kind == hittable_kind::moving_sphere || o.kind == hittable_kind::custom;
+	});
+}
+
+// Whether h holds a primitive whose material collect_materials can't see:
+// custom hittables, and built-in primitives without a surface material.
+inline bool has_hidden_materials(const hittable& h) {
+	return any_hittable(h, [](const hittable& o) {
+		switch (o.kind) {
+		case hittable_kind::custom:
+			return true;
+		case hittable_kind::sphere:
+		case hittable_kind::moving_sphere:
+		case hittable_kind::xy_rect:
+		case hittable_kind::xz_rect:
+		case hittable_kind::yz_rect:
+			return o.surface_material() == nullptr;
+		default:
+			return false;
+		}
+	});
+}
+
+// Features of world seen through cam. Custom materials, and primitives whose
+// material can't be found, count as emitting and filtering, since there is
+// no telling what they do.
+scene_features analyze_scene(const hittable& world, const camera& cam, const global_medium& medium) {
+	scene_features f;
+	f.motion_blur = cam.time1 != cam.time0 && has_motion(world);
+	f.depth_of_field = cam.lens_radius != 0;
+	f.media = medium.active();
+	f.emitters = f.filtered_textures = has_hidden_materials(world);
+
+	std::vector<material*> materials;
+	collect_materials(world, materials);
+	for (auto m : materials) {
+		if (m->kind == material_kind::custom) {
+			f.emitters = f.filtered_textures = true;
+			continue;
+		}
+		if (m->is_emissive())
+			f.emitters = true;
+
+		// Only image and program textures read the footprint, and only
+		// where a material looks them up directly.
+		auto slot = material_texture(*m);
+		if (slot && *slot && ((*slot)->kind == texture_kind::image || (*slot)->kind == texture_kind::program))
+			f.filtered_textures = true;
+	}
+	return f;
+}
+
+std::string scene_features::describe() const {
+	std::string s;
+	auto add = [&](bool on, const char* name) {
+		if (!s.empty()) s += ", ";
+		s += std::string(name) + (on ? " on" : " off");
+	};
+	add(motion_blur, "motion blur");
+	add(depth_of_field, "depth of field");
+	add(media, "global medium");
+	add(emitters, "emitters");
+	add(filtered_textures, "filtered textures");
+	return s;
+}
+
+#endif
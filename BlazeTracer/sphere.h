@@ -2,21 +2,27 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "onb.h"
 
-class sphere : public hittable {
+class sphere final : public hittable {
 public:
 	point3 center;
-	double radius;
+	real radius;
 	shared_ptr<material> mat_ptr;
 public:
 
-	sphere() : radius(0.1) {}
-	sphere(point3 cen, double r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {}
+	sphere() : hittable(hittable_kind::sphere), radius(0.1) {}
+	sphere(point3 cen, real r, shared_ptr<material> m)
+		: hittable(hittable_kind::sphere), center(cen), radius(r), mat_ptr(m) {}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
 
-	static void get_sphere_uv(const point3& p, double& u, double& v) {
+	virtual const material* surface_material() const override { return mat_ptr.get(); }
+	virtual real pdf_value(const point3& o, const vec3& v) const override;
+	virtual vec3 random(const point3& o) const override;
+
+	static void get_sphere_uv(const point3& p, real& u, real& v) {
 		// p: a given point on the sphere of radius one, centered at the origin.
 		// u: returned value [0,1] of angle around the Y axis from X=-1.
 		// v: returned value [0,1] of angle from Y=-1 to Y=+1.
@@ -32,7 +38,7 @@ public:
 	}
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	vec3 oc = r.origin() - center;
 	auto a = r.direction().length_squared();
 	auto half_b = dot(oc, r.direction());
@@ -56,12 +62,13 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
 	vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(r, outward_normal);
 	get_sphere_uv(outward_normal, rec.u, rec.v);
-	rec.mat_ptr = mat_ptr;
+	rec.mat_ptr = mat_ptr.get();
+	rec.obj = this;
 
 	return true;
 }
 
-bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
+bool sphere::bounding_box(real time0, real time1, aabb& output_box) const {
 	output_box = aabb(
 		center - vec3(radius, radius, radius),
 		center + vec3(radius, radius, radius)
@@ -70,4 +77,31 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
 	return true;
 }
 
+real sphere::pdf_value(const point3& o, const vec3& v) const {
+	hit_record rec;
+	if (!this->hit(ray(o, v), 0.001, infinity, rec))
+		return 0;
+
+	// Points inside the sphere see all of it, there is no cone to sample.
+	auto distance_squared = (center - o).length_squared();
+	if (distance_squared <= radius * radius)
+		return 0;
+
+	auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+	auto solid_angle = 2 * pi * (1 - cos_theta_max);
+
+	return 1 / solid_angle;
+}
+
+vec3 sphere::random(const point3& o) const {
+	vec3 direction = center - o;
+	auto distance_squared = direction.length_squared();
+	if (distance_squared <= radius * radius)
+		return direction;
+
+	onb uvw;
+	uvw.build_from_w(direction);
+	return uvw.local(random_to_sphere(radius, distance_squared));
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,552 @@
+#ifndef SPPM_H
+#define SPPM_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "denoiser.h"
+#include "dispatch.h"
+#include "lights.h"
+#include "material.h"
+#include "sampler.h"
+#include "thread_pool.h"
+
+struct sppm_settings {
+	int photons_per_pass = 250000;
+	// Photons of a pass that don't fit are traced in further batches, each
+	// gathered before the next replaces it.
+	size_t photon_budget_mb = 256;
+	// Gather radius where a pixel first sees a diffuse surface, in pixel
+	// footprints there. Shrinks with every pass by alpha.
+	real initial_radius_pixels = 3;
+	real alpha = real(2.0 / 3.0);
+	int max_depth = 16;
+};
+
+// 36 bytes; stored in single precision so big passes stay small.
+struct photon {
+	float p[3];
+	float wi[3];     // towards where it came from
+	float power[3];
+
+	point3 position() const { return point3(p[0], p[1], p[2]); }
+	vec3 direction() const { return vec3(wi[0], wi[1], wi[2]); }
+	color flux() const { return color(power[0], power[1], power[2]); }
+};
+
+// Photons hashed into a uniform grid and counting-sorted by bucket, so the
+// photons of a cell lie next to each other. Counting and scattering run on
+// the pool with atomic bucket counters.
+class photon_grid {
+public:
+	// Takes the photons out of chunks. Cells must be at least a gather
+	// diameter wide.
+	void build(std::vector<std::vector<photon>>& chunks, real cell_size, thread_pool& pool);
+
+	// Calls visit(photon) for every photon within radius of p.
+	template <typename F>
+	void gather(const point3& p, real radius, F&& visit) const;
+
+	size_t size() const { return photons.size(); }
+
+	// Peak memory per photon while building: the unsorted and sorted copies
+	// and up to two bucket counters.
+	static constexpr size_t bytes_per_photon() { return 2 * sizeof(photon) + 4 * sizeof(uint32_t); }
+
+private:
+	uint32_t bucket(int x, int y, int z) const {
+		return ((uint32_t(x) * 73856093u) ^ (uint32_t(y) * 19349663u) ^ (uint32_t(z) * 83492791u)) & mask;
+	}
+	uint32_t bucket(const point3& p) const {
+		return bucket(cell(p.x()), cell(p.y()), cell(p.z()));
+	}
+	int cell(real x) const { return static_cast<int>(floor(x * inv_cell_size)); }
+
+	std::vector<photon> photons;
+	std::vector<uint32_t> start;  // buckets + 1 entries
+	real inv_cell_size = 1;
+	uint32_t mask = 0;
+};
+
+void photon_grid::build(std::vector<std::vector<photon>>& chunks, real cell_size, thread_pool& pool) {
+	size_t total = 0;
+	for (const auto& c : chunks) total += c.size();
+
+	uint32_t buckets = 1;
+	while (buckets < total) buckets <<= 1;
+	mask = buckets - 1;
+	inv_cell_size = 1 / cell_size;
+
+	start.assign(size_t(buckets) + 1, 0);
+	for (auto& c : chunks) {
+		pool.submit([&] {
+			for (const auto& ph : c) {
+				std::atomic_ref<uint32_t>(start[bucket(ph.position()) + 1]).fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+	}
+	pool.wait_idle();
+
+	for (uint32_t b = 0; b < buckets; b++) {
+		start[b + 1] += start[b];
+	}
+
+	photons.clear();
+	photons.shrink_to_fit();
+	photons.resize(total);
+	std::vector<uint32_t> cursor(start.begin(), start.end() - 1);
+	for (auto& c : chunks) {
+		pool.submit([&] {
+			for (const auto& ph : c) {
+				auto i = std::atomic_ref<uint32_t>(cursor[bucket(ph.position())]).fetch_add(1, std::memory_order_relaxed);
+				photons[i] = ph;
+			}
+			c.clear();
+			c.shrink_to_fit();
+		});
+	}
+	pool.wait_idle();
+}
+
+template <typename F>
+void photon_grid::gather(const point3& p, real radius, F&& visit) const {
+	if (photons.empty())
+		return;
+
+	auto radius_squared = radius * radius;
+	int lo[3], hi[3];
+	for (int a = 0; a < 3; a++) {
+		lo[a] = cell(p[a] - radius);
+		hi[a] = cell(p[a] + radius);
+	}
+
+	// Cells sharing a bucket are visited once each; the distance test
+	// drops the photons of other cells.
+	uint32_t seen[8];
+	int seen_count = 0;
+	for (int z = lo[2]; z <= hi[2]; z++) {
+		for (int y = lo[1]; y <= hi[1]; y++) {
+			for (int x = lo[0]; x <= hi[0]; x++) {
+				auto b = bucket(x, y, z);
+				bool repeated = false;
+				for (int i = 0; i < seen_count; i++) repeated |= seen[i] == b;
+				if (repeated) continue;
+				if (seen_count < 8) seen[seen_count++] = b;
+
+				for (auto i = start[b]; i < start[b + 1]; i++) {
+					const auto& ph = photons[i];
+					if ((ph.position() - p).length_squared() <= radius_squared)
+						visit(ph);
+				}
+			}
+		}
+	}
+}
+
+// Stochastic progressive photon mapping (Hachisuka and Jensen, as in pbrt's
+// SPPM). Every pass traces one camera path per pixel through specular
+// bounces and media to the first diffuse surface, the pixel's visible point,
+// where direct light is sampled as usual. Then photons from the lights are
+// traced, stored in a photon_grid and gathered at the visible points, and
+// each pixel's gather radius shrinks. Caustics seen through glass, which
+// neither path nor light subpaths can hit on purpose, converge this way.
+//
+// Photons start on the spheres and rects of the light list and in the
+// environment, which spreads them over the whole scene. Photons are not
+// gathered in media; camera paths are traced on through them instead. The
+// global medium is not supported.
+class sppm_integrator {
+public:
+	sppm_integrator(const hittable& world, const scene_lights& lights, const camera& cam, const color& background,
+		int image_width, int image_height, sampler_kind sampler_type, const sppm_settings& settings);
+
+	// Renders passes passes into colors and features as sums over the
+	// passes, like thread_trace's sums over samples.
+	void render(int passes, int thread_count, std::vector<std::vector<color>>& colors, feature_buffers& features);
+
+	int sampled_light_count() const { return emitters.count(); }
+
+private:
+	struct pixel {
+		// Progressive state.
+		color direct;      // sum over passes
+		color tau;         // flux gathered so far, scaled to the current radius
+		real radius = 0;
+		real photon_count = 0;
+
+		// This pass's visible point.
+		bool valid = false;
+		hit_record rec;
+		ray in;
+		color beta;
+		color pass_direct;
+
+		color phi;
+		real m = 0;
+	};
+
+	void trace_camera(int x, int y, int pass, sampler& s, pixel& px, pixel_features& first) const;
+	bool start_photon(real time, ray& r, color& beta) const;
+	void trace_photons(int pass, int chunk, int count, std::vector<photon>& out) const;
+	color direct_light(const ray& r, const hit_record& rec) const;
+	void gather(const photon_grid& grid, pixel& px) const;
+
+	const hittable& world;
+	const scene_lights& lights;
+	camera cam;
+	color background;
+	int width, height;
+	sampler_kind sampler_type;
+	sppm_settings settings;
+	emitter_distribution emitters;
+	real environment_probability;
+	point3 scene_center;
+	real scene_radius;
+	ray_cone cone;
+
+	std::vector<pixel> pixels;  // row j at j * width
+};
+
+sppm_integrator::sppm_integrator(const hittable& world, const scene_lights& lights, const camera& cam,
+	const color& background, int image_width, int image_height, sampler_kind sampler_type, const sppm_settings& settings)
+	: world(world), lights(lights), cam(cam), background(background), width(image_width), height(image_height),
+	sampler_type(sampler_type), settings(settings), emitters(lights.bvh.lights), cone(cam.pixel_cone(image_height)),
+	pixels(size_t(image_width) * image_height) {
+	if (!lights.environment)
+		environment_probability = 0;
+	else
+		environment_probability = emitters.empty() ? 1 : lights.environment_probability();
+
+	aabb box;
+	if (world.bounding_box(cam.time0, cam.time1, box)) {
+		scene_center = (box.min() + box.max()) / 2;
+		scene_radius = (box.max() - scene_center).length();
+	}
+	else {
+		scene_center = point3(0, 0, 0);
+		scene_radius = 0;
+	}
+}
+
+// Direct light at a diffuse vertex: a light sample and a BSDF sample,
+// combined like the path tracer's next-event estimation and emitter hits.
+color sppm_integrator::direct_light(const ray& r, const hit_record& rec) const {
+	color L(0, 0, 0);
+	if (!lights.empty())
+		L += sample_direct_light(world, lights, r, rec);
+
+	bsdf_sample s;
+	if (!sample_dispatch(*rec.mat_ptr, r, rec, s) || s.is_specular)
+		return L;
+
+	ray bounce = s.scattered;
+	bounce.type = diffuse_ray;
+	hit_record hit;
+	if (!hit_dispatch(world, bounce, 0.001, infinity, hit)) {
+		if (!lights.environment)
+			return L + s.weight * background;
+
+		auto sky = lights.environment->radiance(bounce.direction());
+		return L + s.weight * sky * power_heuristic(s.pdf, environment_pdf(lights, bounce.direction()));
+	}
+
+	auto emitted = emitted_dispatch(*hit.mat_ptr, hit.u, hit.v, hit.p);
+	if (hit.obj && hit.obj->light_index >= 0)
+		emitted *= power_heuristic(s.pdf, light_pdf(lights, *hit.obj, rec, bounce.direction()));
+	return L + s.weight * emitted;
+}
+
+void sppm_integrator::trace_camera(int x, int y, int pass, sampler& smp, pixel& px, pixel_features& first) const {
+	smp.start_pixel_sample(x, y, pass);
+	double film_u, film_v, lens_u, lens_v;
+	smp.get_2d(film_u, film_v);
+	smp.get_2d(lens_u, lens_v);
+	auto time_u = smp.get_1d();
+
+	ray r = cam.get_ray(double(x + film_u) / (width - 1), double(y + film_v) / (height - 1), lens_u, lens_v, time_u);
+	color beta(1, 1, 1);
+	color direct(0, 0, 0);
+	real distance = 0;
+	bool count_emitted = true;  // camera rays and specular bounces see lights directly
+	px.valid = false;
+	first.albedo = color(0, 0, 0);
+	first.normal = vec3(0, 0, 0);
+
+	for (int depth = 0; depth < settings.max_depth; depth++) {
+		hit_record rec;
+		if (!hit_dispatch(world, r, 0.001, infinity, rec)) {
+			auto sky = lights.environment ? lights.environment->radiance(r.direction()) : background;
+			if (depth == 0)
+				first.albedo = color(fmin(sky.x(), 1.0), fmin(sky.y(), 1.0), fmin(sky.z(), 1.0));
+			if (count_emitted)
+				direct += beta * sky;
+			break;
+		}
+
+		if (depth == 0) {
+			first.albedo = albedo_dispatch(*rec.mat_ptr, rec);
+			first.normal = rec.normal;
+		}
+		if (count_emitted)
+			direct += beta * emitted_dispatch(*rec.mat_ptr, rec.u, rec.v, rec.p);
+		distance += rec.t * r.direction().length();
+
+		const auto& mat = *rec.mat_ptr;
+		bool in_medium = mat.kind == material_kind::isotropic;
+		if (!in_medium && !is_specular_dispatch(mat)) {
+			direct += beta * direct_light(r, rec);
+			px.valid = true;
+			px.rec = rec;
+			px.in = r;
+			px.beta = beta;
+			if (px.radius == 0)
+				px.radius = fmax(settings.initial_radius_pixels * cone.width_at(distance), real(1e-4));
+			break;
+		}
+
+		bsdf_sample s;
+		if (!sample_dispatch(mat, r, rec, s))
+			break;
+		if (in_medium)
+			direct += beta * direct_light(r, rec);
+
+		beta = beta * s.weight;
+		if (beta.near_zero())
+			break;
+		count_emitted = s.is_specular;
+		r = s.scattered;
+		r.type = s.is_specular ? specular_ray : diffuse_ray;
+	}
+
+	px.pass_direct = direct;
+	px.direct += direct;
+}
+
+// A photon leaving an emitter, or coming in from the environment through a
+// disk across the scene's bounding sphere, with its flux.
+bool sppm_integrator::start_photon(real time, ray& r, color& beta) const {
+	if (random_double() < environment_probability) {
+		real pdf_dir;
+		auto to_environment = lights.environment->sample(pdf_dir);
+		auto le = lights.environment->radiance(to_environment);
+		if (pdf_dir <= 0 || le.near_zero())
+			return false;
+
+		onb uvw;
+		uvw.build_from_w(to_environment);
+		auto disk_radius = sqrt(random_double()) * scene_radius;
+		auto phi = 2 * pi * random_double();
+		auto origin = scene_center + scene_radius * to_environment
+			+ disk_radius * (cos(phi) * uvw.u() + sin(phi) * uvw.v());
+		r = ray(origin, -to_environment, time, diffuse_ray);
+		beta = le * (pi * scene_radius * scene_radius) / (environment_probability * pdf_dir);
+		return true;
+	}
+
+	real pmf;
+	auto light = emitters.pick(random_double(), pmf);
+	hit_record start;
+	if (!light || !emitters.sample_point(*light, start))
+		return false;
+
+	real pdf_dir;
+	auto direction = emitters.sample_direction(*light, start.normal, pdf_dir);
+	auto le = emitted_dispatch(*start.mat_ptr, start.u, start.v, start.p);
+	auto area_pdf = emitters.origin_pdf(*light);
+	if (pdf_dir <= 0 || area_pdf <= 0 || le.near_zero())
+		return false;
+
+	r = ray(offset_ray_origin(start.p, start.normal, direction), direction, time, diffuse_ray);
+	beta = le * fabs(dot(start.normal, direction)) / ((1 - environment_probability) * area_pdf * pdf_dir);
+	return true;
+}
+
+// Photons of one chunk, from its own random stream so batching doesn't
+// change them. Only photons that bounced at least once are stored; direct
+// light at the visible points is sampled instead.
+void sppm_integrator::trace_photons(int pass, int chunk, int count, std::vector<photon>& out) const {
+	auto smp = make_sampler(sampler_kind::independent, 1, 0x9e3779b9u);
+	active_sample_source = smp.get();
+
+	for (int n = 0; n < count; n++) {
+		smp->start_pixel_sample(chunk, pass, n);
+
+		ray r;
+		color beta;
+		auto time = cam.time0 + (cam.time1 - cam.time0) * random_double();
+		if (!start_photon(time, r, beta))
+			continue;
+
+		for (int depth = 0; depth < settings.max_depth; depth++) {
+			hit_record rec;
+			if (!hit_dispatch(world, r, 0.001, infinity, rec))
+				break;
+
+			const auto& mat = *rec.mat_ptr;
+			if (depth > 0 && mat.kind != material_kind::isotropic && !is_specular_dispatch(mat)) {
+				auto wi = -unit_vector(r.direction());
+				out.push_back({
+					{ float(rec.p.x()), float(rec.p.y()), float(rec.p.z()) },
+					{ float(wi.x()), float(wi.y()), float(wi.z()) },
+					{ float(beta.x()), float(beta.y()), float(beta.z()) } });
+			}
+
+			bsdf_sample s;
+			if (!sample_dispatch(mat, r, rec, s))
+				break;
+
+			// Russian roulette on the throughput lost in this bounce.
+			auto next = beta * s.weight;
+			auto before = luminance(beta);
+			auto survive = before > 0 ? fmin(real(1), luminance(next) / before) : 0;
+			if (survive <= 0 || random_double() >= survive)
+				break;
+
+			beta = next / survive;
+			r = s.scattered;
+			r.type = s.is_specular ? specular_ray : diffuse_ray;
+		}
+	}
+
+	active_sample_source = nullptr;
+}
+
+void sppm_integrator::gather(const photon_grid& grid, pixel& px) const {
+	if (!px.valid)
+		return;
+
+	const auto& rec = px.rec;
+	grid.gather(rec.p, px.radius, [&](const photon& ph) {
+		auto wi = ph.direction();
+		auto cos_theta = fabs(dot(rec.normal, wi));
+		if (cos_theta <= 0)
+			return;
+
+		auto f = eval_dispatch(*rec.mat_ptr, px.in, rec, wi) / cos_theta;
+		px.phi += f * ph.flux();
+		px.m += 1;
+	});
+}
+
+void sppm_integrator::render(int passes, int thread_count, std::vector<std::vector<color>>& colors, feature_buffers& features) {
+	thread_pool pool(thread_count);
+	const int chunk_size = 4096;
+	const int chunk_count = (settings.photons_per_pass + chunk_size - 1) / chunk_size;
+	const int rows_per_job = 4;
+
+	// Stop claiming chunks once the stored photons come within what every
+	// thread could still add with one more chunk.
+	auto capacity = settings.photon_budget_mb * 1024 * 1024 / photon_grid::bytes_per_photon();
+	auto slack = size_t(pool.size()) * chunk_size * settings.max_depth;
+	auto soft_capacity = capacity > slack ? capacity - slack : size_t(1);
+
+	photon_grid grid;
+	std::vector<std::vector<photon>> chunks(chunk_count);
+	int max_batches = 0;
+	size_t max_stored = 0;
+
+	for (int pass = 0; pass < passes; pass++) {
+		// Visible points.
+		for (int y0 = 0; y0 < height; y0 += rows_per_job) {
+			pool.submit([&, y0, pass] {
+				auto smp = make_sampler(sampler_type, passes, 0);
+				active_sample_source = smp.get();
+				for (int y = y0; y < std::min(y0 + rows_per_job, height); y++) {
+					for (int x = 0; x < width; x++) {
+						pixel_features first;
+						trace_camera(x, y, pass, *smp, pixels[size_t(y) * width + x], first);
+						features.albedo[y][x] += first.albedo;
+						features.normal[y][x] += first.normal;
+					}
+				}
+				active_sample_source = nullptr;
+			});
+		}
+		pool.wait_idle();
+
+		real max_radius = 0;
+		for (const auto& px : pixels) {
+			if (px.valid) max_radius = fmax(max_radius, px.radius);
+		}
+
+		// Photons, in as many batches as the budget needs.
+		std::atomic<int> next_chunk = 0;
+		int batches = 0;
+		while (next_chunk < chunk_count && max_radius > 0) {
+			int first_chunk = next_chunk;
+			std::atomic<size_t> stored = 0;
+			for (int t = 0; t < pool.size(); t++) {
+				pool.submit([&, pass] {
+					while (stored < soft_capacity) {
+						int c = next_chunk++;
+						if (c >= chunk_count)
+							break;
+						auto count = std::min(chunk_size, settings.photons_per_pass - c * chunk_size);
+						trace_photons(pass, c, count, chunks[c]);
+						stored += chunks[c].size();
+					}
+				});
+			}
+			pool.wait_idle();
+
+			max_stored = std::max(max_stored, stored.load());
+			std::vector<std::vector<photon>> batch;
+			for (int c = first_chunk; c < std::min<int>(next_chunk, chunk_count); c++) {
+				batch.push_back(std::move(chunks[c]));
+			}
+			grid.build(batch, 2 * max_radius, pool);
+
+			for (int y0 = 0; y0 < height; y0 += rows_per_job) {
+				pool.submit([&, y0] {
+					for (size_t i = size_t(y0) * width; i < size_t(std::min(y0 + rows_per_job, height)) * width; i++) {
+						gather(grid, pixels[i]);
+					}
+				});
+			}
+			pool.wait_idle();
+			batches++;
+		}
+		max_batches = std::max(max_batches, batches);
+
+		// Shrink the radii where photons arrived, keeping alpha of them.
+		auto photons_so_far = real(pass + 1) * settings.photons_per_pass;
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				auto& px = pixels[size_t(y) * width + x];
+				if (px.m > 0) {
+					auto n = px.photon_count + settings.alpha * px.m;
+					auto radius = px.radius * sqrt(n / (px.photon_count + px.m));
+					px.tau = (px.tau + px.beta * px.phi) * ((radius * radius) / (px.radius * px.radius));
+					px.photon_count = n;
+					px.radius = radius;
+				}
+				px.phi = color(0, 0, 0);
+				px.m = 0;
+
+				auto indirect = px.radius > 0 ? px.tau / (photons_so_far * pi * px.radius * px.radius) : color(0, 0, 0);
+				auto l = luminance(px.pass_direct + indirect);
+				features.luminance_squared[y][x] += l * l;
+			}
+		}
+	}
+
+	// Sums over passes, like the path tracer's over samples.
+	auto photons = real(passes) * settings.photons_per_pass;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			const auto& px = pixels[size_t(y) * width + x];
+			auto indirect = px.radius > 0 ? px.tau / (photons * pi * px.radius * px.radius) : color(0, 0, 0);
+			colors[y][x] = px.direct + passes * indirect;
+		}
+	}
+
+	LOG(LOG_TYPE::INFO, "Photon mapping: " + std::to_string(passes) + " passes of "
+		+ std::to_string(settings.photons_per_pass) + " photons, up to " + std::to_string(max_stored)
+		+ " stored in " + std::to_string(max_batches) + " batches per pass");
+}
+
+#endif
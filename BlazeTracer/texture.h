@@ -4,72 +4,97 @@
 #include <iostream>
 
 #include "rtweekend.h"
-#include "rtw_stb_image.h"
+#include "aabb.h"
+#include "arena.h"
 #include "perlin.h"
+#include "texture_cache.h"
 
 
 
+// Type tag for the built-in textures, see hittable_kind.
+enum class texture_kind : unsigned char {
+	custom,
+	solid_color,
+	checker,
+	noise,
+	image,
+	baked,
+	program
+};
+
 class texture {
 public:
-	virtual color value(double u, double v, const point3& p) const = 0;
+	texture_kind kind;
+public:
+	texture(texture_kind k = texture_kind::custom) : kind(k) {}
+
+	virtual color value(real u, real v, const point3& p) const = 0;
 };
 
-class solid_color : public texture {
+// Defined at the bottom of this file once every built-in texture is known.
+inline color texture_value(const texture& t, real u, real v, const point3& p);
+
+class solid_color final : public texture {
 private:
 	color color_value;
 public:
-	solid_color() {}
-	solid_color(color c) : color_value(c) {}
+	solid_color() : texture(texture_kind::solid_color) {}
+	solid_color(color c) : texture(texture_kind::solid_color), color_value(c) {}
 
-	solid_color(double red, double green, double blue) 
+	solid_color(real red, real green, real blue) 
 		: solid_color(color(red, green, blue)) {}
 
-	virtual color value(double u, double v, const point3& p) const override {
+	virtual color value(real u, real v, const point3& p) const override {
 		return color_value;
 	}
 };
 
 
-class checker_texture : public texture {
+class checker_texture final : public texture {
 public:
 	shared_ptr<texture> odd;
 	shared_ptr<texture> even;
 public:
-	checker_texture() {}
+	checker_texture() : texture(texture_kind::checker) {}
 	checker_texture(shared_ptr<texture> _even, shared_ptr<texture> _odd)
-		: odd(_odd), even(_even) {}
+		: texture(texture_kind::checker), odd(_odd), even(_even) {}
 
-	checker_texture(color a, color b)
-		: odd(make_shared<solid_color>(a)), even(make_shared<solid_color>(b))
+	checker_texture(color a, color b, scene_arena* arena = nullptr)
+		: texture(texture_kind::checker), odd(arena_make<solid_color>(arena, a)), even(arena_make<solid_color>(arena, b))
 	{}
 
-	virtual color value(double u, double v, const point3& p) const override {
-		auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+	// Negative where the odd texture shows.
+	static real pattern(const point3& p) {
+		return sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+	}
+
+	virtual color value(real u, real v, const point3& p) const override {
+		auto sines = pattern(p);
 
 		if (sines < 0) {
-			return odd->value(u, v, p);
+			return texture_value(*odd, u, v, p);
 		}
 		else {
-			return even->value(u, v, p);
+			return texture_value(*even, u, v, p);
 		}
 	}
 };
 
 
-class noise_texture : public texture {
+class noise_texture final : public texture {
 public:
 	perlin noise;
-	double scale;
+	real scale;
 	color col;
 public:
-	noise_texture() : scale(1), col(color(1,1,1)) {}
-	noise_texture(double sc) : scale(sc), col(color(1, 1, 1)) {}
+	noise_texture() : texture(texture_kind::noise), scale(1), col(color(1,1,1)) {}
+	noise_texture(real sc) : texture(texture_kind::noise), scale(sc), col(color(1, 1, 1)) {}
 
 	void setColor(color c) {
 		col = c;
 	}
 
-	virtual color value(double u, double v, const point3& p) const override {
+	virtual color value(real u, real v, const point3& p) const override {
 		//return color(1, 1, 1) * 0.5 * (1.0 + noise.noise(scale * p));
 		//return color(1, 1, 1) * noise.turb(scale * p);
 		return col * 0.5 * (1 + sin(scale * p.z() + 10 * noise.turb(p)));
@@ -81,58 +106,208 @@ public:
 
 
 
-class image_texture : public texture {
+// A procedural texture sampled on a voxel grid over a box and looked up
+// trilinearly. Only valid for textures that depend on the hit point alone;
+// points outside the box evaluate the source texture. Built by
+// texture_bake.h.
+class baked_texture final : public texture {
+public:
+	shared_ptr<texture> source;
+	int nx = 0, ny = 0, nz = 0;
+	aabb bounds;
+	std::vector<float> texels;  // RGB, x fastest
 public:
-    const static int bytes_per_pixel = 3;
+	baked_texture() : texture(texture_kind::baked) {}
 
-    image_texture()
-        : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
+	virtual color value(real u, real v, const point3& p) const override;
 
-    image_texture(const char* filename) {
-        auto components_per_pixel = bytes_per_pixel;
-		stbi_set_flip_vertically_on_load(true);
-        data = stbi_load(
-            filename, &width, &height, &components_per_pixel, components_per_pixel);
+	color voxel(int x, int y, int z) const {
+		auto t = &texels[3 * ((size_t(z) * ny + y) * nx + x)];
+		return color(t[0], t[1], t[2]);
+	}
+};
 
-        if (!data) {
-            std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
-            width = height = 0;
-        }
+color baked_texture::value(real u, real v, const point3& p) const {
+	real g[3];
+	int i0[3], i1[3];
+	real f[3];
+	int n[3] = { nx, ny, nz };
+	for (int a = 0; a < 3; a++) {
+		if (p[a] < bounds.min()[a] || p[a] > bounds.max()[a])
+			return texture_value(*source, u, v, p);
+
+		auto extent = bounds.max()[a] - bounds.min()[a];
+		// Voxel centers sit at half-integer grid coordinates.
+		g[a] = extent > 0 ? (p[a] - bounds.min()[a]) / extent * n[a] - real(0.5) : 0;
+		g[a] = clamp(g[a], 0.0, n[a] - 1.0);
+		i0[a] = static_cast<int>(g[a]);
+		i1[a] = std::min(i0[a] + 1, n[a] - 1);
+		f[a] = g[a] - i0[a];
+	}
 
-        bytes_per_scanline = bytes_per_pixel * width;
-    }
+	auto lerp_x = [&](int y, int z) {
+		return (1 - f[0]) * voxel(i0[0], y, z) + f[0] * voxel(i1[0], y, z);
+	};
+	auto lerp_y = [&](int z) {
+		return (1 - f[1]) * lerp_x(i0[1], z) + f[1] * lerp_x(i1[1], z);
+	};
+	return (1 - f[2]) * lerp_y(i0[2]) + f[2] * lerp_y(i1[2]);
+}
+
+// Reads through the process-wide texture_cache, so only the tiles a render
+// actually touches are in memory. Textures of the same file share one cache
+// entry, and construction only queues the image's load.
+class image_texture final : public texture {
+public:
+    image_texture()
+        : texture(texture_kind::image), id(-1) {}
 
-    ~image_texture() {
-        delete data;
+    image_texture(const char* filename)
+        : texture(texture_kind::image), id(texture_cache::global().add_texture(filename)) {}
+
+    virtual color value(real u, real v, const vec3& p) const override {
+        return value_filtered(u, v, 0, 0);
     }
 
-    virtual color value(double u, double v, const vec3& p) const override {
-        // If we have no texture data, then return solid cyan as a debugging aid.
-        if (data == nullptr)
-            return color(0, 1, 1);
+    // Trilinear lookup for a footprint of (du, dv) in texture coordinates.
+    color value_filtered(real u, real v, real du, real dv) const;
 
-        // Clamp input texture coordinates to [0,1] x [1,0]
-        u = clamp(u, 0.0, 1.0);
-        v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
+private:
+    color bilinear(int level, real u, real v) const;
 
-        auto i = static_cast<int>(u * width);
-        auto j = static_cast<int>(v * height);
+    int id;
+};
 
-        // Clamp integer mapping, since actual coordinates should be less than 1.0
-        if (i >= width)  i = width - 1;
-        if (j >= height) j = height - 1;
+color image_texture::value_filtered(real u, real v, real du, real dv) const {
+    // If we have no texture data, then return solid cyan as a debugging aid.
+    if (id < 0)
+        return color(0, 1, 1);
+
+    const auto& info = texture_cache::global().info(id);
+    if (info.levels.empty())
+        return color(0, 1, 1);
+
+    // Clamp input texture coordinates to [0,1] x [1,0]
+    u = clamp(u, 0.0, 1.0);
+    v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
+
+    auto texels = fmax(du * info.width, dv * info.height);
+    if (texels <= 1)
+        return bilinear(0, u, v);
+
+    auto max_level = static_cast<real>(info.levels.size() - 1);
+    auto level = fmin(log2(texels), max_level);
+    auto lower = static_cast<int>(level);
+    auto t = level - lower;
+    if (t <= 0)
+        return bilinear(lower, u, v);
+
+    return (1 - t) * bilinear(lower, u, v) + t * bilinear(lower + 1, u, v);
+}
+
+color image_texture::bilinear(int level, real u, real v) const {
+    auto& cache = texture_cache::global();
+    const auto& li = cache.info(id).levels[level];
+
+    // Texel centers sit at half-integer coordinates.
+    auto x = u * li.width - 0.5;
+    auto y = v * li.height - 0.5;
+    auto x0 = static_cast<int>(floor(x));
+    auto y0 = static_cast<int>(floor(y));
+    auto fx = x - x0;
+    auto fy = y - y0;
+
+    return (1 - fx) * (1 - fy) * cache.texel(id, level, x0, y0)
+        + fx * (1 - fy) * cache.texel(id, level, x0 + 1, y0)
+        + (1 - fx) * fy * cache.texel(id, level, x0, y0 + 1)
+        + fx * fy * cache.texel(id, level, x0 + 1, y0 + 1);
+}
+
+enum class texture_opcode : unsigned char {
+	constant,          // a
+	checker_constant,  // a where the checker pattern is odd, b elsewhere
+	checker_branch,    // odd: continue at the next op, even: skip ops first
+	noise,
+	image,
+	baked,
+	call               // virtual value() of a custom texture
+};
 
-        const auto color_scale = 1.0 / 255.0;
-        auto pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
+struct texture_op {
+	texture_opcode code;
+	int skip = 0;
+	color a, b;
+	const texture* source = nullptr;
+};
 
-        return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
-    }
+// A texture graph flattened into a linear op stream by texture_program.h.
+// Every path through it ends in exactly one op that produces the color, so
+// evaluation is a loop of jumps with no pointer chasing between nodes.
+class program_texture final : public texture {
+public:
+	std::vector<texture_op> ops;
+	// The graph the ops were compiled from; their sources point into it, so
+	// it lives as long as the program.
+	shared_ptr<texture> source;
+public:
+	program_texture() : texture(texture_kind::program) {}
 
-private:
-    unsigned char* data;
-    int width, height;
-    int bytes_per_scanline;
+	virtual color value(real u, real v, const point3& p) const override {
+		return evaluate(u, v, p, 0, 0);
+	}
+
+	color evaluate(real u, real v, const point3& p, real du, real dv) const;
 };
 
+color program_texture::evaluate(real u, real v, const point3& p, real du, real dv) const {
+	const texture_op* op = ops.data();
+	while (true) {
+		switch (op->code) {
+		case texture_opcode::constant:
+			return op->a;
+		case texture_opcode::checker_constant:
+			return checker_texture::pattern(p) < 0 ? op->a : op->b;
+		case texture_opcode::checker_branch:
+			op += checker_texture::pattern(p) < 0 ? 1 : 1 + op->skip;
+			break;
+		case texture_opcode::noise:
+			return static_cast<const noise_texture*>(op->source)->noise_texture::value(u, v, p);
+		case texture_opcode::image:
+			return static_cast<const image_texture*>(op->source)->value_filtered(u, v, du, dv);
+		case texture_opcode::baked:
+			return static_cast<const baked_texture*>(op->source)->baked_texture::value(u, v, p);
+		default:
+			return op->source->value(u, v, p);
+		}
+	}
+}
+
+inline color texture_value(const texture& t, real u, real v, const point3& p) {
+	switch (t.kind) {
+	case texture_kind::solid_color:
+		return static_cast<const solid_color&>(t).solid_color::value(u, v, p);
+	case texture_kind::checker:
+		return static_cast<const checker_texture&>(t).checker_texture::value(u, v, p);
+	case texture_kind::noise:
+		return static_cast<const noise_texture&>(t).noise_texture::value(u, v, p);
+	case texture_kind::image:
+		return static_cast<const image_texture&>(t).image_texture::value(u, v, p);
+	case texture_kind::baked:
+		return static_cast<const baked_texture&>(t).baked_texture::value(u, v, p);
+	case texture_kind::program:
+		return static_cast<const program_texture&>(t).evaluate(u, v, p, 0, 0);
+	default:
+		return t.value(u, v, p);
+	}
+}
+
+// Same, with the footprint of the lookup for filtered image textures.
+inline color texture_value(const texture& t, real u, real v, const point3& p, real du, real dv) {
+	if (t.kind == texture_kind::image)
+		return static_cast<const image_texture&>(t).value_filtered(u, v, du, dv);
+	if (t.kind == texture_kind::program)
+		return static_cast<const program_texture&>(t).evaluate(u, v, p, du, dv);
+	return texture_value(t, u, v, p);
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,240 @@
+#ifndef TEXTURE_BAKE_H
+#define TEXTURE_BAKE_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "texture.h"
+#include "material.h"
+#include "dispatch.h"
+#include "arena.h"
+#include "thread_pool.h"
+#include "util.h"
+
+struct bake_settings {
+	// Voxels along the longest side of the baked region.
+	int resolution = 128;
+	// Only this part of the scene is baked, e.g. around the camera, so a huge
+	// ground sphere doesn't spread the voxels thin.
+	aabb region = aabb(point3(-infinity, -infinity, -infinity), point3(infinity, infinity, infinity));
+	// Baked grids are stored here, named by their parameter hash.
+	std::string cache_directory = "bake_cache";
+};
+
+// FNV-1a over raw bytes, the parameter hash baked grids are cached under.
+inline uint64_t hash_bytes(uint64_t h, const void* data, size_t size) {
+	auto bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		h ^= bytes[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+inline uint64_t hash_vec(uint64_t h, const vec3& v) {
+	real e[3] = { v.x(), v.y(), v.z() };
+	return hash_bytes(h, e, sizeof(e));
+}
+
+// Hash of everything a texture's output depends on. False for textures that
+// can't be baked: image textures need (u, v), custom ones are opaque.
+inline bool texture_hash(const texture& t, uint64_t& h) {
+	auto kind = static_cast<unsigned char>(t.kind);
+	h = hash_bytes(h, &kind, 1);
+
+	switch (t.kind) {
+	case texture_kind::solid_color: {
+		h = hash_vec(h, t.value(0, 0, point3(0, 0, 0)));
+		return true;
+	}
+	case texture_kind::checker: {
+		const auto& checker = static_cast<const checker_texture&>(t);
+		return texture_hash(*checker.odd, h) && texture_hash(*checker.even, h);
+	}
+	case texture_kind::noise: {
+		const auto& noise = static_cast<const noise_texture&>(t);
+		h = hash_bytes(h, &noise.scale, sizeof(noise.scale));
+		h = hash_vec(h, noise.col);
+		h = noise.noise.hash(h);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+inline bool read_baked(const std::string& file, baked_texture& baked) {
+	std::ifstream in(file, std::ios::binary);
+	int32_t size[3];
+	double box[6];
+	if (!in.read(reinterpret_cast<char*>(size), sizeof(size)) || !in.read(reinterpret_cast<char*>(box), sizeof(box)))
+		return false;
+	if (size[0] != baked.nx || size[1] != baked.ny || size[2] != baked.nz)
+		return false;
+
+	baked.texels.resize(size_t(3) * baked.nx * baked.ny * baked.nz);
+	return bool(in.read(reinterpret_cast<char*>(baked.texels.data()), baked.texels.size() * sizeof(float)));
+}
+
+inline void write_baked(const std::string& file, const baked_texture& baked) {
+	std::ofstream out(file, std::ios::binary | std::ios::trunc);
+	int32_t size[3] = { baked.nx, baked.ny, baked.nz };
+	double box[6] = { baked.bounds.min().x(), baked.bounds.min().y(), baked.bounds.min().z(),
+		baked.bounds.max().x(), baked.bounds.max().y(), baked.bounds.max().z() };
+	out.write(reinterpret_cast<const char*>(size), sizeof(size));
+	out.write(reinterpret_cast<const char*>(box), sizeof(box));
+	out.write(reinterpret_cast<const char*>(baked.texels.data()), baked.texels.size() * sizeof(float));
+}
+
+// Bakes source over bounds, or loads the grid from the cache directory if
+// the same texture was baked over the same box before. Returns source when
+// it can't be baked.
+shared_ptr<texture> bake_texture(scene_arena& arena, shared_ptr<texture> source, const aabb& bounds,
+	const bake_settings& settings = bake_settings()) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	if (!texture_hash(*source, h))
+		return source;
+
+	auto extent = bounds.max() - bounds.min();
+	auto longest = fmax(extent.x(), fmax(extent.y(), extent.z()));
+	if (!(longest > 0))
+		return source;
+
+	auto baked = arena.make<baked_texture>();
+	baked->source = source;
+
+	int* n[3] = { &baked->nx, &baked->ny, &baked->nz };
+	for (int a = 0; a < 3; a++) {
+		*n[a] = std::max(1, static_cast<int>(ceil(settings.resolution * extent[a] / longest)));
+	}
+	baked->bounds = bounds;
+
+	int32_t size[3] = { baked->nx, baked->ny, baked->nz };
+	h = hash_bytes(h, size, sizeof(size));
+	h = hash_vec(h, bounds.min());
+	h = hash_vec(h, bounds.max());
+
+	std::stringstream name;
+	name << std::hex << h << ".bake";
+	auto file = (std::filesystem::path(settings.cache_directory) / name.str()).string();
+
+	if (read_baked(file, *baked)) {
+		LOG(LOG_TYPE::INFO, "Loaded baked texture " + file);
+		return baked;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	baked->texels.resize(size_t(3) * baked->nx * baked->ny * baked->nz);
+	{
+		thread_pool pool;
+		for (int z = 0; z < baked->nz; z++) {
+			pool.submit([&, z] {
+				for (int y = 0; y < baked->ny; y++) {
+					for (int x = 0; x < baked->nx; x++) {
+						auto p = bounds.min() + vec3(
+							extent.x() * (x + real(0.5)) / baked->nx,
+							extent.y() * (y + real(0.5)) / baked->ny,
+							extent.z() * (z + real(0.5)) / baked->nz);
+						auto c = texture_value(*source, 0, 0, p);
+						auto t = &baked->texels[3 * ((size_t(z) * baked->ny + y) * baked->nx + x)];
+						t[0] = float(c.x());
+						t[1] = float(c.y());
+						t[2] = float(c.z());
+					}
+				}
+			});
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::create_directories(settings.cache_directory, ec);
+	write_baked(file, *baked);
+
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	std::stringstream ss;
+	ss << "Baked texture " << baked->nx << "x" << baked->ny << "x" << baked->nz << " in " << ms.count() << "ms to " << file;
+	LOG(LOG_TYPE::INFO, ss.str());
+	return baked;
+}
+
+// Swaps every bakeable texture in the scene for a baked grid over the world
+// bounds of the objects using it. Textures shared by several materials are
+// baked once.
+void bake_scene_textures(hittable_list& world, scene_arena& arena, const bake_settings& settings = bake_settings()) {
+	struct usage {
+		aabb bounds;
+		std::vector<shared_ptr<texture>*> slots;
+	};
+	std::unordered_map<texture*, usage> uses;
+	std::vector<texture*> order;
+
+	std::vector<shared_ptr<hittable>> objects;
+	std::vector<const hittable_list*> lists = { &world };
+	while (!lists.empty()) {
+		auto list = lists.back();
+		lists.pop_back();
+		for (const auto& object : list->objects) {
+			if (object->kind == hittable_kind::hittable_list)
+				lists.push_back(static_cast<const hittable_list*>(object.get()));
+			else
+				objects.push_back(object);
+		}
+	}
+
+	for (const auto& object : objects) {
+		aabb box;
+		if (!object->bounding_box(0, 1, box))
+			continue;
+
+		std::vector<material*> materials;
+		collect_materials(*object, materials);
+		for (auto mat : materials) {
+			auto slot = mat ? material_texture(*mat) : nullptr;
+			if (!slot || !*slot || (*slot)->kind == texture_kind::solid_color)
+				continue;
+
+			auto key = slot->get();
+			auto found = uses.find(key);
+			if (found == uses.end()) {
+				uses[key] = { box, { slot } };
+				order.push_back(key);
+			}
+			else {
+				found->second.bounds = surrounding_box(found->second.bounds, box);
+				found->second.slots.push_back(slot);
+			}
+		}
+	}
+
+	for (auto key : order) {
+		auto& use = uses[key];
+		auto source = *use.slots[0];
+
+		// A voxel of margin so surfaces on the box faces interpolate
+		// between samples taken inside.
+		auto extent = use.bounds.max() - use.bounds.min();
+		auto margin = fmax(extent.x(), fmax(extent.y(), extent.z())) / settings.resolution;
+		point3 low, high;
+		for (int a = 0; a < 3; a++) {
+			low[a] = fmax(use.bounds.min()[a] - margin, settings.region.min()[a]);
+			high[a] = fmin(use.bounds.max()[a] + margin, settings.region.max()[a]);
+		}
+		if (!(low.x() < high.x() && low.y() < high.y() && low.z() < high.z()))
+			continue;
+		aabb bounds(low, high);
+
+		auto baked = bake_texture(arena, source, bounds, settings);
+		for (auto slot : use.slots) {
+			*slot = baked;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,439 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "rtw_stb_image.h"
+#include "util.h"
+#include "thread_pool.h"
+
+// Image textures are turned into a mip pyramid of 32x32 RGBA8 tiles once and
+// written to "<image>.mip" (rebuilt when the image changes). Render threads
+// then read single tiles from that file on demand and keep them in a
+// process-wide LRU cache, so texture memory stays under a fixed budget no
+// matter how many or how large the images are.
+//
+// Textures are keyed by canonical path and load options, so every
+// image_texture of the same file shares one entry. Decoding and tile building
+// run on a loader pool; add_texture returns at once and lookups only wait for
+// the textures they actually touch.
+class texture_cache {
+public:
+	static const int tile_size = 32;
+	static const size_t tile_bytes = tile_size * tile_size * 4;
+
+	struct level_info {
+		int width, height;
+		int tiles_x, tiles_y;
+		size_t first_tile;
+	};
+
+	struct texture_info {
+		std::string source;
+		bool flip_vertically = true;
+
+		std::string tile_file;
+		int width = 0, height = 0;
+		// Empty when the image failed to load.
+		std::vector<level_info> levels;
+
+	private:
+		friend class texture_cache;
+
+		std::atomic<bool> ready{ false };
+		std::mutex load_mutex;
+		std::condition_variable loaded;
+
+		std::mutex file_mutex;
+		std::ifstream stream;
+	};
+
+	static texture_cache& global() {
+		static texture_cache cache;
+		return cache;
+	}
+
+	void set_budget(size_t bytes) { budget = bytes; }
+	size_t memory_budget() const { return budget; }
+
+	// Handle to the image's entry, queueing its load the first time the
+	// (path, options) pair is seen. Returns -1 if the file doesn't exist.
+	int add_texture(const char* filename, bool flip_vertically = true);
+
+	// Waits for the texture's load to finish.
+	const texture_info& info(int id);
+
+	// Waits for every queued load.
+	void wait_all() { loaders.wait_idle(); }
+
+	// Texel of a mip level, coordinates clamped to the level.
+	color texel(int id, int level, int x, int y);
+
+	void report() const;
+
+private:
+	struct tile {
+		unsigned char data[tile_bytes];
+	};
+
+	struct entry {
+		std::shared_ptr<const tile> data;
+		std::list<uint64_t>::iterator lru;
+	};
+
+	// Independent LRU lists so threads rarely wait on each other.
+	struct shard {
+		std::mutex mutex;
+		std::list<uint64_t> lru;
+		std::unordered_map<uint64_t, entry> tiles;
+		size_t bytes = 0;
+	};
+
+	static const int shard_count = 16;
+	static const uint32_t file_magic = 0x50494d42;  // "BMIP"
+	static const size_t header_bytes = 48;
+
+	texture_cache() {}
+
+	static uint64_t tile_key(int id, int level, int tx, int ty) {
+		return uint64_t(id) << 48 | uint64_t(level) << 40 | uint64_t(ty) << 20 | uint64_t(tx);
+	}
+
+	static size_t shard_of(uint64_t key) {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return size_t(key % shard_count);
+	}
+
+	std::shared_ptr<const tile> fetch(int id, int level, int tx, int ty);
+	std::shared_ptr<const tile> read_tile(int id, size_t index);
+	void load(texture_info& info);
+	bool build_tile_file(const texture_info& info, const std::string& tile_file, uint64_t source_size, int64_t source_time);
+
+	size_t budget = size_t(256) * 1024 * 1024;
+
+	std::mutex textures_mutex;
+	std::vector<std::unique_ptr<texture_info>> textures;
+	std::unordered_map<std::string, int> ids;
+	shard shards[shard_count];
+
+	std::atomic<uint64_t> requests{ 0 };
+	std::atomic<uint64_t> hits{ 0 };
+	std::atomic<uint64_t> misses{ 0 };
+	std::atomic<uint64_t> evictions{ 0 };
+
+	// Last member, so its jobs are done before anything above goes away.
+	thread_pool loaders;
+};
+
+inline void compute_levels(texture_cache::texture_info& info) {
+	info.levels.clear();
+	int w = info.width, h = info.height;
+	size_t first = 0;
+	while (true) {
+		texture_cache::level_info level;
+		level.width = w;
+		level.height = h;
+		level.tiles_x = (w + texture_cache::tile_size - 1) / texture_cache::tile_size;
+		level.tiles_y = (h + texture_cache::tile_size - 1) / texture_cache::tile_size;
+		level.first_tile = first;
+		info.levels.push_back(level);
+		first += size_t(level.tiles_x) * level.tiles_y;
+
+		if (w == 1 && h == 1) break;
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+	}
+}
+
+bool texture_cache::build_tile_file(const texture_info& source, const std::string& tile_file,
+	uint64_t source_size, int64_t source_time) {
+	// The global flag isn't safe to set from several loader threads.
+	stbi_set_flip_vertically_on_load_thread(source.flip_vertically);
+	int width, height, components;
+	unsigned char* pixels = stbi_load(source.source.c_str(), &width, &height, &components, 4);
+	if (!pixels)
+		return false;
+
+	texture_info info;
+	info.width = width;
+	info.height = height;
+	compute_levels(info);
+
+	// Written under a temporary name and renamed once complete, so a write
+	// that fails halfway never leaves a file load() takes as up to date.
+	std::ostringstream suffix;
+	suffix << ".tmp" << std::this_thread::get_id();
+	auto partial_file = tile_file + suffix.str();
+	std::ofstream out(partial_file, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		stbi_image_free(pixels);
+		return false;
+	}
+
+	unsigned char header[header_bytes] = {};
+	uint32_t fields[4] = { file_magic, uint32_t(width), uint32_t(height), uint32_t(tile_size) };
+	std::memcpy(header, fields, sizeof(fields));
+	std::memcpy(header + 16, &source_size, sizeof(source_size));
+	std::memcpy(header + 24, &source_time, sizeof(source_time));
+	header[32] = source.flip_vertically;
+	out.write(reinterpret_cast<const char*>(header), header_bytes);
+
+	// Level 0 is the image, every next one a 2x2 box filter of the previous.
+	std::vector<unsigned char> level(pixels, pixels + size_t(width) * height * 4);
+	stbi_image_free(pixels);
+
+	std::vector<unsigned char> tile_data(tile_bytes);
+	for (size_t l = 0; l < info.levels.size(); l++) {
+		const auto& li = info.levels[l];
+
+		for (int ty = 0; ty < li.tiles_y; ty++) {
+			for (int tx = 0; tx < li.tiles_x; tx++) {
+				for (int y = 0; y < tile_size; y++) {
+					int sy = std::min(ty * tile_size + y, li.height - 1);
+					for (int x = 0; x < tile_size; x++) {
+						int sx = std::min(tx * tile_size + x, li.width - 1);
+						std::memcpy(&tile_data[(size_t(y) * tile_size + x) * 4], &level[(size_t(sy) * li.width + sx) * 4], 4);
+					}
+				}
+				out.write(reinterpret_cast<const char*>(tile_data.data()), tile_bytes);
+			}
+		}
+
+		if (l + 1 == info.levels.size()) break;
+
+		const auto& next = info.levels[l + 1];
+		std::vector<unsigned char> smaller(size_t(next.width) * next.height * 4);
+		for (int y = 0; y < next.height; y++) {
+			for (int x = 0; x < next.width; x++) {
+				int x0 = std::min(2 * x, li.width - 1), x1 = std::min(2 * x + 1, li.width - 1);
+				int y0 = std::min(2 * y, li.height - 1), y1 = std::min(2 * y + 1, li.height - 1);
+				for (int c = 0; c < 4; c++) {
+					int sum = level[(size_t(y0) * li.width + x0) * 4 + c] + level[(size_t(y0) * li.width + x1) * 4 + c]
+						+ level[(size_t(y1) * li.width + x0) * 4 + c] + level[(size_t(y1) * li.width + x1) * 4 + c];
+					smaller[(size_t(y) * next.width + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+		level.swap(smaller);
+	}
+
+	out.close();
+	std::error_code ec;
+	if (!out.fail())
+		std::filesystem::rename(partial_file, tile_file, ec);
+	if (out.fail() || ec) {
+		std::filesystem::remove(partial_file, ec);
+		return false;
+	}
+	return true;
+}
+
+int texture_cache::add_texture(const char* filename, bool flip_vertically) {
+	requests++;
+
+	std::error_code ec;
+	if (!std::filesystem::is_regular_file(filename, ec)) {
+		std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
+		return -1;
+	}
+
+	auto path = std::filesystem::weakly_canonical(filename, ec);
+	auto key = (ec ? std::string(filename) : path.string()) + (flip_vertically ? "|flip" : "");
+
+	std::lock_guard<std::mutex> lock(textures_mutex);
+	auto found = ids.find(key);
+	if (found != ids.end())
+		return found->second;
+
+	auto info = std::make_unique<texture_info>();
+	info->source = filename;
+	info->flip_vertically = flip_vertically;
+
+	auto& pending = *info;
+	textures.push_back(std::move(info));
+	int id = static_cast<int>(textures.size()) - 1;
+	ids[key] = id;
+
+	loaders.submit([this, &pending] { load(pending); });
+	return id;
+}
+
+const texture_cache::texture_info& texture_cache::info(int id) {
+	auto& t = *textures[id];
+	if (!t.ready.load(std::memory_order_acquire)) {
+		std::unique_lock<std::mutex> lock(t.load_mutex);
+		t.loaded.wait(lock, [&t] { return t.ready.load(std::memory_order_acquire); });
+	}
+	return t;
+}
+
+void texture_cache::load(texture_info& info) {
+	auto filename = info.source.c_str();
+	std::error_code ec;
+	auto source_size = static_cast<uint64_t>(std::filesystem::file_size(filename, ec));
+	auto source_time = static_cast<int64_t>(std::filesystem::last_write_time(filename, ec).time_since_epoch().count());
+
+	info.tile_file = info.source + (info.flip_vertically ? ".mip" : ".noflip.mip");
+
+	// Reuse the tile file when it was built from this very image.
+	bool up_to_date = false;
+	{
+		std::ifstream in(info.tile_file, std::ios::binary);
+		unsigned char header[header_bytes];
+		if (in.read(reinterpret_cast<char*>(header), header_bytes)) {
+			uint32_t fields[4];
+			uint64_t size;
+			int64_t time;
+			std::memcpy(fields, header, sizeof(fields));
+			std::memcpy(&size, header + 16, sizeof(size));
+			std::memcpy(&time, header + 24, sizeof(time));
+			if (fields[0] == file_magic && fields[3] == uint32_t(tile_size) && size == source_size && time == source_time
+				&& header[32] == info.flip_vertically) {
+				info.width = int(fields[1]);
+				info.height = int(fields[2]);
+				up_to_date = true;
+			}
+		}
+	}
+
+	bool loaded = true;
+	if (!up_to_date) {
+		if (!build_tile_file(info, info.tile_file, source_size, source_time)) {
+			// Next to the image may be read-only, try the temp directory.
+			auto fallback = std::filesystem::temp_directory_path(ec)
+				/ (std::to_string(std::hash<std::string>()(std::filesystem::absolute(filename, ec).string()))
+					+ (info.flip_vertically ? ".mip" : ".noflip.mip"));
+			info.tile_file = fallback.string();
+			loaded = build_tile_file(info, info.tile_file, source_size, source_time);
+		}
+
+		if (loaded) {
+			std::ifstream in(info.tile_file, std::ios::binary);
+			uint32_t fields[4];
+			in.read(reinterpret_cast<char*>(fields), sizeof(fields));
+			info.width = int(fields[1]);
+			info.height = int(fields[2]);
+		}
+	}
+
+	if (loaded) {
+		compute_levels(info);
+		info.stream.open(info.tile_file, std::ios::binary);
+
+		std::stringstream ss;
+		ss << "Texture '" << filename << "': " << info.width << "x" << info.height << ", "
+			<< info.levels.size() << " mip levels" << (up_to_date ? " (cached tiles)" : "");
+		LOG(LOG_TYPE::INFO, ss.str());
+	}
+	else {
+		std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(info.load_mutex);
+		info.ready.store(true, std::memory_order_release);
+	}
+	info.loaded.notify_all();
+}
+
+std::shared_ptr<const texture_cache::tile> texture_cache::read_tile(int id, size_t index) {
+	auto result = std::make_shared<tile>();
+
+	auto& file = *textures[id];
+	std::lock_guard<std::mutex> lock(file.file_mutex);
+	file.stream.clear();
+	file.stream.seekg(std::streamoff(header_bytes + index * tile_bytes));
+	if (!file.stream.read(reinterpret_cast<char*>(result->data), tile_bytes)) {
+		std::memset(result->data, 0, tile_bytes);
+	}
+
+	return result;
+}
+
+std::shared_ptr<const texture_cache::tile> texture_cache::fetch(int id, int level, int tx, int ty) {
+	auto key = tile_key(id, level, tx, ty);
+	auto& s = shards[shard_of(key)];
+
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto it = s.tiles.find(key);
+		if (it != s.tiles.end()) {
+			s.lru.splice(s.lru.begin(), s.lru, it->second.lru);
+			hits++;
+			return it->second.data;
+		}
+	}
+
+	// Read outside the lock, another thread may load the same tile meanwhile.
+	const auto& li = textures[id]->levels[level];
+	auto data = read_tile(id, li.first_tile + size_t(ty) * li.tiles_x + tx);
+	misses++;
+
+	std::lock_guard<std::mutex> lock(s.mutex);
+	auto it = s.tiles.find(key);
+	if (it != s.tiles.end())
+		return it->second.data;
+
+	s.lru.push_front(key);
+	s.tiles[key] = { data, s.lru.begin() };
+	s.bytes += tile_bytes;
+
+	// Tiles still in use elsewhere stay alive through their shared_ptr.
+	while (s.bytes > budget / shard_count && s.lru.size() > 1) {
+		s.tiles.erase(s.lru.back());
+		s.lru.pop_back();
+		s.bytes -= tile_bytes;
+		evictions++;
+	}
+
+	return data;
+}
+
+color texture_cache::texel(int id, int level, int x, int y) {
+	const auto& li = textures[id]->levels[level];
+	x = std::min(std::max(x, 0), li.width - 1);
+	y = std::min(std::max(y, 0), li.height - 1);
+
+	int tx = x / tile_size, ty = y / tile_size;
+	auto key = tile_key(id, level, tx, ty);
+
+	// Most lookups land in the tile the previous one used.
+	thread_local uint64_t last_key = ~uint64_t(0);
+	thread_local std::shared_ptr<const tile> last_tile;
+	if (key != last_key) {
+		last_tile = fetch(id, level, tx, ty);
+		last_key = key;
+	}
+
+	const auto color_scale = 1.0 / 255.0;
+	auto pixel = last_tile->data + (size_t(y % tile_size) * tile_size + x % tile_size) * 4;
+	return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+}
+
+void texture_cache::report() const {
+	size_t resident = 0;
+	for (const auto& s : shards) resident += s.bytes;
+
+	std::stringstream ss;
+	ss << "Texture cache: " << textures.size() << " textures for " << requests << " requests, " << resident / 1024.0 << " KB resident of " << budget / 1024.0 << " KB budget, "
+		<< hits << " hits, " << misses << " misses, " << evictions << " evictions";
+	LOG(LOG_TYPE::INFO, ss.str());
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef TEXTURE_PROGRAM_H
+#define TEXTURE_PROGRAM_H
+
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "texture.h"
+#include "material.h"
+#include "dispatch.h"
+#include "arena.h"
+#include "util.h"
+
+// Appends the ops of the graph below t. Checkers whose two sides fold to
+// constants become a single op, and to one constant if those are equal.
+inline void compile_texture(const texture& t, std::vector<texture_op>& ops) {
+	texture_op op;
+	op.source = &t;
+
+	switch (t.kind) {
+	case texture_kind::solid_color:
+		op.code = texture_opcode::constant;
+		op.a = t.value(0, 0, point3(0, 0, 0));
+		break;
+	case texture_kind::checker: {
+		const auto& checker = static_cast<const checker_texture&>(t);
+		std::vector<texture_op> odd, even;
+		compile_texture(*checker.odd, odd);
+		compile_texture(*checker.even, even);
+
+		bool odd_constant = odd.size() == 1 && odd[0].code == texture_opcode::constant;
+		bool even_constant = even.size() == 1 && even[0].code == texture_opcode::constant;
+		if (odd_constant && even_constant) {
+			op.code = texture_opcode::checker_constant;
+			op.a = odd[0].a;
+			op.b = even[0].a;
+			if (op.a.x() == op.b.x() && op.a.y() == op.b.y() && op.a.z() == op.b.z())
+				op.code = texture_opcode::constant;
+			break;
+		}
+
+		op.code = texture_opcode::checker_branch;
+		op.skip = static_cast<int>(odd.size());
+		ops.push_back(op);
+		ops.insert(ops.end(), odd.begin(), odd.end());
+		ops.insert(ops.end(), even.begin(), even.end());
+		return;
+	}
+	case texture_kind::noise:
+		op.code = texture_opcode::noise;
+		break;
+	case texture_kind::image:
+		op.code = texture_opcode::image;
+		break;
+	case texture_kind::baked:
+		op.code = texture_opcode::baked;
+		break;
+	case texture_kind::program: {
+		const auto& program = static_cast<const program_texture&>(t);
+		ops.insert(ops.end(), program.ops.begin(), program.ops.end());
+		return;
+	}
+	default:
+		op.code = texture_opcode::call;
+		break;
+	}
+
+	ops.push_back(op);
+}
+
+// Replaces the texture of every built-in material in the world by its
+// compiled program. Shared textures are compiled once; leaves are already
+// dispatched directly and are left alone.
+void compile_scene_textures(hittable_list& world, scene_arena& arena) {
+	std::vector<material*> materials;
+	collect_materials(world, materials);
+
+	std::unordered_map<const texture*, shared_ptr<texture>> compiled;
+	size_t programs = 0, ops = 0;
+
+	for (auto mat : materials) {
+		auto slot = mat ? material_texture(*mat) : nullptr;
+		if (!slot || !*slot)
+			continue;
+
+		auto found = compiled.find(slot->get());
+		if (found == compiled.end()) {
+			std::vector<texture_op> code;
+			compile_texture(**slot, code);
+
+			shared_ptr<texture> replacement = *slot;
+			if ((*slot)->kind == texture_kind::checker) {
+				auto program = arena.make<program_texture>();
+				program->ops = std::move(code);
+				program->source = *slot;
+				programs++;
+				ops += program->ops.size();
+				replacement = program;
+			}
+			found = compiled.emplace(slot->get(), replacement).first;
+		}
+
+		*slot = found->second;
+	}
+
+	std::stringstream ss;
+	ss << "Compiled " << programs << " texture graphs into " << ops << " ops";
+	LOG(LOG_TYPE::INFO, ss.str());
+}
+
+#endif
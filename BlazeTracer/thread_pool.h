@@ -0,0 +1,99 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers draining a FIFO of jobs. The destructor finishes every
+// queued job before joining.
+class thread_pool {
+public:
+	explicit thread_pool(int thread_count = 0);
+	~thread_pool();
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	void submit(std::function<void()> job);
+
+	// Blocks until the queue is empty and no job is running.
+	void wait_idle();
+
+	int size() const { return static_cast<int>(workers.size()); }
+
+private:
+	void work();
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable job_added;
+	std::condition_variable idle;
+	int running = 0;
+	bool stopping = false;
+};
+
+thread_pool::thread_pool(int thread_count) {
+	if (thread_count <= 0)
+		thread_count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+	for (int i = 0; i < thread_count; i++) {
+		workers.emplace_back(&thread_pool::work, this);
+	}
+}
+
+thread_pool::~thread_pool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	job_added.notify_all();
+	for (auto& t : workers) {
+		t.join();
+	}
+}
+
+void thread_pool::submit(std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(std::move(job));
+	}
+	job_added.notify_one();
+}
+
+void thread_pool::wait_idle() {
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this] { return jobs.empty() && running == 0; });
+}
+
+void thread_pool::work() {
+	while (true) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			job_added.wait(lock, [this] { return stopping || !jobs.empty(); });
+			if (jobs.empty())
+				return;
+
+			job = std::move(jobs.front());
+			jobs.pop_front();
+			running++;
+		}
+
+		job();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running--;
+			if (jobs.empty() && running == 0)
+				idle.notify_all();
+		}
+	}
+}
+
+#endif
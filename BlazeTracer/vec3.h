@@ -2,128 +2,162 @@
 #define VEC3_H
 
 #include <cmath>
+#include <type_traits>
 
+#include "precision.h"
 #include "util.h"
+#include "vec3_simd.h"
 
 using std::sqrt;
 
-class vec3 {
+template <typename T>
+class vec3_t {
 public:
-	double e[3];
+	using kernels = vec3_kernels<T>;
+
+	// Padded to four lanes when the SIMD kernels are in use; the padding
+	// lane is always zero.
+	alignas(kernels::alignment) T e[kernels::lanes];
 public:
-	vec3() : e{ 0, 0, 0 } {}
-	vec3(double e1, double e2, double e3) : e{ e1, e2, e3 } {}
+	vec3_t() : e{ 0, 0, 0 } {}
+	vec3_t(T e1, T e2, T e3) : e{ e1, e2, e3 } {}
+
+	template <typename U>
+	explicit vec3_t(const vec3_t<U>& v) : e{ T(v.e[0]), T(v.e[1]), T(v.e[2]) } {}
 
-	double x() const { return e[0]; }
-	double y() const { return e[1]; }
-	double z() const { return e[2]; }
+	T x() const { return e[0]; }
+	T y() const { return e[1]; }
+	T z() const { return e[2]; }
 
-	vec3 operator -() const { return vec3(-e[0], -e[1], -e[2]); }
-	double operator[](int i) const { return e[i]; }
-	double& operator[](int i) { return e[i]; }
+	vec3_t operator -() const {
+		vec3_t out;
+		kernels::neg(e, out.e);
+		return out;
+	}
+	T operator[](int i) const { return e[i]; }
+	T& operator[](int i) { return e[i]; }
 
-	vec3 operator +=(const vec3& v) {
-		e[0] += v.e[0];
-		e[1] += v.e[1];
-		e[2] += v.e[2];
+	vec3_t operator +=(const vec3_t& v) {
+		kernels::add(e, v.e, e);
 
 		return *this;
 	}
 
-	vec3 operator *=(const vec3& v) {
-		e[0] *= v.e[0];
-		e[1] *= v.e[1];
-		e[2] *= v.e[2];
+	vec3_t operator *=(const vec3_t& v) {
+		kernels::mul(e, v.e, e);
 
 		return *this;
 	}
 
-	vec3 operator *=(const double t) {
-		e[0] *= t;
-		e[1] *= t;
-		e[2] *= t;
+	vec3_t operator *=(const T t) {
+		kernels::scale(e, t, e);
 
 		return *this;
 	}
 
-	vec3 operator /=(const double t) {
-		return *this *= 1.0 / t;
+	vec3_t operator /=(const T t) {
+		return *this *= T(1) / t;
 	}
 
 	
-	double length_squared() const {
+	T length_squared() const {
 
-		return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+		return kernels::dot(e, e);
 	}
 
-	double length() const {
+	T length() const {
 		return sqrt(length_squared());
 	}
 
-	inline static vec3 random() {
-		return vec3(random_double(), random_double(), random_double());
+	inline static vec3_t random() {
+		return vec3_t(T(random_double()), T(random_double()), T(random_double()));
 	}
 
-	inline static vec3 random(double min, double max) {
-		return vec3(random_double(min, max), random_double(min, max),
-			random_double(min, max));
+	inline static vec3_t random(double min, double max) {
+		return vec3_t(T(random_double(min, max)), T(random_double(min, max)),
+			T(random_double(min, max)));
 	}
 
 	bool near_zero() const {
-		const auto s = 1e-8;
+		const auto s = T(1e-8);
 		return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[1]) < s);
 	}
 
 	
 };
 
+using vec3 = vec3_t<real>;
 using point3 = vec3;
 using color = vec3;
 
 
 //UTIL
 
+// Scalars are taken in a non-deduced context so mixing literals of another
+// type (2 * v, 0.5 * v) works for every vec3_t.
+template <typename T>
+using scalar_of = std::type_identity_t<T>;
 
-inline std::ostream& operator <<(std::ostream& out, const vec3& v) {
+template <typename T>
+inline std::ostream& operator <<(std::ostream& out, const vec3_t<T>& v) {
 	return out << '(' << v.e[0] << ',' << v.e[1] << ',' << v.e[2] << ')';
 }
 
-inline vec3 operator +(const vec3& u, const vec3& v) {
-	return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T>
+inline vec3_t<T> operator +(const vec3_t<T>& u, const vec3_t<T>& v) {
+	vec3_t<T> out;
+	vec3_kernels<T>::add(u.e, v.e, out.e);
+	return out;
 }
 
-inline vec3 operator *(const vec3& u, const vec3& v) {
-	return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T>
+inline vec3_t<T> operator *(const vec3_t<T>& u, const vec3_t<T>& v) {
+	vec3_t<T> out;
+	vec3_kernels<T>::mul(u.e, v.e, out.e);
+	return out;
 }
 
-inline vec3 operator -(const vec3& u, const vec3& v) {
-	return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T>
+inline vec3_t<T> operator -(const vec3_t<T>& u, const vec3_t<T>& v) {
+	vec3_t<T> out;
+	vec3_kernels<T>::sub(u.e, v.e, out.e);
+	return out;
 }
 
-inline vec3 operator *(double t, const vec3& v) {
-	return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+template <typename T>
+inline vec3_t<T> operator *(scalar_of<T> t, const vec3_t<T>& v) {
+	vec3_t<T> out;
+	vec3_kernels<T>::scale(v.e, t, out.e);
+	return out;
 }
 
-inline vec3 operator *(const vec3& v, double t) {
+template <typename T>
+inline vec3_t<T> operator *(const vec3_t<T>& v, scalar_of<T> t) {
 	return t * v;
 }
 
-inline vec3 operator /(const vec3& v, double t) {
-	return (1.0/t) * v;
+template <typename T>
+inline vec3_t<T> operator /(const vec3_t<T>& v, scalar_of<T> t) {
+	return (T(1) / t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
-	return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
+template <typename T>
+inline T dot(const vec3_t<T>& u, const vec3_t<T>& v) {
+	return vec3_kernels<T>::dot(u.e, v.e);
 }
 
-inline vec3 cross(const vec3& u, const vec3& v) {
-	return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-		u.e[2] * v.e[0] - u.e[0] * v.e[2],
-		u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+template <typename T>
+inline vec3_t<T> cross(const vec3_t<T>& u, const vec3_t<T>& v) {
+	vec3_t<T> out;
+	vec3_kernels<T>::cross(u.e, v.e, out.e);
+	return out;
 }
 
-inline vec3 unit_vector(vec3 v) {
-	return v / v.length();
+template <typename T>
+inline vec3_t<T> unit_vector(vec3_t<T> v) {
+	vec3_t<T> out;
+	vec3_kernels<T>::normalize(v.e, out.e);
+	return out;
 }
 
 vec3 random_in_unit_sphere() {
@@ -162,14 +196,14 @@ vec3 reflect(const vec3& v, const vec3& n) {
 	return v - 2 * dot(v, n) * n;
 }
 
-vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-	auto cos_theta = fmin(dot(-uv, n), 1.0);
+vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
+	auto cos_theta = fmin(dot(-uv, n), real(1.0));
 
 	vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-	vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
+	vec3 r_out_parallel = -sqrt(fabs(1 - r_out_perp.length_squared())) * n;
 	return r_out_perp + r_out_parallel;
 }
 
 
 
-#endif
\ No newline at end of file
+#endif
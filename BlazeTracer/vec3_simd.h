@@ -0,0 +1,243 @@
+#ifndef VEC3_SIMD_H
+#define VEC3_SIMD_H
+
+#include <cmath>
+
+// Element-wise kernels behind vec3_t. With BLAZE_SIMD defined a vec3 is padded
+// to four lanes (the fourth always zero) and the kernels below use whatever
+// the compiler targets: SSE for float, AVX or SSE2 for double, NEON for float
+// on ARM. Everything else, and builds without BLAZE_SIMD, use the scalar
+// fallback.
+
+#if defined(BLAZE_SIMD)
+#if defined(__AVX__)
+#include <immintrin.h>
+#define BLAZE_SIMD_SSE
+#define BLAZE_SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLAZE_SIMD_SSE
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define BLAZE_SIMD_NEON
+#endif
+#endif
+
+template <typename T>
+struct vec3_kernels {
+	static constexpr int lanes = 3;
+	static constexpr int alignment = alignof(T);
+
+	static void add(const T* a, const T* b, T* out) {
+		out[0] = a[0] + b[0]; out[1] = a[1] + b[1]; out[2] = a[2] + b[2];
+	}
+	static void sub(const T* a, const T* b, T* out) {
+		out[0] = a[0] - b[0]; out[1] = a[1] - b[1]; out[2] = a[2] - b[2];
+	}
+	static void mul(const T* a, const T* b, T* out) {
+		out[0] = a[0] * b[0]; out[1] = a[1] * b[1]; out[2] = a[2] * b[2];
+	}
+	static void scale(const T* a, T s, T* out) {
+		out[0] = a[0] * s; out[1] = a[1] * s; out[2] = a[2] * s;
+	}
+	static void neg(const T* a, T* out) {
+		out[0] = -a[0]; out[1] = -a[1]; out[2] = -a[2];
+	}
+	static T dot(const T* a, const T* b) {
+		return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	}
+	static void cross(const T* a, const T* b, T* out) {
+		out[0] = a[1] * b[2] - a[2] * b[1];
+		out[1] = a[2] * b[0] - a[0] * b[2];
+		out[2] = a[0] * b[1] - a[1] * b[0];
+	}
+	static void normalize(const T* a, T* out) {
+		scale(a, T(1) / std::sqrt(dot(a, a)), out);
+	}
+};
+
+#if defined(BLAZE_SIMD_SSE)
+
+template <>
+struct vec3_kernels<float> {
+	static constexpr int lanes = 4;
+	static constexpr int alignment = 16;
+
+	static void add(const float* a, const float* b, float* out) {
+		_mm_store_ps(out, _mm_add_ps(_mm_load_ps(a), _mm_load_ps(b)));
+	}
+	static void sub(const float* a, const float* b, float* out) {
+		_mm_store_ps(out, _mm_sub_ps(_mm_load_ps(a), _mm_load_ps(b)));
+	}
+	static void mul(const float* a, const float* b, float* out) {
+		_mm_store_ps(out, _mm_mul_ps(_mm_load_ps(a), _mm_load_ps(b)));
+	}
+	static void scale(const float* a, float s, float* out) {
+		_mm_store_ps(out, _mm_mul_ps(_mm_load_ps(a), _mm_set1_ps(s)));
+	}
+	static void neg(const float* a, float* out) {
+		_mm_store_ps(out, _mm_sub_ps(_mm_setzero_ps(), _mm_load_ps(a)));
+	}
+
+	// Horizontal sum of all four lanes; the padding lane is zero.
+	static __m128 dot_splat(__m128 a, __m128 b) {
+		__m128 m = _mm_mul_ps(a, b);
+		__m128 s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 3, 2)));
+	}
+	static float dot(const float* a, const float* b) {
+		return _mm_cvtss_f32(dot_splat(_mm_load_ps(a), _mm_load_ps(b)));
+	}
+	static void cross(const float* a, const float* b, float* out) {
+		__m128 va = _mm_load_ps(a);
+		__m128 vb = _mm_load_ps(b);
+		__m128 a_yzx = _mm_shuffle_ps(va, va, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 b_yzx = _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 c = _mm_sub_ps(_mm_mul_ps(va, b_yzx), _mm_mul_ps(a_yzx, vb));
+		_mm_store_ps(out, _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+	}
+	// rsqrt estimate refined by one Newton-Raphson step (~22 bits).
+	static void normalize(const float* a, float* out) {
+		__m128 va = _mm_load_ps(a);
+		__m128 d = dot_splat(va, va);
+		__m128 r = _mm_rsqrt_ps(d);
+		__m128 half_d_r = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), d), r);
+		r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(half_d_r, r)));
+		_mm_store_ps(out, _mm_mul_ps(va, r));
+	}
+};
+
+#if defined(BLAZE_SIMD_AVX)
+
+template <>
+struct vec3_kernels<double> {
+	static constexpr int lanes = 4;
+	static constexpr int alignment = 32;
+
+	static void add(const double* a, const double* b, double* out) {
+		_mm256_store_pd(out, _mm256_add_pd(_mm256_load_pd(a), _mm256_load_pd(b)));
+	}
+	static void sub(const double* a, const double* b, double* out) {
+		_mm256_store_pd(out, _mm256_sub_pd(_mm256_load_pd(a), _mm256_load_pd(b)));
+	}
+	static void mul(const double* a, const double* b, double* out) {
+		_mm256_store_pd(out, _mm256_mul_pd(_mm256_load_pd(a), _mm256_load_pd(b)));
+	}
+	static void scale(const double* a, double s, double* out) {
+		_mm256_store_pd(out, _mm256_mul_pd(_mm256_load_pd(a), _mm256_set1_pd(s)));
+	}
+	static void neg(const double* a, double* out) {
+		_mm256_store_pd(out, _mm256_sub_pd(_mm256_setzero_pd(), _mm256_load_pd(a)));
+	}
+	static double dot(const double* a, const double* b) {
+		__m256d m = _mm256_mul_pd(_mm256_load_pd(a), _mm256_load_pd(b));
+		__m128d s = _mm_add_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+		return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+	}
+	static void cross(const double* a, const double* b, double* out) {
+		__m256d va = _mm256_load_pd(a);
+		__m256d vb = _mm256_load_pd(b);
+		// (y, z, x, w) without AVX2 lane-crossing permutes
+		__m256d a_yzx = _mm256_set_pd(a[3], a[0], a[2], a[1]);
+		__m256d b_yzx = _mm256_set_pd(b[3], b[0], b[2], b[1]);
+		__m256d c = _mm256_sub_pd(_mm256_mul_pd(va, b_yzx), _mm256_mul_pd(a_yzx, vb));
+		alignas(32) double t[4];
+		_mm256_store_pd(t, c);
+		out[0] = t[1]; out[1] = t[2]; out[2] = t[0]; out[3] = 0;
+	}
+	static void normalize(const double* a, double* out) {
+		scale(a, 1.0 / std::sqrt(dot(a, a)), out);
+	}
+};
+
+#else
+
+// SSE2: x and y in one register, z and the padding lane in the other.
+template <>
+struct vec3_kernels<double> {
+	static constexpr int lanes = 4;
+	static constexpr int alignment = 16;
+
+	static void add(const double* a, const double* b, double* out) {
+		_mm_store_pd(out, _mm_add_pd(_mm_load_pd(a), _mm_load_pd(b)));
+		_mm_store_pd(out + 2, _mm_add_pd(_mm_load_pd(a + 2), _mm_load_pd(b + 2)));
+	}
+	static void sub(const double* a, const double* b, double* out) {
+		_mm_store_pd(out, _mm_sub_pd(_mm_load_pd(a), _mm_load_pd(b)));
+		_mm_store_pd(out + 2, _mm_sub_pd(_mm_load_pd(a + 2), _mm_load_pd(b + 2)));
+	}
+	static void mul(const double* a, const double* b, double* out) {
+		_mm_store_pd(out, _mm_mul_pd(_mm_load_pd(a), _mm_load_pd(b)));
+		_mm_store_pd(out + 2, _mm_mul_pd(_mm_load_pd(a + 2), _mm_load_pd(b + 2)));
+	}
+	static void scale(const double* a, double s, double* out) {
+		__m128d vs = _mm_set1_pd(s);
+		_mm_store_pd(out, _mm_mul_pd(_mm_load_pd(a), vs));
+		_mm_store_pd(out + 2, _mm_mul_pd(_mm_load_pd(a + 2), vs));
+	}
+	static void neg(const double* a, double* out) {
+		_mm_store_pd(out, _mm_sub_pd(_mm_setzero_pd(), _mm_load_pd(a)));
+		_mm_store_pd(out + 2, _mm_sub_pd(_mm_setzero_pd(), _mm_load_pd(a + 2)));
+	}
+	static double dot(const double* a, const double* b) {
+		__m128d s = _mm_add_pd(_mm_mul_pd(_mm_load_pd(a), _mm_load_pd(b)),
+			_mm_mul_pd(_mm_load_pd(a + 2), _mm_load_pd(b + 2)));
+		return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+	}
+	static void cross(const double* a, const double* b, double* out) {
+		double x = a[1] * b[2] - a[2] * b[1];
+		double y = a[2] * b[0] - a[0] * b[2];
+		double z = a[0] * b[1] - a[1] * b[0];
+		out[0] = x; out[1] = y; out[2] = z; out[3] = 0;
+	}
+	static void normalize(const double* a, double* out) {
+		scale(a, 1.0 / std::sqrt(dot(a, a)), out);
+	}
+};
+
+#endif
+
+#elif defined(BLAZE_SIMD_NEON)
+
+template <>
+struct vec3_kernels<float> {
+	static constexpr int lanes = 4;
+	static constexpr int alignment = 16;
+
+	static void add(const float* a, const float* b, float* out) {
+		vst1q_f32(out, vaddq_f32(vld1q_f32(a), vld1q_f32(b)));
+	}
+	static void sub(const float* a, const float* b, float* out) {
+		vst1q_f32(out, vsubq_f32(vld1q_f32(a), vld1q_f32(b)));
+	}
+	static void mul(const float* a, const float* b, float* out) {
+		vst1q_f32(out, vmulq_f32(vld1q_f32(a), vld1q_f32(b)));
+	}
+	static void scale(const float* a, float s, float* out) {
+		vst1q_f32(out, vmulq_n_f32(vld1q_f32(a), s));
+	}
+	static void neg(const float* a, float* out) {
+		vst1q_f32(out, vnegq_f32(vld1q_f32(a)));
+	}
+	static float dot(const float* a, const float* b) {
+		return vaddvq_f32(vmulq_f32(vld1q_f32(a), vld1q_f32(b)));
+	}
+	static void cross(const float* a, const float* b, float* out) {
+		float x = a[1] * b[2] - a[2] * b[1];
+		float y = a[2] * b[0] - a[0] * b[2];
+		float z = a[0] * b[1] - a[1] * b[0];
+		out[0] = x; out[1] = y; out[2] = z; out[3] = 0;
+	}
+	// rsqrt estimate refined by one Newton-Raphson step.
+	static void normalize(const float* a, float* out) {
+		float32x4_t va = vld1q_f32(a);
+		float32x4_t d = vdupq_n_f32(vaddvq_f32(vmulq_f32(va, va)));
+		float32x4_t r = vrsqrteq_f32(d);
+		r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(d, r), r));
+		vst1q_f32(out, vmulq_f32(va, r));
+	}
+};
+
+#endif
+
+#endif
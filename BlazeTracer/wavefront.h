@@ -0,0 +1,374 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "denoiser.h"
+#include "dispatch.h"
+#include "global_medium.h"
+#include "lights.h"
+#include "material.h"
+#include "sampler.h"
+#include "thread_pool.h"
+
+struct wavefront_settings {
+	// Paths each worker keeps in flight; every stage runs over all of them.
+	int paths_per_worker = 1 << 12;
+	// Shade hits grouped by material kind, and trace extension rays grouped
+	// by direction octant and then by origin along a Morton curve. The
+	// scalar BVH traversal gains less from coherent rays than the sort costs,
+	// so the second is off by default.
+	bool sort_by_material = true;
+	bool sort_rays = false;
+};
+
+// The path tracer as a wavefront (Laine et al., "Megakernels Considered
+// Harmful"): every worker takes a block of pixels, starts all their samples
+// as one wave of paths and advances the whole wave a stage at a time.
+// Extend traces every path's next ray, shade evaluates the hits material by
+// material, scatters and samples lights, connect traces the shadow rays.
+// Each stage is a tight loop over one kind of work, so its code and data
+// stay in cache. The result is ray_color's, including the global medium;
+// path guiding and the radiance cache are not supported.
+//
+// Paths keep their place in their pixel sample's random number stream
+// between stages, so every path draws the same numbers as with ray_color.
+//
+// Experimental: with scalar traversal and shading on the CPU it measures
+// about 1.5x slower than ray_color (Cornell box, 200px, 16 spp), with or
+// without ray sorting and at 2^12 or 2^14 paths per worker. It is kept as
+// the ground for SIMD traversal and shading over sorted streams, not for
+// speed today, and stays opt-in.
+class wavefront_integrator {
+public:
+	wavefront_integrator(const hittable& world, const scene_lights& lights, const global_medium& medium,
+		const camera& cam, const color& background, int image_width, int image_height, int max_depth,
+		sampler_kind sampler_type, const wavefront_settings& settings);
+
+	// Renders samples_per_pixel samples into colors and features as sums,
+	// like thread_trace.
+	void render(int samples_per_pixel, int thread_count, std::vector<std::vector<color>>& colors, feature_buffers& features);
+
+private:
+	// Path states of a wave, one array per field.
+	struct wave {
+		std::vector<ray> rays;
+		std::vector<sampler::position> positions;
+		std::vector<int> depth;          // left, counting down like ray_color's
+		std::vector<uint32_t> pixel;     // row j at j * width
+		std::vector<color> beta;         // throughput up to rays
+		std::vector<color> radiance;     // gathered so far
+		std::vector<real> bsdf_pdf;      // of the bounce that made rays, 0 after specular ones
+		std::vector<real> cone_width;
+		std::vector<unsigned char> hit;
+		std::vector<hit_record> rec;     // what rays hit
+		std::vector<hit_record> from;    // the vertex before, for MIS of emitter hits
+		std::vector<color> bounce_weight;
+		std::vector<unsigned char> alive;
+		std::vector<light_connection> connection;
+		std::vector<unsigned char> connecting;
+
+		// Indices of the paths still going, in the order the next stage
+		// handles them.
+		std::vector<uint32_t> active;
+		std::vector<uint32_t> scratch;
+		std::vector<uint64_t> keys;
+
+		void resize(size_t n);
+	};
+
+	void start(wave& w, sampler& smp, int samples_per_pixel, size_t first_pixel, size_t pixel_count) const;
+	void sort_rays(wave& w) const;
+	void extend(wave& w, sampler& smp) const;
+	void sort_by_material(wave& w) const;
+	void shade(wave& w, sampler& smp, feature_buffers& features) const;
+	void connect(wave& w, sampler& smp) const;
+	void retire(wave& w, std::vector<std::vector<color>>& colors, feature_buffers& features) const;
+
+	const hittable& world;
+	const scene_lights& lights;
+	const global_medium& medium;
+	camera cam;
+	color background;
+	int width, height;
+	int max_depth;
+	sampler_kind sampler_type;
+	wavefront_settings settings;
+	ray_cone cone;
+	aabb bounds;
+};
+
+wavefront_integrator::wavefront_integrator(const hittable& world, const scene_lights& lights, const global_medium& medium,
+	const camera& cam, const color& background, int image_width, int image_height, int max_depth,
+	sampler_kind sampler_type, const wavefront_settings& settings)
+	: world(world), lights(lights), medium(medium), cam(cam), background(background), width(image_width),
+	height(image_height), max_depth(max_depth), sampler_type(sampler_type), settings(settings),
+	cone(cam.pixel_cone(image_height)) {
+	if (!world.bounding_box(cam.time0, cam.time1, bounds))
+		bounds = aabb(point3(-1, -1, -1), point3(1, 1, 1));
+}
+
+void wavefront_integrator::wave::resize(size_t n) {
+	rays.resize(n);
+	positions.resize(n);
+	depth.resize(n);
+	pixel.resize(n);
+	beta.resize(n);
+	radiance.resize(n);
+	bsdf_pdf.resize(n);
+	cone_width.resize(n);
+	hit.resize(n);
+	rec.resize(n);
+	from.resize(n);
+	bounce_weight.resize(n);
+	alive.resize(n);
+	connection.resize(n);
+	connecting.resize(n);
+	active.reserve(n);
+	scratch.reserve(n);
+	keys.reserve(n);
+}
+
+// Camera rays for every sample of pixel_count pixels from first_pixel on.
+void wavefront_integrator::start(wave& w, sampler& smp, int samples_per_pixel, size_t first_pixel, size_t pixel_count) const {
+	w.active.clear();
+	for (size_t k = 0; k < pixel_count * samples_per_pixel; k++) {
+		auto q = static_cast<uint32_t>(first_pixel + k / samples_per_pixel);
+		int x = q % width, y = q / width;
+		smp.start_pixel_sample(x, y, static_cast<int>(k % samples_per_pixel));
+
+		double film_u, film_v, lens_u, lens_v;
+		smp.get_2d(film_u, film_v);
+		smp.get_2d(lens_u, lens_v);
+		auto time_u = smp.get_1d();
+
+		w.rays[k] = cam.get_ray(double(x + film_u) / (width - 1), double(y + film_v) / (height - 1), lens_u, lens_v, time_u);
+		w.positions[k] = smp.save();
+		w.depth[k] = max_depth;
+		w.pixel[k] = q;
+		w.beta[k] = color(1, 1, 1);
+		w.radiance[k] = color(0, 0, 0);
+		w.bsdf_pdf[k] = 0;
+		w.cone_width[k] = cone.width;
+		if (max_depth > 0)
+			w.active.push_back(static_cast<uint32_t>(k));
+	}
+}
+
+// Spreads the 10 low bits of v to every third bit.
+inline uint32_t morton_spread(uint32_t v) {
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+// Keys hold the octant in the top 3 bits, the 30-bit Morton code and then
+// the path index in the low 31 bits.
+void wavefront_integrator::sort_rays(wave& w) const {
+	// The order only matters for speed, so waves too large for the index
+	// bits are left as they are.
+	if (w.rays.size() > (size_t(1) << 31))
+		return;
+
+	auto extent = bounds.max() - bounds.min();
+	w.keys.clear();
+	for (auto i : w.active) {
+		const auto& r = w.rays[i];
+		uint32_t octant = (r.direction().x() < 0) | (r.direction().y() < 0) << 1 | (r.direction().z() < 0) << 2;
+		uint32_t code = 0;
+		for (int a = 0; a < 3; a++) {
+			auto f = extent[a] > 0 ? (r.origin()[a] - bounds.min()[a]) / extent[a] : 0;
+			code |= morton_spread(static_cast<uint32_t>(clamp(f, 0.0, 1.0) * 1023)) << a;
+		}
+		w.keys.push_back(uint64_t(octant) << 61 | uint64_t(code) << 31 | i);
+	}
+	std::sort(w.keys.begin(), w.keys.end());
+	for (size_t k = 0; k < w.keys.size(); k++) {
+		w.active[k] = static_cast<uint32_t>(w.keys[k] & 0x7fffffff);
+	}
+}
+
+void wavefront_integrator::extend(wave& w, sampler& smp) const {
+	for (auto i : w.active) {
+		// Media draw random numbers while being hit, and so does the global
+		// medium.
+		smp.restore(w.positions[i]);
+		const auto& r = w.rays[i];
+		auto& rec = w.rec[i];
+		bool hit = hit_dispatch(world, r, 0.001, infinity, rec);
+		if (medium.active() && medium.sample(r, 0.001, hit ? rec.t : infinity, rec))
+			hit = true;
+		w.hit[i] = hit;
+		w.positions[i] = smp.save();
+	}
+}
+
+// Stable counting sort by material kind, misses first.
+void wavefront_integrator::sort_by_material(wave& w) const {
+	const int buckets = static_cast<int>(material_kind::isotropic) + 2;
+	auto bucket = [&](uint32_t i) {
+		return w.hit[i] ? static_cast<int>(w.rec[i].mat_ptr->kind) + 1 : 0;
+	};
+
+	size_t start[buckets + 1] = {};
+	for (auto i : w.active) start[bucket(i) + 1]++;
+	for (int b = 0; b < buckets; b++) start[b + 1] += start[b];
+
+	w.scratch.resize(w.active.size());
+	for (auto i : w.active) w.scratch[start[bucket(i)]++] = i;
+	std::swap(w.active, w.scratch);
+}
+
+void wavefront_integrator::shade(wave& w, sampler& smp, feature_buffers& features) const {
+	for (auto i : w.active) {
+		smp.restore(w.positions[i]);
+		const auto& r = w.rays[i];
+		auto& rec = w.rec[i];
+		bool first = w.depth[i] == max_depth;
+		int x = w.pixel[i] % width, y = w.pixel[i] / width;
+		w.alive[i] = false;
+		w.connecting[i] = false;
+
+		if (!w.hit[i]) {
+			auto sky = lights.environment ? lights.environment->radiance(r.direction()) : background;
+			if (first)
+				features.albedo[y][x] += color(fmin(sky.x(), 1.0), fmin(sky.y(), 1.0), fmin(sky.z(), 1.0));
+
+			if (lights.environment && w.bsdf_pdf[i] > 0)
+				sky *= power_heuristic(w.bsdf_pdf[i], environment_pdf(lights, r.direction()));
+			w.radiance[i] += w.beta[i] * (lights.environment ? sky : background);
+			w.positions[i] = smp.save();
+			continue;
+		}
+
+		// Texture footprint, as in ray_color.
+		auto distance = rec.t * r.direction().length();
+		auto cone_width = w.cone_width[i] + cone.spread * distance;
+		if (cone_width > 0) {
+			real length_u, length_v;
+			surface_uv_lengths(rec, length_u, length_v);
+			if (length_u > 0 && length_v > 0) {
+				auto cos_theta = fabs(dot(r.direction(), rec.normal)) / r.direction().length();
+				auto footprint = cone_width / fmax(cos_theta, real(0.05));
+				rec.footprint_u = footprint / length_u;
+				rec.footprint_v = footprint / length_v;
+			}
+		}
+
+		if (first) {
+			features.albedo[y][x] += albedo_dispatch(*rec.mat_ptr, rec);
+			features.normal[y][x] += rec.normal;
+		}
+
+		color emitted = emitted_dispatch(*rec.mat_ptr, rec.u, rec.v, rec.p);
+		if (w.bsdf_pdf[i] > 0 && rec.obj && rec.obj->light_index >= 0)
+			emitted *= power_heuristic(w.bsdf_pdf[i], light_pdf(lights, *rec.obj, w.from[i], r.direction()));
+		w.radiance[i] += w.beta[i] * emitted;
+
+		bsdf_sample s;
+		if (!sample_dispatch(*rec.mat_ptr, r, rec, s)) {
+			w.positions[i] = smp.save();
+			continue;
+		}
+		s.scattered.type = s.is_specular ? specular_ray : diffuse_ray;
+
+		bool weighted = !lights.empty() && !s.is_specular;
+		if (weighted)
+			w.connecting[i] = connect_direct_light(lights, r, rec, nullptr, w.connection[i]);
+
+		if (w.depth[i] > 1) {
+			w.alive[i] = true;
+			w.bounce_weight[i] = s.weight;
+			w.rays[i] = s.scattered;
+			w.bsdf_pdf[i] = weighted ? s.pdf : 0;
+			w.cone_width[i] = cone_width;
+			w.depth[i]--;
+			if (weighted)
+				w.from[i] = rec;
+		}
+		w.positions[i] = smp.save();
+	}
+}
+
+void wavefront_integrator::connect(wave& w, sampler& smp) const {
+	for (auto i : w.active) {
+		if (!w.connecting[i]) continue;
+
+		// Shadow rays through media draw random numbers too.
+		smp.restore(w.positions[i]);
+		w.radiance[i] += w.beta[i] * trace_connection(world, w.connection[i], &medium);
+		w.positions[i] = smp.save();
+	}
+}
+
+// Hands finished paths to their pixels and moves the others on.
+void wavefront_integrator::retire(wave& w, std::vector<std::vector<color>>& colors, feature_buffers& features) const {
+	size_t kept = 0;
+	for (auto i : w.active) {
+		if (w.alive[i]) {
+			w.beta[i] *= w.bounce_weight[i];
+			w.active[kept++] = i;
+			continue;
+		}
+
+		int x = w.pixel[i] % width, y = w.pixel[i] / width;
+		const auto& L = w.radiance[i];
+		colors[y][x] += L;
+		features.luminance_squared[y][x] += luminance(L) * luminance(L);
+	}
+	w.active.resize(kept);
+}
+
+void wavefront_integrator::render(int samples_per_pixel, int thread_count, std::vector<std::vector<color>>& colors, feature_buffers& features) {
+	thread_pool pool(thread_count);
+	const size_t pixel_total = size_t(width) * height;
+	const size_t pixels_per_wave = std::max<size_t>(1, settings.paths_per_worker / std::max(samples_per_pixel, 1));
+
+	std::atomic<size_t> next_pixel = 0;
+	std::atomic<uint64_t> extension_rays = 0;
+	for (int t = 0; t < pool.size(); t++) {
+		pool.submit([&] {
+			auto smp = make_sampler(sampler_type, samples_per_pixel, 0);
+			active_sample_source = smp.get();
+			wave w;
+			w.resize(pixels_per_wave * samples_per_pixel);
+			uint64_t traced = 0;
+
+			while (true) {
+				auto first_pixel = next_pixel.fetch_add(pixels_per_wave);
+				if (first_pixel >= pixel_total)
+					break;
+				auto count = std::min(pixels_per_wave, pixel_total - first_pixel);
+
+				start(w, *smp, samples_per_pixel, first_pixel, count);
+				while (!w.active.empty()) {
+					if (settings.sort_rays) sort_rays(w);
+					extend(w, *smp);
+					traced += w.active.size();
+					if (settings.sort_by_material) sort_by_material(w);
+					shade(w, *smp, features);
+					connect(w, *smp);
+					retire(w, colors, features);
+				}
+			}
+
+			extension_rays += traced;
+			active_sample_source = nullptr;
+		});
+	}
+	pool.wait_idle();
+
+	LOG(LOG_TYPE::INFO, "Wavefront: " + std::to_string(extension_rays.load()) + " extension rays in waves of up to "
+		+ std::to_string(pixels_per_wave * samples_per_pixel) + " paths");
+}
+
+#endif